@@ -0,0 +1,381 @@
+#include "bytecode.h"
+#include "source.h"
+#include <cstring>
+#include <fstream>
+#include <system_error>
+#include <type_traits>
+
+using bytecode::ConstantTag;
+
+bool bytecode::isBytecodeFile(const std::filesystem::path &path) {
+  // Sniffing a pipe would consume the program it carries.
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(path, error)) {
+    return false;
+  }
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+template <typename T> void BytecodeWriter::put(std::string &out, T value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+std::string BytecodeWriter::serialize(const ObjFunction *script) {
+  body_.clear();
+  strings_.clear();
+  string_indices_.clear();
+  functions_.clear();
+  function_indices_.clear();
+
+  // Writing a function may discover more; they are appended and written in
+  // turn, so the script stays at index 0.
+  functionIndex(script);
+  for (size_t i = 0; i < functions_.size(); i++) {
+    writeFunction(functions_[i]);
+  }
+
+  std::string out(bytecode::MAGIC, sizeof(bytecode::MAGIC));
+  put(out, bytecode::VERSION);
+  put(out, static_cast<uint32_t>(strings_.size()));
+  for (auto string : strings_) {
+    put(out, static_cast<uint32_t>(string->str.size()));
+    out += string->str;
+  }
+  put(out, static_cast<uint32_t>(functions_.size()));
+  out += body_;
+  return out;
+}
+
+bool BytecodeWriter::write(const ObjFunction *script,
+                           const std::filesystem::path &path) {
+  std::string bytes = serialize(script);
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  return file.write(bytes.data(), bytes.size()) && file.flush();
+}
+
+uint32_t BytecodeWriter::stringIndex(const ObjString *string) {
+  auto [it, inserted] =
+      string_indices_.try_emplace(string, static_cast<uint32_t>(
+                                              strings_.size()));
+  if (inserted) {
+    strings_.push_back(string);
+  }
+  return it->second;
+}
+
+uint32_t BytecodeWriter::functionIndex(const ObjFunction *function) {
+  auto [it, inserted] = function_indices_.try_emplace(
+      function, static_cast<uint32_t>(functions_.size()));
+  if (inserted) {
+    functions_.push_back(function);
+  }
+  return it->second;
+}
+
+void BytecodeWriter::writeFunction(const ObjFunction *function) {
+  put(body_, static_cast<int32_t>(function->arity));
+  put(body_, static_cast<int32_t>(function->upvalue_count));
+  put(body_, function->name != nullptr ? stringIndex(function->name)
+                                       : bytecode::NO_INDEX);
+  put(body_, static_cast<uint8_t>(function->escapes));
+  writeChunk(*function->chunk);
+  // The number chunk only differs from the chunk in its opcodes.
+  put(body_, static_cast<uint8_t>(function->number_chunk != nullptr));
+  if (function->number_chunk != nullptr) {
+    writeCode(function->number_chunk->code);
+  }
+}
+
+void BytecodeWriter::writeChunk(const Chunk &chunk) {
+  writeCode(chunk.code);
+  put(body_, static_cast<uint32_t>(chunk.lines.size()));
+  for (auto [offset, line] : chunk.lines) {
+    put(body_, static_cast<int32_t>(offset));
+    put(body_, static_cast<int32_t>(line));
+  }
+  put(body_, static_cast<uint32_t>(chunk.long_jumps.size()));
+  for (auto jump : chunk.long_jumps) {
+    put(body_, jump);
+  }
+  put(body_, static_cast<uint32_t>(chunk.constants.size()));
+  for (const auto &constant : chunk.constants) {
+    switch (constant.type) {
+    case Value::Type::NIL:
+      put(body_, ConstantTag::NIL);
+      break;
+    case Value::Type::BOOL:
+      put(body_, Value::AsBool(constant) ? ConstantTag::TRUE
+                                         : ConstantTag::FALSE);
+      break;
+    case Value::Type::NUMBER:
+      put(body_, ConstantTag::NUMBER);
+      put(body_, Value::AsNumber(constant));
+      break;
+    case Value::Type::OBJECT:
+      // The compiler only puts strings and functions in the pool.
+      if (obj_helpers::IsString(constant)) {
+        put(body_, ConstantTag::STRING);
+        put(body_, stringIndex(obj_helpers::AsString(constant)));
+      } else {
+        put(body_, ConstantTag::FUNCTION);
+        put(body_, functionIndex(obj_helpers::AsFunction(constant)));
+      }
+      break;
+    }
+  }
+  put(body_, static_cast<uint32_t>(chunk.inlined.size()));
+  for (auto [start, end, line, callee] : chunk.inlined) {
+    put(body_, static_cast<int32_t>(start));
+    put(body_, static_cast<int32_t>(end));
+    put(body_, static_cast<int32_t>(line));
+    put(body_, static_cast<int32_t>(callee));
+  }
+}
+
+void BytecodeWriter::writeCode(const CodeBuffer &code) {
+  put(body_, static_cast<uint32_t>(code.size()));
+  body_.append(reinterpret_cast<const char *>(code.data()), code.size());
+}
+
+std::shared_ptr<ObjFunction>
+BytecodeReader::read(const std::filesystem::path &path) {
+  auto source = Source::map(path);
+  if (source == nullptr) {
+    fail("could not open \"" + path.string() + "\"");
+    return nullptr;
+  }
+  auto bytes = source->text();
+  return read(reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size(),
+              source);
+}
+
+std::shared_ptr<ObjFunction>
+BytecodeReader::read(const uint8_t *data, size_t size,
+                     std::shared_ptr<const void> owner) {
+  owner_ = std::move(owner);
+  error_.clear();
+  cursor_ = data;
+  end_ = data + size;
+  strings_.clear();
+  functions_.clear();
+
+  auto magic = take(sizeof(bytecode::MAGIC));
+  if (magic == nullptr ||
+      std::memcmp(magic, bytecode::MAGIC, sizeof(bytecode::MAGIC)) != 0) {
+    fail("not a .loxc file");
+    return nullptr;
+  }
+  uint32_t version;
+  if (!get(version) || version != bytecode::VERSION) {
+    fail("unsupported format version");
+    return nullptr;
+  }
+
+  uint32_t string_count;
+  if (!get(string_count) || string_count > remaining()) {
+    fail("truncated string table");
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < string_count; i++) {
+    uint32_t length;
+    const uint8_t *chars;
+    if (!get(length) || (chars = take(length)) == nullptr) {
+      fail("truncated string table");
+      return nullptr;
+    }
+    strings_.push_back(
+        ObjString::getObject(reinterpret_cast<const char *>(chars), length));
+  }
+
+  // Functions refer to each other by index, so create them all up front.
+  uint32_t function_count;
+  if (!get(function_count) || function_count == 0 ||
+      function_count > remaining()) {
+    fail("missing function table");
+    return nullptr;
+  }
+  for (uint32_t i = 0; i < function_count; i++) {
+    functions_.push_back(std::make_shared<ObjFunction>(0, nullptr));
+  }
+  for (const auto &function : functions_) {
+    if (!readFunction(function.get())) {
+      return nullptr;
+    }
+  }
+  if (cursor_ != end_) {
+    fail("trailing bytes after the function table");
+    return nullptr;
+  }
+  return functions_.front();
+}
+
+bool BytecodeReader::readFunction(ObjFunction *function) {
+  int32_t arity;
+  int32_t upvalue_count;
+  uint32_t name;
+  uint8_t escapes;
+  uint8_t has_number_chunk;
+  if (!get(arity) || !get(upvalue_count) || !get(name) || !get(escapes)) {
+    fail("truncated function");
+    return false;
+  }
+  // Past these the compiler could not have written the function.
+  if (arity < 0 || arity > UINT8_MAX || upvalue_count < 0 ||
+      upvalue_count > UINT16_MAX ||
+      (name != bytecode::NO_INDEX && name >= strings_.size())) {
+    fail("bad function header");
+    return false;
+  }
+  function->arity = arity;
+  function->upvalue_count = upvalue_count;
+  function->name =
+      name == bytecode::NO_INDEX ? nullptr : strings_[name].get();
+  function->escapes = escapes != 0;
+  if (!readChunk(*function->chunk) || !get(has_number_chunk)) {
+    fail("bad chunk");
+    return false;
+  }
+  if (has_number_chunk) {
+    auto number_chunk = std::make_shared<Chunk>(*function->chunk);
+    if (!readCode(number_chunk->code) ||
+        number_chunk->code.size() != function->chunk->code.size()) {
+      fail("bad number chunk");
+      return false;
+    }
+    function->number_chunk = std::move(number_chunk);
+  }
+  return true;
+}
+
+bool BytecodeReader::readChunk(Chunk &chunk) {
+  uint32_t count;
+  if (!readCode(chunk.code) || !get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t offset;
+    int32_t line;
+    if (!get(offset) || !get(line)) {
+      return false;
+    }
+    // GetLine binary-searches the runs by offset.
+    if (offset < 0 || offset >= chunk.code.size() ||
+        (!chunk.lines.empty() && offset <= chunk.lines.back().offset)) {
+      return false;
+    }
+    chunk.lines.push_back({offset, line});
+  }
+  if (!get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t jump;
+    if (!get(jump)) {
+      return false;
+    }
+    chunk.long_jumps.push_back(jump);
+  }
+  if (!get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (!readConstant(chunk)) {
+      return false;
+    }
+  }
+  if (!get(count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t start;
+    int32_t end;
+    int32_t line;
+    int32_t callee;
+    if (!get(start) || !get(end) || !get(line) || !get(callee)) {
+      return false;
+    }
+    chunk.inlined.push_back({start, end, line, callee});
+  }
+  return true;
+}
+
+bool BytecodeReader::readCode(CodeBuffer &code) {
+  uint32_t size;
+  const uint8_t *bytes;
+  if (!get(size) || (bytes = take(size)) == nullptr) {
+    return false;
+  }
+  code = CodeBuffer(bytes, size, owner_);
+  return true;
+}
+
+bool BytecodeReader::readConstant(Chunk &chunk) {
+  ConstantTag tag;
+  if (!get(tag)) {
+    return false;
+  }
+  Value value;
+  switch (tag) {
+  case ConstantTag::NIL:
+    value = Value::Nil();
+    break;
+  case ConstantTag::FALSE:
+  case ConstantTag::TRUE:
+    value = Value::Bool(tag == ConstantTag::TRUE);
+    break;
+  case ConstantTag::NUMBER: {
+    double number;
+    if (!get(number)) {
+      return false;
+    }
+    value = Value::Number(number);
+    break;
+  }
+  case ConstantTag::STRING:
+  case ConstantTag::FUNCTION: {
+    uint32_t index;
+    if (!get(index)) {
+      return false;
+    }
+    if (tag == ConstantTag::STRING && index < strings_.size()) {
+      value = Value::Object(strings_[index]);
+    } else if (tag == ConstantTag::FUNCTION && index < functions_.size()) {
+      value = Value::Object(functions_[index]);
+    } else {
+      return false;
+    }
+    break;
+  }
+  default:
+    return false;
+  }
+  // Operands index the pool directly, so a constant the pool would merge
+  // with an earlier one means the file was not written by BytecodeWriter.
+  int slot = chunk.constants.size();
+  return chunk.AddConstant(value) == slot;
+}
+
+template <typename T> bool BytecodeReader::get(T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  auto bytes = take(sizeof(value));
+  if (bytes == nullptr) {
+    return false;
+  }
+  std::memcpy(&value, bytes, sizeof(value));
+  return true;
+}
+
+const uint8_t *BytecodeReader::take(size_t count) {
+  if (count > remaining()) {
+    return nullptr;
+  }
+  auto bytes = cursor_;
+  cursor_ += count;
+  return bytes;
+}
+
+void BytecodeReader::fail(const std::string &message) { error_ = message; }
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "chunk.h"
+#include "object.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// On-disk bytecode (.loxc). Layout, numbers in host byte order:
+//   header     "LOXC", u32 version
+//   strings    u32 count, then per string: u32 length, bytes
+//   functions  u32 count, then per function (the script first):
+//              i32 arity, i32 upvalue_count, u32 name string (or NO_INDEX),
+//              u8 escapes, chunk, u8 has_number_chunk [, u32 size, code]
+//   chunk      u32 size, code, u32 run count, (i32 offset, i32 line) runs,
+//              u32 long jump count, u32 offsets, u32 constant count,
+//              constants as a ConstantTag byte plus payload, u32 inlined
+//              run count, (i32 start, i32 end, i32 line, i32 callee) runs
+// Functions and strings are referenced by table index, so a callee shared
+// between a CLOSURE constant and an optimizer guard keeps its identity.
+namespace bytecode {
+inline constexpr char MAGIC[4] = {'L', 'O', 'X', 'C'};
+inline constexpr uint32_t VERSION = 2;
+inline constexpr uint32_t NO_INDEX = UINT32_MAX;
+
+enum class ConstantTag : uint8_t { NIL, FALSE, TRUE, NUMBER, STRING, FUNCTION };
+
+bool isBytecodeFile(const std::filesystem::path &path);
+} // namespace bytecode
+
+class BytecodeWriter {
+public:
+  std::string serialize(const ObjFunction *script);
+  bool write(const ObjFunction *script, const std::filesystem::path &path);
+
+private:
+  uint32_t stringIndex(const ObjString *string);
+  uint32_t functionIndex(const ObjFunction *function);
+  void writeFunction(const ObjFunction *function);
+  void writeChunk(const Chunk &chunk);
+  void writeCode(const CodeBuffer &code);
+  template <typename T> void put(std::string &out, T value);
+
+  std::string body_;
+  std::vector<const ObjString *> strings_;
+  std::unordered_map<const ObjString *, uint32_t> string_indices_;
+  std::vector<const ObjFunction *> functions_;
+  std::unordered_map<const ObjFunction *, uint32_t> function_indices_;
+};
+
+// Loads a .loxc file by mapping it. Chunk code points into the mapping, which
+// stays alive as long as any chunk uses it; constants and line tables are
+// rebuilt on the heap and strings go through the intern table.
+class BytecodeReader {
+public:
+  std::shared_ptr<ObjFunction> read(const std::filesystem::path &path);
+  // Reads from `size` bytes at `data`, which `owner` keeps alive.
+  std::shared_ptr<ObjFunction> read(const uint8_t *data, size_t size,
+                                    std::shared_ptr<const void> owner);
+  // Why the last read returned null.
+  const std::string &error() const { return error_; }
+
+private:
+  bool readFunction(ObjFunction *function);
+  bool readChunk(Chunk &chunk);
+  bool readCode(CodeBuffer &code);
+  bool readConstant(Chunk &chunk);
+  template <typename T> bool get(T &value);
+  const uint8_t *take(size_t count);
+  size_t remaining() const { return end_ - cursor_; }
+  void fail(const std::string &message);
+
+  std::shared_ptr<const void> owner_;
+  const uint8_t *cursor_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  std::vector<std::shared_ptr<ObjString>> strings_;
+  std::vector<std::shared_ptr<ObjFunction>> functions_;
+  std::string error_;
+};
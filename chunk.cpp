@@ -1,13 +1,254 @@
 #include "chunk.h"
+#include "object.h"
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <utility>
+
+CodeBuffer::CodeBuffer(const uint8_t *data, size_t size,
+                       std::shared_ptr<const void> owner)
+    : data_(data), size_(size), owner_(std::move(owner)) {}
+
+CodeBuffer::CodeBuffer(const CodeBuffer &other)
+    : bytes_(other.bytes_), data_(other.data_), size_(other.size_),
+      owner_(other.owner_) {
+  if (owner_ == nullptr) {
+    data_ = bytes_.data();
+  }
+}
+
+CodeBuffer::CodeBuffer(CodeBuffer &&other) noexcept
+    : bytes_(std::move(other.bytes_)), data_(std::exchange(other.data_, {})),
+      size_(std::exchange(other.size_, 0)), owner_(std::move(other.owner_)) {}
+
+CodeBuffer &CodeBuffer::operator=(CodeBuffer other) noexcept {
+  std::swap(bytes_, other.bytes_);
+  std::swap(data_, other.data_);
+  std::swap(size_, other.size_);
+  std::swap(owner_, other.owner_);
+  return *this;
+}
+
+void CodeBuffer::push_back(uint8_t byte) {
+  own();
+  bytes_.push_back(byte);
+  data_ = bytes_.data();
+  size_ = bytes_.size();
+}
+
+void CodeBuffer::clear() {
+  own();
+  bytes_.clear();
+  size_ = 0;
+}
+
+void CodeBuffer::own() {
+  if (owner_ != nullptr) {
+    bytes_.assign(data_, data_ + size_);
+    data_ = bytes_.data();
+    owner_.reset();
+  }
+}
 
 void Chunk::Write(OpCode op, int line) { Write(to_underlying(op), line); }
 
 void Chunk::Write(uint8_t byte, int line) {
   code.push_back(byte);
-  lines.push_back(line);
+  if (lines.empty() || lines.back().line != line) {
+    lines.push_back({static_cast<int>(code.size()) - 1, line});
+  }
+}
+
+int Chunk::GetLine(int offset) const {
+  auto run = std::ranges::upper_bound(lines, offset, {}, &LineRun::offset);
+  return run == lines.begin() ? 0 : std::prev(run)->line;
+}
+
+const InlinedRun *Chunk::GetInlined(int offset) const {
+  auto run = std::ranges::upper_bound(inlined, offset, {}, &InlinedRun::start);
+  if (run == inlined.begin() || offset >= std::prev(run)->end) {
+    return nullptr;
+  }
+  return &*std::prev(run);
 }
 
 int Chunk::AddConstant(Value value) {
+  int slot = constants.size();
+  if (Value::IsNumber(value)) {
+    auto bits = std::bit_cast<uint64_t>(Value::AsNumber(value));
+    auto [it, inserted] = number_slots.try_emplace(bits, slot);
+    if (!inserted) {
+      return it->second;
+    }
+  } else if (Value::IsObject(value)) {
+    auto [it, inserted] =
+        object_slots.try_emplace(Value::AsObject(value), slot);
+    if (!inserted) {
+      return it->second;
+    }
+  }
   constants.push_back(value);
-  return constants.size() - 1;
+  return slot;
+}
+
+int Chunk::InstructionLength(int offset) const {
+  switch (from_uint8(code[offset])) {
+  case OpCode::CONSTANT:
+  case OpCode::DEFINE_GLOBAL:
+  case OpCode::GET_GLOBAL:
+  case OpCode::SET_GLOBAL:
+  case OpCode::GET_LOCAL:
+  case OpCode::SET_LOCAL:
+  case OpCode::CALL:
+  case OpCode::GET_UPVALUE:
+  case OpCode::SET_UPVALUE:
+  case OpCode::CLASS:
+  case OpCode::SET_PROPERTY:
+  case OpCode::GET_PROPERTY:
+  case OpCode::METHOD:
+  case OpCode::GET_SUPER:
+  case OpCode::INLINE_RETURN:
+  case OpCode::IMPORT:
+    return 2;
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP:
+  case OpCode::LOOP:
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::JUMP_LONG:
+  case OpCode::LOOP_LONG:
+  case OpCode::INVOKE:
+  case OpCode::SUPER_INVOKE:
+    return 3;
+  case OpCode::GUARD_CALLEE:
+  case OpCode::GUARD_METHOD:
+  case OpCode::FOR_INCR_LT:
+    return 5;
+  case OpCode::CLOSURE: {
+    auto function = obj_helpers::AsFunction(constants[code[offset + 1]]);
+    return 2 + function->upvalue_count * 2;
+  }
+  case OpCode::WIDE:
+    switch (from_uint8(code[offset + 1])) {
+    case OpCode::INVOKE:
+    case OpCode::SUPER_INVOKE:
+      return 5;
+    case OpCode::CLOSURE: {
+      uint16_t constant = code[offset + 2] << 8 | code[offset + 3];
+      auto function = obj_helpers::AsFunction(constants[constant]);
+      return 4 + function->upvalue_count * 3;
+    }
+    default:
+      return 4;
+    }
+  default:
+    return 1;
+  }
+}
+
+int Chunk::StackEffect(int offset) const {
+  switch (from_uint8(code[offset])) {
+  case OpCode::CONSTANT:
+  case OpCode::NIL:
+  case OpCode::TRUE:
+  case OpCode::FALSE:
+  case OpCode::GET_GLOBAL:
+  case OpCode::GET_LOCAL:
+  case OpCode::GET_UPVALUE:
+  case OpCode::CLOSURE:
+  case OpCode::CLASS:
+    return 1;
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::ADD_NUMBER:
+  case OpCode::SUBTRACT_NUMBER:
+  case OpCode::MULTIPLY_NUMBER:
+  case OpCode::DIVIDE_NUMBER:
+  case OpCode::GREATER_NUMBER:
+  case OpCode::LESS_NUMBER:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::DEFINE_GLOBAL:
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::SET_PROPERTY:
+  case OpCode::METHOD:
+  case OpCode::INHERIT:
+  case OpCode::GET_SUPER:
+  case OpCode::FOR_INCR_LT:
+  case OpCode::RETURN:
+    return -1;
+  case OpCode::CALL:
+  case OpCode::INLINE_RETURN:
+    return -code[offset + 1];
+  case OpCode::INVOKE:
+    return -code[offset + 2];
+  case OpCode::SUPER_INVOKE:
+    return -code[offset + 2] - 1;
+  case OpCode::WIDE:
+    switch (from_uint8(code[offset + 1])) {
+    case OpCode::INVOKE:
+      return -code[offset + 4];
+    case OpCode::SUPER_INVOKE:
+      return -code[offset + 4] - 1;
+    default:
+      return StackEffect(offset + 1);
+    }
+  default:
+    return 0;
+  }
+}
+
+int Chunk::PopCount(int offset) const {
+  switch (from_uint8(code[offset])) {
+  case OpCode::NEGATE:
+  case OpCode::NEGATE_NUMBER:
+  case OpCode::NOT:
+  case OpCode::GET_PROPERTY:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::DEFINE_GLOBAL:
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::METHOD:
+  case OpCode::INHERIT:
+  case OpCode::FOR_INCR_LT:
+    return 1;
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::ADD_NUMBER:
+  case OpCode::SUBTRACT_NUMBER:
+  case OpCode::MULTIPLY_NUMBER:
+  case OpCode::DIVIDE_NUMBER:
+  case OpCode::GREATER_NUMBER:
+  case OpCode::LESS_NUMBER:
+  case OpCode::SET_PROPERTY:
+  case OpCode::GET_SUPER:
+    return 2;
+  case OpCode::CALL:
+  case OpCode::INLINE_RETURN:
+    return code[offset + 1] + 1;
+  case OpCode::INVOKE:
+    return code[offset + 2] + 1;
+  case OpCode::SUPER_INVOKE:
+    return code[offset + 2] + 2;
+  case OpCode::WIDE:
+    switch (from_uint8(code[offset + 1])) {
+    case OpCode::INVOKE:
+      return code[offset + 4] + 1;
+    case OpCode::SUPER_INVOKE:
+      return code[offset + 4] + 2;
+    default:
+      return PopCount(offset + 1);
+    }
+  default:
+    return 0;
+  }
 }
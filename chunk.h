@@ -2,6 +2,10 @@
 
 #include "common.h"
 #include "value.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 enum class OpCode : uint8_t {
@@ -42,6 +46,26 @@ enum class OpCode : uint8_t {
   INHERIT,
   GET_SUPER,
   SUPER_INVOKE,
+  GUARD_CALLEE,
+  GUARD_METHOD,
+  INLINE_RETURN,
+  ADD_NUMBER,
+  SUBTRACT_NUMBER,
+  MULTIPLY_NUMBER,
+  DIVIDE_NUMBER,
+  NEGATE_NUMBER,
+  GREATER_NUMBER,
+  LESS_NUMBER,
+  FOR_INCR_LT,
+  // Prefix: the next instruction's constant, slot and upvalue operands are
+  // two bytes instead of one.
+  WIDE,
+  // Jumps whose 16-bit operand indexes Chunk::long_jumps.
+  JUMP_LONG,
+  JUMP_IF_FALSE_LONG,
+  LOOP_LONG,
+  // Runs a module's top-level code, unless this VM already has.
+  IMPORT,
 };
 
 constexpr uint8_t to_underlying(OpCode op) { return static_cast<uint8_t>(op); }
@@ -50,10 +74,66 @@ constexpr OpCode from_uint8(uint8_t value) {
   return static_cast<OpCode>(value);
 }
 
+// A run of bytecode starting at `offset` that all comes from `line`.
+struct LineRun {
+  int offset;
+  int line;
+};
+
+// Code the optimizer inlined from another function: [start, end) runs the
+// body of the function in constant `callee`, at `line` in its source.
+struct InlinedRun {
+  int start;
+  int end;
+  int line;
+  int callee;
+};
+
+// Bytecode storage. Usually owns its bytes, but can view memory kept alive by
+// `owner` (a mapped .loxc file); the first write then takes a private copy.
+class CodeBuffer {
+public:
+  CodeBuffer() = default;
+  CodeBuffer(const uint8_t *data, size_t size,
+             std::shared_ptr<const void> owner);
+  CodeBuffer(const CodeBuffer &other);
+  CodeBuffer(CodeBuffer &&other) noexcept;
+  CodeBuffer &operator=(CodeBuffer other) noexcept;
+
+  size_t size() const { return size_; }
+  const uint8_t *data() const { return data_; }
+  const uint8_t *begin() const { return data_; }
+  const uint8_t *end() const { return data_ + size_; }
+  uint8_t operator[](size_t index) const { return data_[index]; }
+  uint8_t &operator[](size_t index) {
+    own();
+    return bytes_[index];
+  }
+  void push_back(uint8_t byte);
+  void clear();
+
+private:
+  void own();
+
+  std::vector<uint8_t> bytes_;
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  std::shared_ptr<const void> owner_;
+};
+
 struct Chunk {
-  std::vector<uint8_t> code;
+  CodeBuffer code;
   std::vector<Value> constants;
-  std::vector<int> lines;
+  // Run-length encoded source lines, one entry per change of line.
+  std::vector<LineRun> lines;
+  // Offsets of jumps too far for a 16-bit operand.
+  std::vector<uint32_t> long_jumps;
+  // Inlined code in offset order, so runtime errors can name the callee.
+  std::vector<InlinedRun> inlined;
+  // Pool slots by number bit pattern and by object identity, so that equal
+  // numbers and interned strings share one constant.
+  std::unordered_map<uint64_t, int> number_slots;
+  std::unordered_map<const Obj *, int> object_slots;
 
   Chunk() = default;
   ~Chunk() = default;
@@ -62,4 +142,11 @@ struct Chunk {
   void Write(OpCode op, int line);
 
   int AddConstant(Value value);
+  int GetLine(int offset) const;
+  // The inlined run covering `offset`, or null.
+  const InlinedRun *GetInlined(int offset) const;
+  int InstructionLength(int offset) const;
+  int StackEffect(int offset) const;
+  // Number of values an instruction consumes before pushing its result.
+  int PopCount(int offset) const;
 };
\ No newline at end of file
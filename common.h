@@ -4,5 +4,8 @@
 #include <cstddef>
 #include <cstdint>
 
+// Part of the compile cache key; bump when compiled output changes.
+#define CPPLOX_VERSION "0.2.0"
+
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include "compile_cache.h"
+#include "bytecode.h"
+#include "source.h"
+#include "verifier.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <ostream>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+// 64-bit FNV-1a.
+uint64_t hashBytes(std::string_view bytes, uint64_t hash) {
+  for (unsigned char byte : bytes) {
+    hash ^= byte;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+} // namespace
+
+std::filesystem::path CompileCache::defaultDirectory() {
+  if (const char *cache_home = std::getenv("XDG_CACHE_HOME");
+      cache_home != nullptr && *cache_home != '\0') {
+    return std::filesystem::path(cache_home) / "cpplox";
+  }
+  if (const char *home = std::getenv("HOME");
+      home != nullptr && *home != '\0') {
+    return std::filesystem::path(home) / ".cache" / "cpplox";
+  }
+  return {};
+}
+
+std::filesystem::path
+CompileCache::entryPath(std::string_view source,
+                        CompilerOptions options) const {
+  auto key = std::format("{}/{}/{}", CPPLOX_VERSION, bytecode::VERSION,
+                         options.optimize ? "O" : "");
+  uint64_t hash = hashBytes(key, 0xcbf29ce484222325);
+  hash = hashBytes(source, hash);
+  return directory_ / std::format("{:016x}.loxc", hash);
+}
+
+std::shared_ptr<ObjFunction> CompileCache::load(std::string_view source,
+                                                CompilerOptions options) {
+  if (directory_.empty()) {
+    return nullptr;
+  }
+  auto path = entryPath(source, options);
+  std::error_code error;
+  if (!std::filesystem::exists(path, error)) {
+    return nullptr;
+  }
+  // A corrupt, stale or unverifiable entry is just a miss; the store replaces
+  // it. So is one whose source merely shares the hash.
+  auto entry = Source::map(path);
+  if (entry == nullptr) {
+    return nullptr;
+  }
+  auto bytes = entry->text();
+  uint64_t length;
+  if (bytes.size() < sizeof(length)) {
+    return nullptr;
+  }
+  std::memcpy(&length, bytes.data(), sizeof(length));
+  bytes.remove_prefix(sizeof(length));
+  if (length != source.size() || !bytes.starts_with(source)) {
+    return nullptr;
+  }
+  bytes.remove_prefix(length);
+  auto function =
+      BytecodeReader().read(reinterpret_cast<const uint8_t *>(bytes.data()),
+                            bytes.size(), entry);
+  std::ostream discard(nullptr);
+  if (function == nullptr || !Verifier(discard).verify(function.get())) {
+    return nullptr;
+  }
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), error);
+  return function;
+}
+
+void CompileCache::store(std::string_view source, CompilerOptions options,
+                         const ObjFunction *script) {
+  // Lazy bodies are still source; only fully compiled trees are stored.
+  if (directory_.empty() || options.lazy) {
+    return;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(directory_, error);
+  if (error) {
+    return;
+  }
+
+  // Write aside and rename, so a concurrent run never maps a partial entry.
+  auto path = entryPath(source, options);
+  auto temp = path;
+  temp += std::format(".{}.{}.tmp", getpid(),
+                      std::hash<std::thread::id>()(std::this_thread::get_id()));
+  uint64_t length = source.size();
+  std::string bytes = BytecodeWriter().serialize(script);
+  std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+  file.write(source.data(), source.size());
+  if (!file.write(bytes.data(), bytes.size()) || !file.flush()) {
+    file.close();
+    std::filesystem::remove(temp, error);
+    return;
+  }
+  file.close();
+  std::filesystem::rename(temp, path, error);
+  if (error) {
+    std::filesystem::remove(temp, error);
+    return;
+  }
+  evict();
+}
+
+void CompileCache::evict() {
+  struct Entry {
+    std::filesystem::path path;
+    std::filesystem::file_time_type used;
+    uintmax_t size;
+  };
+  std::vector<Entry> entries;
+  uintmax_t total = 0;
+  std::error_code error;
+  for (const auto &file :
+       std::filesystem::directory_iterator(directory_, error)) {
+    if (file.path().extension() != ".loxc") {
+      continue;
+    }
+    auto size = file.file_size(error);
+    auto used = file.last_write_time(error);
+    if (!error) {
+      entries.push_back({file.path(), used, size});
+      total += size;
+    }
+  }
+
+  std::ranges::sort(entries, {}, &Entry::used);
+  for (const auto &entry : entries) {
+    if (total <= max_bytes_) {
+      break;
+    }
+    if (std::filesystem::remove(entry.path, error)) {
+      total -= entry.size;
+    }
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "compiler.h"
+#include "object.h"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// On-disk cache of compiled scripts in .loxc form. Entries are keyed by a
+// hash of the source, the interpreter version and the compiler options, and
+// the least recently used ones are evicted once the directory outgrows
+// max_bytes. An empty directory disables the cache.
+//
+// Entry layout: u64 source length, the source itself, then the .loxc bytes.
+// The source is compared on load, so a hash collision is only a miss.
+class CompileCache {
+public:
+  static constexpr uintmax_t MAX_BYTES = 64 << 20;
+
+  explicit CompileCache(std::filesystem::path directory,
+                        uintmax_t max_bytes = MAX_BYTES)
+      : directory_(std::move(directory)), max_bytes_(max_bytes) {}
+
+  // $XDG_CACHE_HOME/cpplox, falling back to ~/.cache/cpplox.
+  static std::filesystem::path defaultDirectory();
+
+  std::shared_ptr<ObjFunction> load(std::string_view source,
+                                    CompilerOptions options);
+  void store(std::string_view source, CompilerOptions options,
+             const ObjFunction *script);
+
+private:
+  std::filesystem::path entryPath(std::string_view source,
+                                  CompilerOptions options) const;
+  void evict();
+
+  std::filesystem::path directory_;
+  uintmax_t max_bytes_;
+};
@@ -1,11 +1,15 @@
 #include "compiler.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
+#include <string_view>
 #include <unordered_map>
 
 #include "chunk.h"
 #include "object.h"
+#include "optimizer.h"
 #include "parser.h"
 #include "scanner.h"
 #ifdef DEBUG_PRINT_CODE
@@ -16,11 +20,67 @@ namespace {
 bool identifiersEqual(const Token &a, const Token &b) {
   return a.length == b.length && std::memcmp(a.start, b.start, a.length) == 0;
 }
+
+// Indexed by token type and built at compile time, so compilers on any
+// number of threads share it without initializing anything. Tokens with no
+// entry have no parse functions.
+constexpr auto PARSE_RULES = [] {
+  std::array<ParseRule, static_cast<size_t>(TokenType::END_OF_FILE) + 1>
+      rules{};
+  auto set = [&rules](TokenType type, ParseRule rule) {
+    rules[static_cast<size_t>(type)] = rule;
+  };
+  set(TokenType::LEFT_PAREN, {Compiler::grouping, Compiler::call,
+                              Precedence::CALL});
+  set(TokenType::MINUS, {Compiler::unary, Compiler::binary, Precedence::TERM});
+  set(TokenType::PLUS, {nullptr, Compiler::binary, Precedence::TERM});
+  set(TokenType::STAR, {nullptr, Compiler::binary, Precedence::FACTOR});
+  set(TokenType::SLASH, {nullptr, Compiler::binary, Precedence::FACTOR});
+  set(TokenType::NUMBER, {Compiler::number, nullptr, Precedence::NONE});
+  set(TokenType::FALSE, {Compiler::literal, nullptr, Precedence::NONE});
+  set(TokenType::TRUE, {Compiler::literal, nullptr, Precedence::NONE});
+  set(TokenType::NIL, {Compiler::literal, nullptr, Precedence::NONE});
+  set(TokenType::BANG, {Compiler::unary, nullptr, Precedence::NONE});
+  set(TokenType::BANG_EQUAL,
+      {nullptr, Compiler::binary, Precedence::EQUALITY});
+  set(TokenType::EQUAL_EQUAL,
+      {nullptr, Compiler::binary, Precedence::EQUALITY});
+  set(TokenType::GREATER,
+      {nullptr, Compiler::binary, Precedence::COMPARISON});
+  set(TokenType::GREATER_EQUAL,
+      {nullptr, Compiler::binary, Precedence::COMPARISON});
+  set(TokenType::LESS, {nullptr, Compiler::binary, Precedence::COMPARISON});
+  set(TokenType::LESS_EQUAL,
+      {nullptr, Compiler::binary, Precedence::COMPARISON});
+  set(TokenType::STRING, {Compiler::string, nullptr, Precedence::NONE});
+  set(TokenType::IDENTIFIER, {Compiler::variable, nullptr, Precedence::NONE});
+  set(TokenType::AND, {Compiler::logicalAnd, nullptr, Precedence::AND});
+  set(TokenType::OR, {Compiler::logicalOr, nullptr, Precedence::OR});
+  set(TokenType::DOT, {nullptr, Compiler::dot, Precedence::CALL});
+  set(TokenType::THIS, {Compiler::handleThis, nullptr, Precedence::NONE});
+  set(TokenType::SUPER, {nullptr, Compiler::handleSuper, Precedence::NONE});
+  return rules;
+}();
 } // namespace
 
 std::shared_ptr<ObjFunction> Compiler::compile(const std::string &source) {
+  // Lazy bodies outlive the caller's string, so they need their own copy.
+  if (options_.lazy) {
+    return compile(std::make_shared<const Source>(source));
+  }
+  return compileText(source, 1);
+}
+
+std::shared_ptr<ObjFunction>
+Compiler::compile(std::shared_ptr<const Source> source, int line) {
+  source_ = std::move(source);
+  return compileText(source_->text(), line);
+}
+
+std::shared_ptr<ObjFunction> Compiler::compileText(std::string_view text,
+                                                   int line) {
   // initialization
-  parser_ = std::make_unique<Parser>(source);
+  parser_ = std::make_unique<Parser>(text, 0, line, *options_.errors);
   contexts_.push_back(
       {0, std::make_shared<ObjFunction>(0, nullptr), FunctionType::SCRIPT, {}});
   contexts_.back().locals.push_back(Local{Token::emptyToken(), 0, false});
@@ -33,9 +93,35 @@ std::shared_ptr<ObjFunction> Compiler::compile(const std::string &source) {
   if (parser_->hadError()) {
     return nullptr;
   }
+  if (options_.optimize && !options_.lazy) {
+    Optimizer().optimize(function.get());
+  }
   return function;
 }
 
+bool Compiler::compileLazy(ObjFunction *function) {
+  auto lazy = std::move(function->lazy);
+  source_ = lazy->source;
+  parser_ = std::make_unique<Parser>(source_->text(), lazy->offset,
+                                     lazy->line, *options_.errors);
+  ClassContext class_context{nullptr, lazy->has_superclass};
+  current_class_ = lazy->in_class ? &class_context : nullptr;
+
+  // The function is owned by its enclosing chunk's constants, so the context
+  // gets a non-owning pointer.
+  function->arity = 0;
+  parser_->advance();
+  if (!beginFunction(std::shared_ptr<ObjFunction>(std::shared_ptr<Obj>(),
+                                                  function),
+                     lazy->type)) {
+    return false;
+  }
+  contexts_.back().captures = &lazy->captures;
+  block(this);
+  endCompiler();
+  return !parser_->hadError();
+}
+
 std::shared_ptr<ObjFunction> Compiler::endCompiler() {
   emitReturn();
 #ifdef DEBUG_PRINT_CODE
@@ -44,6 +130,12 @@ std::shared_ptr<ObjFunction> Compiler::endCompiler() {
                                         : "<script>");
 #endif
 
+  // The body's own scope is never ended, so its functions are settled here.
+  for (const auto &local : contexts_.back().locals) {
+    if (local.function != nullptr && !local.closure_escapes) {
+      local.function->escapes = false;
+    }
+  }
   auto function = contexts_.back().function;
   contexts_.pop_back();
   return function;
@@ -76,17 +168,30 @@ void Compiler::emitReturn() {
   emitByte(OpCode::RETURN);
 }
 
+// Emits an instruction with a constant, slot or upvalue index operand, using
+// the WIDE prefix when the index does not fit in a byte.
+void Compiler::emitIndexed(OpCode op, uint16_t index) {
+  if (index > UINT8_MAX) {
+    emitByte(OpCode::WIDE);
+    emitByte(op);
+    emitByte((index >> 8) & 0xFF);
+    emitByte(index & 0xFF);
+    return;
+  }
+  emitBytes(op, static_cast<uint8_t>(index));
+}
+
 void Compiler::emitConstant(Value value) {
-  emitBytes(OpCode::CONSTANT, makeConstant(value));
+  emitIndexed(OpCode::CONSTANT, makeConstant(value));
 }
 
-uint8_t Compiler::makeConstant(Value value) {
+uint16_t Compiler::makeConstant(Value value) {
   auto constantIndex = currentChunk()->AddConstant(value);
-  if (constantIndex >= UINT8_MAX) {
+  if (constantIndex > UINT16_MAX) {
     parser_->error("Too many constants in one chunk.");
     return 0;
   }
-  return static_cast<uint8_t>(constantIndex);
+  return static_cast<uint16_t>(constantIndex);
 }
 
 void Compiler::parsePrecedence(Compiler *compiler, Precedence precedence) {
@@ -120,41 +225,7 @@ void Compiler::parsePrecedence(Compiler *compiler, Precedence precedence) {
 }
 
 const ParseRule *Compiler::getRule(TokenType type) {
-  static std::unordered_map<TokenType, ParseRule> rules = {
-      {TokenType::LEFT_PAREN, {Compiler::grouping, call, Precedence::NONE}},
-      {TokenType::RIGHT_PAREN, {nullptr, nullptr, Precedence::NONE}},
-      {TokenType::MINUS, {Compiler::unary, Compiler::binary, Precedence::TERM}},
-      {TokenType::PLUS, {nullptr, Compiler::binary, Precedence::TERM}},
-      {TokenType::STAR, {nullptr, Compiler::binary, Precedence::FACTOR}},
-      {TokenType::SLASH, {nullptr, Compiler::binary, Precedence::FACTOR}},
-      {TokenType::NUMBER, {Compiler::number, nullptr, Precedence::NONE}},
-      {TokenType::FALSE, {Compiler::literal, nullptr, Precedence::NONE}},
-      {TokenType::TRUE, {Compiler::literal, nullptr, Precedence::NONE}},
-      {TokenType::NIL, {Compiler::literal, nullptr, Precedence::NONE}},
-      {TokenType::END_OF_FILE, {nullptr, nullptr, Precedence::NONE}},
-      {TokenType::BANG, {Compiler::unary, nullptr, Precedence::NONE}},
-      {TokenType::BANG_EQUAL,
-       {nullptr, Compiler::binary, Precedence::EQUALITY}},
-      {TokenType::EQUAL_EQUAL,
-       {nullptr, Compiler::binary, Precedence::EQUALITY}},
-      {TokenType::GREATER, {nullptr, Compiler::binary, Precedence::COMPARISON}},
-      {TokenType::GREATER_EQUAL,
-       {nullptr, Compiler::binary, Precedence::COMPARISON}},
-      {TokenType::LESS, {nullptr, Compiler::binary, Precedence::COMPARISON}},
-      {TokenType::LESS_EQUAL,
-       {nullptr, Compiler::binary, Precedence::COMPARISON}},
-      {TokenType::STRING, {Compiler::string, nullptr, Precedence::NONE}},
-      {TokenType::IDENTIFIER, {Compiler::variable, nullptr, Precedence::NONE}},
-      {TokenType::AND, {Compiler::logicalAnd, nullptr, Precedence::AND}},
-      {TokenType::OR, {Compiler::logicalOr, nullptr, Precedence::OR}},
-      {TokenType::DOT, {nullptr, Compiler::dot, Precedence::CALL}},
-      {TokenType::THIS, {Compiler::handleThis, nullptr, Precedence::NONE}},
-      {TokenType::SUPER, {nullptr, Compiler::handleSuper, Precedence::NONE}}};
-  if (!rules.contains(type)) {
-    throw std::runtime_error("No rule for token type: " +
-                             std::to_string(static_cast<int>(type)));
-  }
-  return &rules[type];
+  return &PARSE_RULES[static_cast<size_t>(type)];
 }
 
 void Compiler::handleThis(Compiler *compiler, bool can_assign) {
@@ -185,11 +256,11 @@ void Compiler::handleSuper(Compiler *compiler, bool can_assign) {
   if (compiler->parser_->match(TokenType::LEFT_PAREN)) {
     auto arg_count = argumentList(compiler);
     namedVariable(compiler, Token::superToken(), false);
-    compiler->emitBytes(OpCode::SUPER_INVOKE, name_constant);
+    compiler->emitIndexed(OpCode::SUPER_INVOKE, name_constant);
     compiler->emitByte(arg_count);
   } else {
     namedVariable(compiler, Token::superToken(), false);
-    compiler->emitBytes(OpCode::GET_SUPER, name_constant);
+    compiler->emitIndexed(OpCode::GET_SUPER, name_constant);
   }
 }
 
@@ -205,13 +276,13 @@ void Compiler::dot(Compiler *compiler, bool can_assign) {
 
   if (can_assign && compiler->parser_->match(TokenType::EQUAL)) {
     expression(compiler);
-    compiler->emitBytes(OpCode::GET_PROPERTY, nameConstant);
+    compiler->emitIndexed(OpCode::SET_PROPERTY, nameConstant);
   } else if (compiler->parser_->match(TokenType::LEFT_PAREN)) {
     auto arg_count = argumentList(compiler);
-    compiler->emitBytes(OpCode::INVOKE, nameConstant);
+    compiler->emitIndexed(OpCode::INVOKE, nameConstant);
     compiler->emitByte(arg_count);
   } else {
-    compiler->emitBytes(OpCode::GET_PROPERTY, nameConstant);
+    compiler->emitIndexed(OpCode::GET_PROPERTY, nameConstant);
   }
 }
 
@@ -261,7 +332,7 @@ void Compiler::binary(Compiler *compiler, bool can_assign) {
     compiler->emitBytes(OpCode::EQUAL, OpCode::NOT);
     break;
   case TokenType::EQUAL_EQUAL:
-    compiler->emitBytes(OpCode::EQUAL, OpCode::EQUAL);
+    compiler->emitByte(OpCode::EQUAL);
     break;
   case TokenType::GREATER:
     compiler->emitByte(OpCode::GREATER);
@@ -328,7 +399,7 @@ void Compiler::classDeclaration(Compiler *compiler) {
       compiler->identifierConstant(compiler->parser_->previous());
 
   declareVariable(compiler);
-  compiler->emitBytes(OpCode::CLASS, nameConstant);
+  compiler->emitIndexed(OpCode::CLASS, nameConstant);
   defineVariable(compiler, nameConstant);
 
   ClassContext class_context;
@@ -385,13 +456,16 @@ void Compiler::method(Compiler *compiler) {
   }
   function(compiler, type);
 
-  compiler->emitBytes(OpCode::METHOD, method_name_constant);
+  compiler->emitIndexed(OpCode::METHOD, method_name_constant);
 }
 
 void Compiler::functionDeclaration(Compiler *compiler) {
   auto global = parseVariable(compiler, "Expect function name.");
   compiler->markInitialized();
-  function(compiler, FunctionType::FUNCTION);
+  auto function = Compiler::function(compiler, FunctionType::FUNCTION);
+  if (compiler->contexts_.back().scope_depth > 0) {
+    compiler->contexts_.back().locals.back().function = function;
+  }
   defineVariable(compiler, global);
 }
 
@@ -416,6 +490,7 @@ uint8_t Compiler::argumentList(Compiler *compiler) {
   uint8_t arg_count = 0;
   if (!compiler->parser_->check(TokenType::RIGHT_PAREN)) {
     do {
+      compiler->argument_start_ = compiler->parser_->current().start;
       expression(compiler);
       if (arg_count == 255) {
         compiler->parser_->error("Can't have more than 255 arguments.");
@@ -429,8 +504,8 @@ uint8_t Compiler::argumentList(Compiler *compiler) {
   return arg_count;
 }
 
-uint8_t Compiler::parseVariable(Compiler *compiler,
-                                const std::string &errorMessage) {
+uint16_t Compiler::parseVariable(Compiler *compiler,
+                                 const std::string &errorMessage) {
   compiler->parser_->consume(TokenType::IDENTIFIER, errorMessage);
   declareVariable(compiler);
   if (compiler->contexts_.back().scope_depth > 0) {
@@ -459,21 +534,21 @@ void Compiler::declareVariable(Compiler *compiler) {
   compiler->addLocal(name);
 }
 
-uint8_t Compiler::identifierConstant(const Token &name) {
+uint16_t Compiler::identifierConstant(const Token &name) {
   return makeConstant(
       Value::Object(ObjString::getObject(name.start, name.length)));
 }
 
-void Compiler::defineVariable(Compiler *compiler, uint8_t global) {
+void Compiler::defineVariable(Compiler *compiler, uint16_t global) {
   if (compiler->contexts_.back().scope_depth > 0) {
     compiler->markInitialized();
     return;
   }
-  compiler->emitBytes(OpCode::DEFINE_GLOBAL, global);
+  compiler->emitIndexed(OpCode::DEFINE_GLOBAL, global);
 }
 
 void Compiler::addLocal(const Token &name) {
-  if (contexts_.back().locals.size() == UINT8_MAX) {
+  if (contexts_.back().locals.size() > UINT16_MAX) {
     parser_->error("Too many local variables in function.");
     return;
   }
@@ -488,57 +563,142 @@ void Compiler::markInitialized() {
   contexts_.back().locals.back().depth = current_context.scope_depth;
 }
 
-void Compiler::function(Compiler *compiler, FunctionType type) {
-  compiler->contexts_.push_back(
-      {0, std::make_shared<ObjFunction>(0, nullptr), type, {}});
-  compiler->contexts_.back().locals.push_back(Local{Token::emptyToken(), 0});
-  compiler->contexts_.back().function->name =
-      ObjString::getObject(compiler->parser_->previous().start,
-                           compiler->parser_->previous().length)
-          .get();
+ObjFunction *Compiler::function(Compiler *compiler, FunctionType type) {
+  auto function = std::make_shared<ObjFunction>(
+      0, ObjString::getObject(compiler->parser_->previous().start,
+                              compiler->parser_->previous().length)
+             .get());
+  const auto &open_paren = compiler->parser_->current();
+  size_t offset = compiler->source_ != nullptr
+                      ? open_paren.start - compiler->source_->text().data()
+                      : 0;
+  int line = open_paren.line;
+  if (!compiler->beginFunction(function, type)) {
+    return nullptr;
+  }
+
+  if (compiler->options_.lazy) {
+    auto lazy = std::make_shared<LazyFunction>(LazyFunction{
+        compiler->source_, offset, line, type,
+        compiler->current_class_ != nullptr,
+        compiler->current_class_ != nullptr &&
+            compiler->current_class_->has_superclass});
+    lazy->captures = compiler->scanCaptures();
+    function->lazy = std::move(lazy);
+  } else {
+    block(compiler);
+  }
+
+  auto upvalues = std::move(compiler->contexts_.back().upvalues);
+  if (function->lazy != nullptr) {
+    compiler->contexts_.pop_back();
+  } else {
+    compiler->endCompiler();
+  }
+  auto constant = compiler->makeConstant(Value::Object(function));
+  // Under WIDE, the upvalue indices are two bytes as well.
+  bool wide = constant > UINT8_MAX ||
+              std::ranges::any_of(upvalues, [](const Upvalue &upvalue) {
+                return upvalue.index > UINT8_MAX;
+              });
+  if (wide) {
+    compiler->emitByte(OpCode::WIDE);
+    compiler->emitByte(OpCode::CLOSURE);
+    compiler->emitByte((constant >> 8) & 0xFF);
+    compiler->emitByte(constant & 0xFF);
+  } else {
+    compiler->emitBytes(OpCode::CLOSURE, static_cast<uint8_t>(constant));
+  }
+  for (int i = 0; i < upvalues.size(); i++) {
+    compiler->emitByte(upvalues[i].is_local ? 1 : 0);
+    if (wide) {
+      compiler->emitByte((upvalues[i].index >> 8) & 0xFF);
+    }
+    compiler->emitByte(upvalues[i].index & 0xFF);
+  }
+  return function.get();
+}
+
+// Pushes a context for `function` and parses its parameters, leaving the
+// parser at the start of the body.
+bool Compiler::beginFunction(std::shared_ptr<ObjFunction> function,
+                             FunctionType type) {
+  contexts_.push_back({0, std::move(function), type, {}});
   auto slot_zero_token =
       type != FunctionType::FUNCTION ? Token::thisToken() : Token::emptyToken();
-  compiler->contexts_.back().locals.push_back(Local{slot_zero_token, 0, false});
+  contexts_.back().locals.push_back(Local{slot_zero_token, 0, false});
 
-  compiler->beginScope(compiler);
+  beginScope(this);
 
-  compiler->parser_->consume(TokenType::LEFT_PAREN,
-                             "Expect '(' after function name.");
+  parser_->consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
 
   // parse parameters
-  if (!compiler->parser_->check(TokenType::RIGHT_PAREN)) {
+  if (!parser_->check(TokenType::RIGHT_PAREN)) {
     do {
-      compiler->contexts_.back().function->arity++;
-      if (compiler->contexts_.back().function->arity > 255) {
-        compiler->parser_->error("Can't have more than 255 parameters.");
-        return;
+      contexts_.back().function->arity++;
+      if (contexts_.back().function->arity > 255) {
+        parser_->error("Can't have more than 255 parameters.");
+        return false;
       }
 
-      uint8_t constant = parseVariable(compiler, "Expect parameter name.");
-      defineVariable(compiler, constant);
-    } while (compiler->parser_->match(TokenType::COMMA));
+      auto constant = parseVariable(this, "Expect parameter name.");
+      defineVariable(this, constant);
+    } while (parser_->match(TokenType::COMMA));
   }
 
-  compiler->parser_->consume(TokenType::RIGHT_PAREN,
-                             "Expect ')' after parameters.");
-
-  compiler->parser_->consume(TokenType::LEFT_BRACE,
-                             "Expect '{' after parameters.");
-  block(compiler);
+  parser_->consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+  parser_->consume(TokenType::LEFT_BRACE, "Expect '{' after parameters.");
+  return true;
+}
 
-  auto function = compiler->endCompiler();
-  compiler->emitBytes(OpCode::CLOSURE,
-                      compiler->makeConstant(Value::Object(function)));
-  const auto &upvalues = compiler->contexts_.back().upvalues;
-  for (int i = 0; i < upvalues.size(); i++) {
-    compiler->emitByte(upvalues[i].is_local ? 1 : 0);
-    compiler->emitByte(upvalues[i].index);
+// Skips a function body in lazy mode, resolving every name it mentions so
+// the enclosing functions capture whatever the body will need. Returns the
+// captured names in upvalue order. A name the body declares itself may be
+// captured needlessly, which only costs an unused upvalue.
+std::vector<std::string> Compiler::scanCaptures() {
+  std::vector<std::string> captures;
+  auto capture = [this, &captures](const Token &name) {
+    auto &context = contexts_.back();
+    if (resolveLocal(context, name) != -1) {
+      return;
+    }
+    size_t count = context.upvalues.size();
+    resolveUpvalue(contexts_.size() - 1, name);
+    if (context.upvalues.size() > count) {
+      captures.emplace_back(name.start, name.length);
+    }
+  };
+
+  int depth = 1;
+  auto previous = TokenType::LEFT_BRACE;
+  while (!parser_->check(TokenType::END_OF_FILE)) {
+    auto token = parser_->current();
+    if (token.type == TokenType::LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TokenType::RIGHT_BRACE && --depth == 0) {
+      parser_->advance();
+      return captures;
+    } else if (token.type == TokenType::IDENTIFIER &&
+               previous != TokenType::DOT) {
+      capture(token);
+    } else if (token.type == TokenType::THIS) {
+      capture(Token::thisToken());
+    } else if (token.type == TokenType::SUPER) {
+      capture(Token::thisToken());
+      capture(Token::superToken());
+    }
+    previous = token.type;
+    parser_->advance();
   }
+  parser_->consume(TokenType::RIGHT_BRACE, "Expect '}' after block.");
+  return captures;
 }
 
 void Compiler::statement(Compiler *compiler) {
   if (compiler->parser_->match(TokenType::PRINT)) {
     printStatement(compiler);
+  } else if (compiler->parser_->match(TokenType::IMPORT)) {
+    importStatement(compiler);
   } else if (compiler->parser_->match(TokenType::IF)) {
     ifStatement(compiler);
   } else if (compiler->parser_->match(TokenType::RETURN)) {
@@ -548,7 +708,9 @@ void Compiler::statement(Compiler *compiler) {
   } else if (compiler->parser_->match(TokenType::FOR)) {
     forStatement(compiler);
   } else if (compiler->parser_->match(TokenType::LEFT_BRACE)) {
+    beginScope(compiler);
     block(compiler);
+    endScope(compiler);
   } else {
     expressionStatement(compiler);
   }
@@ -581,6 +743,11 @@ void Compiler::forStatement(Compiler *compiler) {
     // empty initializer
   } else if (compiler->parser_->match(TokenType::VAR)) {
     varDeclaration(compiler);
+    if (isCountedLoop(compiler)) {
+      countedForLoop(compiler);
+      endScope(compiler);
+      return;
+    }
   } else {
     expressionStatement(compiler);
   }
@@ -640,11 +807,101 @@ void Compiler::whileStatement(Compiler *compiler) {
   compiler->emitByte(OpCode::POP);
 }
 
+// Matches `i < limit; i = i + step)` right after `var i = ...;`, where limit
+// is a number or a variable other than i and step is a number literal.
+bool Compiler::isCountedLoop(Compiler *compiler) {
+  const auto &context = compiler->contexts_.back();
+  if (context.scope_depth == 0 || context.locals.empty()) {
+    return false;
+  }
+  const auto &counter = context.locals.back().name;
+  const auto &parser = *compiler->parser_;
+  if (!parser.check(TokenType::IDENTIFIER) ||
+      !identifiersEqual(parser.current(), counter)) {
+    return false;
+  }
+
+  auto tokens = parser.lookahead(9);
+  auto is = [&tokens](int i, TokenType type) {
+    return tokens[i].type == type;
+  };
+  bool limit_ok = is(1, TokenType::NUMBER) ||
+                  (is(1, TokenType::IDENTIFIER) &&
+                   !identifiersEqual(tokens[1], counter));
+  return is(0, TokenType::LESS) && limit_ok && is(2, TokenType::SEMICOLON) &&
+         is(3, TokenType::IDENTIFIER) && identifiersEqual(tokens[3], counter) &&
+         is(4, TokenType::EQUAL) && is(5, TokenType::IDENTIFIER) &&
+         identifiersEqual(tokens[5], counter) && is(6, TokenType::PLUS) &&
+         is(7, TokenType::NUMBER) && is(8, TokenType::RIGHT_PAREN);
+}
+
+// Counted loop: the condition is compiled as usual for the first check, and
+// the increment, re-check and back edge fold into one FOR_INCR_LT after the
+// body.
+void Compiler::countedForLoop(Compiler *compiler) {
+  auto &parser = *compiler->parser_;
+  auto chunk = compiler->currentChunk();
+  int slot = compiler->contexts_.back().locals.size() - 1;
+
+  int condition_start = chunk->code.size();
+  expression(compiler);
+  parser.consume(TokenType::SEMICOLON, "Expect ';' after for loop condition.");
+  // Bytes loading the limit, between GET_LOCAL i and LESS.
+  int counter_load = slot > UINT8_MAX ? 4 : 2;
+  std::vector<uint8_t> limit_code(
+      chunk->code.begin() + condition_start + counter_load,
+      chunk->code.end() - 1);
+  int exitJump = compiler->emitJump(OpCode::JUMP_IF_FALSE);
+  compiler->emitByte(OpCode::POP);
+
+  // `i = i +`
+  for (int i = 0; i < 4; i++) {
+    parser.advance();
+  }
+  parser.consume(TokenType::NUMBER, "Expect loop step.");
+  auto step = compiler->makeConstant(
+      Value::Number(std::stod(parser.previous().start)));
+  parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  int bodyStart = chunk->code.size();
+  compiler->statement(compiler);
+
+  int offset = chunk->code.size() + limit_code.size() + 5 - bodyStart;
+  if (slot > UINT8_MAX || step > UINT8_MAX || offset > UINT16_MAX) {
+    // Operands do not fit the fused form: increment and loop back to the
+    // condition like any other for loop.
+    compiler->emitIndexed(OpCode::GET_LOCAL, slot);
+    compiler->emitIndexed(OpCode::CONSTANT, step);
+    compiler->emitByte(OpCode::ADD);
+    compiler->emitIndexed(OpCode::SET_LOCAL, slot);
+    compiler->emitByte(OpCode::POP);
+    compiler->emitLoop(condition_start);
+    compiler->patchJump(exitJump);
+    compiler->emitByte(OpCode::POP);
+    return;
+  }
+
+  for (auto byte : limit_code) {
+    compiler->emitByte(byte);
+  }
+  compiler->emitBytes(OpCode::FOR_INCR_LT, static_cast<uint8_t>(slot));
+  compiler->emitByte(static_cast<uint8_t>(step));
+  compiler->emitByte((offset >> 8) & 0xFF);
+  compiler->emitByte(offset & 0xFF);
+
+  int endJump = compiler->emitJump(OpCode::JUMP);
+  compiler->patchJump(exitJump);
+  compiler->emitByte(OpCode::POP);
+  compiler->patchJump(endJump);
+}
+
 void Compiler::emitLoop(int loopStart) {
-  emitByte(OpCode::LOOP);
-  int offset = currentChunk()->code.size() - loopStart + 2;
+  int offset = currentChunk()->code.size() - loopStart + 3;
   if (offset > UINT16_MAX) {
-    parser_->error("Loop body too large.");
+    emitByte(OpCode::LOOP_LONG);
+    offset = addLongJump(offset);
+  } else {
+    emitByte(OpCode::LOOP);
   }
   emitByte((offset >> 8) & 0xFF);
   emitByte(offset & 0xFF);
@@ -682,15 +939,31 @@ int Compiler::emitJump(OpCode op) {
 void Compiler::patchJump(int offset) {
   // -2 to adjust for the bytecode for the jump offset itself.
   int jump = currentChunk()->code.size() - offset - 2;
+  auto &code = currentChunk()->code;
   if (jump > UINT16_MAX) {
-    parser_->error("Too much code to jump over.");
+    // Too far for the operand: switch to the long form, whose operand
+    // indexes the chunk's table of long jump offsets.
+    auto op = from_uint8(code[offset - 1]);
+    code[offset - 1] = to_underlying(op == OpCode::JUMP
+                                         ? OpCode::JUMP_LONG
+                                         : OpCode::JUMP_IF_FALSE_LONG);
+    jump = addLongJump(jump);
   }
 
-  auto &code = currentChunk()->code;
   code[offset] = (jump >> 8) & 0xFF;
   code[offset + 1] = jump & 0xFF;
 }
 
+int Compiler::addLongJump(uint32_t jump) {
+  auto &long_jumps = currentChunk()->long_jumps;
+  if (long_jumps.size() > UINT16_MAX) {
+    parser_->error("Too much code to jump over.");
+    return 0;
+  }
+  long_jumps.push_back(jump);
+  return long_jumps.size() - 1;
+}
+
 void Compiler::logicalAnd(Compiler *compiler, bool can_assign) {
   int endJump = compiler->emitJump(OpCode::JUMP_IF_FALSE);
 
@@ -723,6 +996,21 @@ void Compiler::printStatement(Compiler *compiler) {
   compiler->emitByte(OpCode::PRINT);
 }
 
+void Compiler::importStatement(Compiler *compiler) {
+  // Paths resolve against the directory of the module being run, which the
+  // VM only knows while that module's top-level code runs.
+  if (compiler->contexts_.back().function_type != FunctionType::SCRIPT) {
+    compiler->parser_->error("Can only import from top-level code.");
+  }
+  compiler->parser_->consume(TokenType::STRING, "Expect module path.");
+  auto path = compiler->parser_->previous();
+  auto constant = compiler->makeConstant(
+      Value::Object(ObjString::getObject(path.start + 1, path.length - 2)));
+  compiler->parser_->consume(TokenType::SEMICOLON,
+                             "Expect ';' after module path.");
+  compiler->emitIndexed(OpCode::IMPORT, constant);
+}
+
 void Compiler::synchronize(Compiler *compiler) {
   compiler->parser_->resetPanicMode();
 
@@ -739,6 +1027,7 @@ void Compiler::synchronize(Compiler *compiler) {
     case TokenType::WHILE:
     case TokenType::PRINT:
     case TokenType::RETURN:
+    case TokenType::IMPORT:
       return;
     default:; // do nothing
     }
@@ -784,21 +1073,43 @@ void Compiler::namedVariable(Compiler *compiler, const Token &name,
 
   if (can_assign && compiler->parser_->match(TokenType::EQUAL)) {
     expression(compiler);
-    compiler->emitBytes(setOp, static_cast<uint8_t>(arg));
+    compiler->emitIndexed(setOp, arg);
   } else {
-    compiler->emitBytes(getOp, static_cast<uint8_t>(arg));
+    // Calling the function, or passing it straight to a call, keeps it in
+    // the scope. A callee that stores it only costs the reuse.
+    bool passed = name.start == compiler->argument_start_ &&
+                  (compiler->parser_->check(TokenType::COMMA) ||
+                   compiler->parser_->check(TokenType::RIGHT_PAREN));
+    if (getOp == OpCode::GET_LOCAL &&
+        !compiler->parser_->check(TokenType::LEFT_PAREN) && !passed) {
+      compiler->contexts_.back().locals[arg].closure_escapes = true;
+    }
+    compiler->emitIndexed(getOp, arg);
   }
 }
 
 int Compiler::resolveUpvalue(int contextIdx, const Token &name) {
+  auto &current_context = contexts_[contextIdx];
+  if (current_context.captures != nullptr) {
+    // Lazily compiled body: the enclosing functions are gone, and the
+    // upvalues were fixed when the body was pre-scanned.
+    auto it = std::ranges::find_if(
+        *current_context.captures, [&name](const std::string &capture) {
+          return std::string_view(name.start, name.length) == capture;
+        });
+    return it != current_context.captures->end()
+               ? it - current_context.captures->begin()
+               : -1;
+  }
   if (contextIdx <= 0) {
     return -1;
   }
 
-  auto &current_context = contexts_[contextIdx];
-
   int localIndex = resolveLocal(contexts_[contextIdx - 1], name);
   if (localIndex != -1) {
+    auto &local = contexts_[contextIdx - 1].locals[localIndex];
+    local.is_captured = true;
+    local.closure_escapes = true;
     return addUpvalue(current_context, localIndex, true);
   }
 
@@ -810,7 +1121,7 @@ int Compiler::resolveUpvalue(int contextIdx, const Token &name) {
   return -1;
 }
 
-int Compiler::addUpvalue(CompileContext &context, uint8_t index,
+int Compiler::addUpvalue(CompileContext &context, uint16_t index,
                          bool is_local) {
   auto &upvalues = context.upvalues;
   for (int i = 0; i < upvalues.size(); i++) {
@@ -819,7 +1130,7 @@ int Compiler::addUpvalue(CompileContext &context, uint8_t index,
     }
   }
 
-  if (upvalues.size() == UINT8_MAX) {
+  if (upvalues.size() > UINT16_MAX) {
     parser_->error("Too many upvalues in function.");
     return 0;
   }
@@ -846,11 +1157,15 @@ void Compiler::endScope(Compiler *compiler) {
   current_context.scope_depth--;
   while (current_context.locals.size() > 0 &&
          current_context.locals.back().depth > current_context.scope_depth) {
-    if (current_context.locals.back().is_captured) {
+    const auto &local = current_context.locals.back();
+    if (local.function != nullptr && !local.closure_escapes) {
+      local.function->escapes = false;
+    }
+    if (local.is_captured) {
       compiler->emitByte(OpCode::CLOSE_UPVALUE);
     } else {
       compiler->emitByte(OpCode::POP);
-      current_context.locals.pop_back();
     }
+    current_context.locals.pop_back();
   }
 }
\ No newline at end of file
@@ -4,10 +4,14 @@
 #include "object.h"
 #include "parser.h"
 #include "scanner.h"
+#include "source.h"
 #include <cstdint>
+#include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <sys/types.h>
+#include <vector>
 
 enum class Precedence : uint8_t {
   NONE,
@@ -43,10 +47,15 @@ struct Local {
   Token name;
   int depth;
   bool is_captured;
+  // Function declared into this local, and whether its closure may outlive
+  // the scope: read as a value other than a direct call or a whole call
+  // argument, or captured.
+  ObjFunction *function = nullptr;
+  bool closure_escapes = false;
 };
 
 struct Upvalue {
-  uint8_t index;
+  uint16_t index;
   bool is_local;
 };
 
@@ -56,6 +65,32 @@ struct CompileContext {
   FunctionType function_type;
   std::vector<Local> locals;
   std::vector<Upvalue> upvalues;
+  // Names of the upvalues fixed by the pre-scan, when this is a lazily
+  // compiled function's body.
+  const std::vector<std::string> *captures = nullptr;
+};
+
+// A function whose body has only been pre-scanned: where it starts in the
+// source, and the enclosing variables it captures, in upvalue order.
+struct LazyFunction {
+  std::shared_ptr<const Source> source;
+  size_t offset;
+  int line;
+  FunctionType type;
+  bool in_class;
+  bool has_superclass;
+  std::vector<std::string> captures;
+};
+
+struct CompilerOptions {
+  // Run the optimizing tier over the compiled function tree. Costs extra
+  // compile time, so it is meant for long-running scripts.
+  bool optimize = false;
+  // Compile function bodies on their first call. The optimizer needs the
+  // whole program, so it is skipped in this mode.
+  bool lazy = false;
+  // Where syntax errors are reported.
+  std::ostream *errors = &std::cerr;
 };
 
 struct ClassContext {
@@ -65,7 +100,15 @@ struct ClassContext {
 
 class Compiler {
 public:
+  explicit Compiler(CompilerOptions options = {}) : options_(options) {}
+
   std::shared_ptr<ObjFunction> compile(const std::string &source);
+  // Compiles text whose first line is `line`, keeping `source` alive for as
+  // long as lazy bodies refer to it.
+  std::shared_ptr<ObjFunction> compile(std::shared_ptr<const Source> source,
+                                       int line = 1);
+  // Compiles the body of a function declared in lazy mode.
+  bool compileLazy(ObjFunction *function);
   std::shared_ptr<ObjFunction> endCompiler();
 
   Chunk *currentChunk() { return contexts_.back().function->chunk.get(); }
@@ -75,31 +118,35 @@ public:
   void emitBytes(OpCode op, uint8_t byte);
   void emitBytes(OpCode op1, OpCode op2);
   void emitReturn();
+  void emitIndexed(OpCode op, uint16_t index);
   void emitConstant(Value value);
-  uint8_t makeConstant(Value value);
+  uint16_t makeConstant(Value value);
 
   int emitJump(OpCode op);
   void patchJump(int offset);
+  int addLongJump(uint32_t jump);
   void emitLoop(int loopStart);
 
   void addLocal(const Token &name);
-  uint8_t identifierConstant(const Token &name);
+  uint16_t identifierConstant(const Token &name);
   void markInitialized();
 
   int resolveUpvalue(int contextIdx, const Token &name);
   int resolveLocal(CompileContext &context, const Token &name);
-  int addUpvalue(CompileContext &context, uint8_t index, bool is_local);
+  int addUpvalue(CompileContext &context, uint16_t index, bool is_local);
 
   static void parsePrecedence(Compiler *compiler, Precedence precedence);
   static const ParseRule *getRule(TokenType type);
 
   static void synchronize(Compiler *compiler);
-  static uint8_t parseVariable(Compiler *compiler,
-                               const std::string &errorMessage);
-  static void defineVariable(Compiler *compiler, uint8_t global);
+  static uint16_t parseVariable(Compiler *compiler,
+                                const std::string &errorMessage);
+  static void defineVariable(Compiler *compiler, uint16_t global);
   static void declareVariable(Compiler *compiler);
 
-  static void function(Compiler *compiler, FunctionType type);
+  static ObjFunction *function(Compiler *compiler, FunctionType type);
+  bool beginFunction(std::shared_ptr<ObjFunction> function, FunctionType type);
+  std::vector<std::string> scanCaptures();
   static void call(Compiler *compiler, bool can_assign);
   static uint8_t argumentList(Compiler *compiler);
 
@@ -111,6 +158,7 @@ public:
   static void method(Compiler *compiler);
   static void statement(Compiler *compiler);
   static void printStatement(Compiler *compiler);
+  static void importStatement(Compiler *compiler);
   static void ifStatement(Compiler *compiler);
   static void returnStatement(Compiler *compiler);
   static void expressionStatement(Compiler *compiler);
@@ -132,12 +180,21 @@ public:
   static void logicalOr(Compiler *compiler, bool can_assign);
   static void whileStatement(Compiler *compiler);
   static void forStatement(Compiler *compiler);
+  static bool isCountedLoop(Compiler *compiler);
+  static void countedForLoop(Compiler *compiler);
 
   static void beginScope(Compiler *compiler);
   static void endScope(Compiler *compiler);
 
 private:
+  std::shared_ptr<ObjFunction> compileText(std::string_view text, int line);
+
+  CompilerOptions options_;
   std::vector<CompileContext> contexts_;
   std::unique_ptr<Parser> parser_;
-  ClassContext *current_class_;
+  // Kept alive past compile() for the lazy bodies that still refer to it.
+  std::shared_ptr<const Source> source_;
+  ClassContext *current_class_ = nullptr;
+  // Where the call argument being compiled starts in the source.
+  const char *argument_start_ = nullptr;
 };
@@ -6,134 +6,294 @@
 #include <string_view>
 
 namespace {
-int simpleInstruction(std::string_view name, int offset) {
-  std::cout << std::format("{}\n", name);
+int simpleInstruction(std::string_view name, int offset, std::ostream &out) {
+  out << std::format("{}\n", name);
   return offset + 1;
 }
 
-int constantInstruction(std::string_view name, const Chunk &chunk, int offset) {
+int constantInstruction(std::string_view name, const Chunk &chunk, int offset,
+                        std::ostream &out) {
   uint8_t constant_idx = chunk.code[offset + 1];
-  std::cout << std::format("{:<16} {:>4} '{}' \n", name, constant_idx,
-                           chunk.constants[constant_idx]);
+  out << std::format("{:<16} {:>4} '{}' \n", name, constant_idx,
+                     chunk.constants[constant_idx]);
   return offset + 2;
 }
 
-int byteInstruction(std::string_view name, const Chunk &chunk, int offset) {
+int byteInstruction(std::string_view name, const Chunk &chunk, int offset,
+                    std::ostream &out) {
   uint8_t slot = chunk.code[offset + 1];
-  std::cout << std::format("{:<16} {:>4}\n", name, slot);
+  out << std::format("{:<16} {:>4}\n", name, slot);
   return offset + 2;
 }
 
 int jumpInstruction(std::string_view name, const Chunk &chunk, int sign,
-                    int offset) {
+                    int offset, std::ostream &out) {
   uint16_t jump = static_cast<uint16_t>(chunk.code[offset + 1]) << 8 |
                   (chunk.code[offset + 2]);
-  std::cout << std::format("{:<16} {:>4} -> {}\n", name, offset,
-                           offset + 3 + sign * jump);
+  out << std::format("{:<16} {:>4} -> {}\n", name, offset,
+                     offset + 3 + sign * jump);
   return offset + 3;
 }
 
-int invokeInstruction(std::string_view name, const Chunk &chunk, int offset) {
+int longJumpInstruction(std::string_view name, const Chunk &chunk, int sign,
+                        int offset, std::ostream &out) {
+  uint16_t index = static_cast<uint16_t>(chunk.code[offset + 1]) << 8 |
+                   (chunk.code[offset + 2]);
+  int64_t jump = chunk.long_jumps[index];
+  out << std::format("{:<16} {:>4} -> {}\n", name, offset,
+                     offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+// An instruction after the WIDE prefix, with two-byte index operands.
+int wideInstruction(const Chunk &chunk, int offset, std::ostream &out) {
+  uint16_t index = static_cast<uint16_t>(chunk.code[offset + 2]) << 8 |
+                   (chunk.code[offset + 3]);
+  auto slot = [&](std::string_view name) {
+    out << std::format("{:<16} {:>4}\n", name, index);
+    return offset + 4;
+  };
+  auto constant = [&](std::string_view name) {
+    out << std::format("{:<16} {:>4} '{}' \n", name, index,
+                       chunk.constants[index]);
+    return offset + 4;
+  };
+  auto invoke = [&](std::string_view name) {
+    uint8_t arg_count = chunk.code[offset + 4];
+    out << std::format("{:<16} {:>4} ({}) '{}'\n", name, index, arg_count,
+                       chunk.constants[index]);
+    return offset + 5;
+  };
+
+  switch (from_uint8(chunk.code[offset + 1])) {
+  case OpCode::CONSTANT:
+    return constant("OP_WIDE_CONSTANT");
+  case OpCode::DEFINE_GLOBAL:
+    return constant("OP_WIDE_DEFINE_GLOBAL");
+  case OpCode::GET_GLOBAL:
+    return constant("OP_WIDE_GET_GLOBAL");
+  case OpCode::SET_GLOBAL:
+    return constant("OP_WIDE_SET_GLOBAL");
+  case OpCode::CLASS:
+    return constant("OP_WIDE_CLASS");
+  case OpCode::GET_PROPERTY:
+    return constant("OP_WIDE_GET_PROPERTY");
+  case OpCode::SET_PROPERTY:
+    return constant("OP_WIDE_SET_PROPERTY");
+  case OpCode::METHOD:
+    return constant("OP_WIDE_METHOD");
+  case OpCode::GET_SUPER:
+    return constant("OP_WIDE_GET_SUPER");
+  case OpCode::IMPORT:
+    return constant("OP_WIDE_IMPORT");
+  case OpCode::GET_LOCAL:
+    return slot("OP_WIDE_GET_LOCAL");
+  case OpCode::SET_LOCAL:
+    return slot("OP_WIDE_SET_LOCAL");
+  case OpCode::GET_UPVALUE:
+    return slot("OP_WIDE_GET_UPVALUE");
+  case OpCode::SET_UPVALUE:
+    return slot("OP_WIDE_SET_UPVALUE");
+  case OpCode::INVOKE:
+    return invoke("OP_WIDE_INVOKE");
+  case OpCode::SUPER_INVOKE:
+    return invoke("OP_WIDE_SUPER_INVOKE");
+  case OpCode::CLOSURE: {
+    out << std::format("{:<16} {:>4}\n", "OP_WIDE_CLOSURE", index);
+    out << chunk.constants[index] << std::endl;
+
+    auto function = obj_helpers::AsFunction(chunk.constants[index]);
+    offset += 4;
+    for (int i = 0; i < function->upvalue_count; i++) {
+      int is_local = chunk.code[offset++];
+      int upvalue = chunk.code[offset] << 8 | chunk.code[offset + 1];
+      offset += 2;
+      out << std::format("{:04d}      |                     {} {}\n", offset,
+                         is_local ? "local" : "upvalue", upvalue);
+    }
+    return offset;
+  }
+  default:
+    out << std::format("Unknown wide opcode {}\n", chunk.code[offset + 1]);
+    return offset + 2;
+  }
+}
+
+int invokeInstruction(std::string_view name, const Chunk &chunk, int offset,
+                      std::ostream &out) {
   uint8_t constant_idx = chunk.code[offset + 1];
   uint8_t arg_count = chunk.code[offset + 2];
-  std::cout << std::format("{:<16} {:>4} ({}) '{}'\n", name, constant_idx,
-                           arg_count, chunk.constants[constant_idx]);
+  out << std::format("{:<16} {:>4} ({}) '{}'\n", name, constant_idx, arg_count,
+                     chunk.constants[constant_idx]);
   return offset + 3;
 }
+
+int forIncrInstruction(std::string_view name, const Chunk &chunk, int offset,
+                       std::ostream &out) {
+  uint8_t slot = chunk.code[offset + 1];
+  uint8_t constant_idx = chunk.code[offset + 2];
+  uint16_t jump = static_cast<uint16_t>(chunk.code[offset + 3]) << 8 |
+                  (chunk.code[offset + 4]);
+  out << std::format("{:<16} {:>4} += '{}' -> {}\n", name, slot,
+                     chunk.constants[constant_idx], offset + 5 - jump);
+  return offset + 5;
+}
+
+int guardInstruction(std::string_view name, const Chunk &chunk, int offset,
+                     std::ostream &out) {
+  uint8_t arg_count = chunk.code[offset + 1];
+  uint8_t constant_idx = chunk.code[offset + 2];
+  uint16_t jump = static_cast<uint16_t>(chunk.code[offset + 3]) << 8 |
+                  (chunk.code[offset + 4]);
+  out << std::format("{:<16} {:>4} ({}) '{}' -> {}\n", name, constant_idx,
+                     arg_count, chunk.constants[constant_idx],
+                     offset + 5 + jump);
+  return offset + 5;
+}
 } // namespace
 
-void disassembleChunk(const Chunk &chunk, std::string_view name) {
-  std::cout << std::format("== {} ==\n", name);
+void disassembleChunk(const Chunk &chunk, std::string_view name,
+                      std::ostream &out) {
+  out << std::format("== {} ==\n", name);
 
   for (int offset = 0; offset < chunk.code.size();) {
-    offset = disassembleInstruction(chunk, offset);
+    offset = disassembleInstruction(chunk, offset, out);
   }
 }
 
-int disassembleInstruction(const Chunk &chunk, int offset) {
-  std::cout << std::format("{:04} ", offset);
-  if (offset > 0 && chunk.lines[offset] == chunk.lines[offset - 1]) {
-    std::cout << "   | ";
+int disassembleInstruction(const Chunk &chunk, int offset, std::ostream &out) {
+  out << std::format("{:04} ", offset);
+  int line = chunk.GetLine(offset);
+  if (offset > 0 && line == chunk.GetLine(offset - 1)) {
+    out << "   | ";
   } else {
-    std::cout << std::format("{:4} ", chunk.lines[offset]);
+    out << std::format("{:4} ", line);
   }
 
   uint8_t instruction = chunk.code[offset];
   switch (from_uint8(instruction)) {
   case OpCode::CONSTANT:
-    return constantInstruction("OP_CONSTANT", chunk, offset);
+    return constantInstruction("OP_CONSTANT", chunk, offset, out);
   case OpCode::RETURN:
-    return simpleInstruction("OP_RETURN", offset);
+    return simpleInstruction("OP_RETURN", offset, out);
   case OpCode::NEGATE:
-    return simpleInstruction("OP_NEGATE", offset);
+    return simpleInstruction("OP_NEGATE", offset, out);
+  case OpCode::ADD:
+    return simpleInstruction("OP_ADD", offset, out);
+  case OpCode::SUBTRACT:
+    return simpleInstruction("OP_SUBTRACT", offset, out);
+  case OpCode::MULTIPLY:
+    return simpleInstruction("OP_MULTIPLY", offset, out);
+  case OpCode::DIVIDE:
+    return simpleInstruction("OP_DIVIDE", offset, out);
+  case OpCode::NOT:
+    return simpleInstruction("OP_NOT", offset, out);
+  case OpCode::EQUAL:
+    return simpleInstruction("OP_EQUAL", offset, out);
+  case OpCode::GREATER:
+    return simpleInstruction("OP_GREATER", offset, out);
+  case OpCode::LESS:
+    return simpleInstruction("OP_LESS", offset, out);
   case OpCode::FALSE:
-    return simpleInstruction("OP_FALSE", offset);
+    return simpleInstruction("OP_FALSE", offset, out);
   case OpCode::TRUE:
-    return simpleInstruction("OP_TRUE", offset);
+    return simpleInstruction("OP_TRUE", offset, out);
   case OpCode::NIL:
-    return simpleInstruction("OP_NIL", offset);
+    return simpleInstruction("OP_NIL", offset, out);
   case OpCode::PRINT:
-    return simpleInstruction("OP_PRINT", offset);
+    return simpleInstruction("OP_PRINT", offset, out);
   case OpCode::POP:
-    return simpleInstruction("OP_POP", offset);
+    return simpleInstruction("OP_POP", offset, out);
   case OpCode::DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, out);
   case OpCode::GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return constantInstruction("OP_GET_GLOBAL", chunk, offset, out);
   case OpCode::SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return constantInstruction("OP_SET_GLOBAL", chunk, offset, out);
   case OpCode::GET_LOCAL:
-    return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    return byteInstruction("OP_GET_LOCAL", chunk, offset, out);
   case OpCode::SET_LOCAL:
-    return byteInstruction("OP_SET_LOCAL", chunk, offset);
+    return byteInstruction("OP_SET_LOCAL", chunk, offset, out);
   case OpCode::JUMP_IF_FALSE:
-    return jumpInstruction("OP_JUMP_IF_FALSE", chunk, 1, offset);
+    return jumpInstruction("OP_JUMP_IF_FALSE", chunk, 1, offset, out);
   case OpCode::JUMP:
-    return jumpInstruction("OP_JUMP", chunk, 1, offset);
+    return jumpInstruction("OP_JUMP", chunk, 1, offset, out);
   case OpCode::LOOP:
-    return jumpInstruction("OP_LOOP", chunk, -1, offset);
+    return jumpInstruction("OP_LOOP", chunk, -1, offset, out);
   case OpCode::CALL:
-    return byteInstruction("OP_CALL", chunk, offset);
+    return byteInstruction("OP_CALL", chunk, offset, out);
   case OpCode::CLOSURE: {
     offset++;
     uint8_t constant_idx = chunk.code[offset++];
-    std::cout << std::format("{:<16} {:>4}\n", "OP_CLOSURE", constant_idx);
-    std::cout << chunk.constants[constant_idx] << std::endl;
+    out << std::format("{:<16} {:>4}\n", "OP_CLOSURE", constant_idx);
+    out << chunk.constants[constant_idx] << std::endl;
 
     auto function = obj_helpers::AsFunction(chunk.constants[constant_idx]);
     for (int i = 0; i < function->upvalue_count; i++) {
       int is_local = chunk.code[offset++];
       int index = chunk.code[offset++];
-      std::cout << std::format("{:04d}      |                     {} {}\n",
-                               offset, is_local ? "local" : "upvalue", index);
+      out << std::format("{:04d}      |                     {} {}\n", offset,
+                         is_local ? "local" : "upvalue", index);
     }
 
     return offset;
   }
   case OpCode::CLOSE_UPVALUE:
-    return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+    return simpleInstruction("OP_CLOSE_UPVALUE", offset, out);
   case OpCode::GET_UPVALUE:
-    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+    return byteInstruction("OP_GET_UPVALUE", chunk, offset, out);
   case OpCode::SET_UPVALUE:
-    return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    return byteInstruction("OP_SET_UPVALUE", chunk, offset, out);
   case OpCode::CLASS:
-    return constantInstruction("OP_CLASS", chunk, offset);
+    return constantInstruction("OP_CLASS", chunk, offset, out);
   case OpCode::GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return constantInstruction("OP_GET_PROPERTY", chunk, offset, out);
   case OpCode::SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return constantInstruction("OP_SET_PROPERTY", chunk, offset, out);
   case OpCode::METHOD:
-    return constantInstruction("OP_METHOD", chunk, offset);
+    return constantInstruction("OP_METHOD", chunk, offset, out);
   case OpCode::INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return invokeInstruction("OP_INVOKE", chunk, offset, out);
   case OpCode::INHERIT:
-    return simpleInstruction("OP_INHERIT", offset);
+    return simpleInstruction("OP_INHERIT", offset, out);
   case OpCode::GET_SUPER:
-    return constantInstruction("OP_GET_SUPER", chunk, offset);
+    return constantInstruction("OP_GET_SUPER", chunk, offset, out);
   case OpCode::SUPER_INVOKE:
-    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, out);
+  case OpCode::GUARD_CALLEE:
+    return guardInstruction("OP_GUARD_CALLEE", chunk, offset, out);
+  case OpCode::GUARD_METHOD:
+    return guardInstruction("OP_GUARD_METHOD", chunk, offset, out);
+  case OpCode::INLINE_RETURN:
+    return byteInstruction("OP_INLINE_RETURN", chunk, offset, out);
+  case OpCode::ADD_NUMBER:
+    return simpleInstruction("OP_ADD_NUMBER", offset, out);
+  case OpCode::SUBTRACT_NUMBER:
+    return simpleInstruction("OP_SUBTRACT_NUMBER", offset, out);
+  case OpCode::MULTIPLY_NUMBER:
+    return simpleInstruction("OP_MULTIPLY_NUMBER", offset, out);
+  case OpCode::DIVIDE_NUMBER:
+    return simpleInstruction("OP_DIVIDE_NUMBER", offset, out);
+  case OpCode::NEGATE_NUMBER:
+    return simpleInstruction("OP_NEGATE_NUMBER", offset, out);
+  case OpCode::GREATER_NUMBER:
+    return simpleInstruction("OP_GREATER_NUMBER", offset, out);
+  case OpCode::LESS_NUMBER:
+    return simpleInstruction("OP_LESS_NUMBER", offset, out);
+  case OpCode::FOR_INCR_LT:
+    return forIncrInstruction("OP_FOR_INCR_LT", chunk, offset, out);
+  case OpCode::WIDE:
+    return wideInstruction(chunk, offset, out);
+  case OpCode::JUMP_LONG:
+    return longJumpInstruction("OP_JUMP_LONG", chunk, 1, offset, out);
+  case OpCode::JUMP_IF_FALSE_LONG:
+    return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", chunk, 1, offset, out);
+  case OpCode::LOOP_LONG:
+    return longJumpInstruction("OP_LOOP_LONG", chunk, -1, offset, out);
+  case OpCode::IMPORT:
+    return constantInstruction("OP_IMPORT", chunk, offset, out);
   default:
-    std::cout << std::format("Unknown opcode {}\n", instruction);
+    out << std::format("Unknown opcode {}\n", instruction);
     return offset + 1;
   }
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "chunk.h"
+#include <iostream>
 #include <string_view>
 
-void disassembleChunk(const Chunk &chunk, std::string_view name);
-int disassembleInstruction(const Chunk &chunk, int offset);
\ No newline at end of file
+void disassembleChunk(const Chunk &chunk, std::string_view name,
+                      std::ostream &out = std::cout);
+int disassembleInstruction(const Chunk &chunk, int offset,
+                           std::ostream &out = std::cout);
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "event_loop.h"
+#include "thread_pool.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <iterator>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace {
+// epoll data for the two shared descriptors; wait ids start after them.
+constexpr uint64_t POSTED_ID = 0;
+constexpr uint64_t TIMERS_ID = 1;
+
+ThreadPool &fileReaders() {
+  static ThreadPool pool(2);
+  return pool;
+}
+
+void check(int result, const char *what) {
+  if (result < 0) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+}
+
+// Reads a file epoll can't wait on, such as a regular file or a device,
+// blocking until the end.
+bool readBlocking(const std::filesystem::path &path, std::string &data) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char buffer[64 * 1024];
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (count > 0) {
+      data.append(buffer, count);
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+  close(fd);
+  return count == 0;
+}
+} // namespace
+
+struct EventLoop::Posted {
+  std::mutex mutex;
+  std::vector<Completion> completions;
+  // Weak waits not yet finished.
+  size_t weak_waiting = 0;
+  int event_fd;
+
+  Posted() : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    check(event_fd, "eventfd");
+  }
+  ~Posted() { close(event_fd); }
+
+  void post(Completion completion, bool weak = false) {
+    {
+      std::lock_guard lock(mutex);
+      completions.push_back(std::move(completion));
+      weak_waiting -= weak;
+    }
+    uint64_t one = 1;
+    write(event_fd, &one, sizeof(one));
+  }
+};
+
+EventLoop::EventLoop()
+    : epoll_(epoll_create1(EPOLL_CLOEXEC)),
+      timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      posted_(std::make_shared<Posted>()), next_id_(TIMERS_ID + 1) {
+  check(epoll_, "epoll_create1");
+  check(timer_fd_, "timerfd_create");
+  check(add(posted_->event_fd, POSTED_ID), "epoll_ctl");
+  check(add(timer_fd_, TIMERS_ID), "epoll_ctl");
+}
+
+EventLoop::~EventLoop() {
+  for (auto &[id, read] : reads_) {
+    close(read.fd);
+  }
+  close(timer_fd_);
+  close(epoll_);
+}
+
+uint64_t EventLoop::sleep(std::chrono::milliseconds duration) {
+  uint64_t id = next_id_++;
+  timers_.emplace(Clock::now() + duration, id);
+  if (timers_.top().second == id) {
+    armTimer();
+  }
+  pending_++;
+  return id;
+}
+
+uint64_t EventLoop::readFile(const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  uint64_t id = next_id_++;
+  pending_++;
+  struct stat info;
+  if (fstat(fd, &info) == 0 &&
+      (S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode)) && add(fd, id) == 0) {
+    reads_.emplace(id, Read{fd, {}});
+    return id;
+  }
+  close(fd);
+
+  fileReaders().submit([posted = posted_, id, path] {
+    std::string data;
+    bool ok = readBlocking(path, data);
+    posted->post(Completion{id, ok, std::move(data)});
+  });
+  return id;
+}
+
+std::pair<uint64_t, std::function<void()>> EventLoop::expect(bool weak) {
+  uint64_t id = next_id_++;
+  pending_++;
+  if (weak) {
+    std::lock_guard lock(posted_->mutex);
+    posted_->weak_waiting++;
+  }
+  return {id, [posted = posted_, id, weak] {
+            posted->post(Completion{id, true, {}}, weak);
+          }};
+}
+
+size_t EventLoop::pending() const {
+  std::lock_guard lock(posted_->mutex);
+  return pending_ - posted_->weak_waiting;
+}
+
+int EventLoop::add(int fd, uint64_t id) {
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u64 = id;
+  return epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+}
+
+void EventLoop::armTimer() {
+  // steady_clock is CLOCK_MONOTONIC, so its deadlines arm the timerfd
+  // directly. They are never zero, which would disarm it instead.
+  auto deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      timers_.top().first.time_since_epoch())
+                      .count();
+  itimerspec spec{};
+  spec.it_value.tv_sec = deadline / 1'000'000'000;
+  spec.it_value.tv_nsec = deadline % 1'000'000'000;
+  check(timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr),
+        "timerfd_settime");
+}
+
+void EventLoop::wait(std::vector<Completion> &done) {
+  epoll_event events[64];
+  int count;
+  do {
+    count = epoll_wait(epoll_, events, std::size(events), -1);
+  } while (count < 0 && errno == EINTR);
+  check(count, "epoll_wait");
+
+  for (int i = 0; i < count; i++) {
+    uint64_t id = events[i].data.u64;
+    if (id == TIMERS_ID) {
+      expireTimers(done);
+    } else if (id == POSTED_ID) {
+      uint64_t signals;
+      read(posted_->event_fd, &signals, sizeof(signals));
+      std::lock_guard lock(posted_->mutex);
+      pending_ -= posted_->completions.size();
+      std::move(posted_->completions.begin(), posted_->completions.end(),
+                std::back_inserter(done));
+      posted_->completions.clear();
+    } else {
+      readReady(id, reads_.at(id), done);
+    }
+  }
+}
+
+void EventLoop::expireTimers(std::vector<Completion> &done) {
+  uint64_t expirations;
+  read(timer_fd_, &expirations, sizeof(expirations));
+  auto now = Clock::now();
+  while (!timers_.empty() && timers_.top().first <= now) {
+    done.push_back(Completion{timers_.top().second, true, {}});
+    timers_.pop();
+    pending_--;
+  }
+  if (!timers_.empty()) {
+    armTimer();
+  }
+}
+
+void EventLoop::readReady(uint64_t id, Read &file,
+                          std::vector<Completion> &done) {
+  // Level triggered, so stopping at EAGAIN leaves the rest for the next
+  // wait().
+  char buffer[64 * 1024];
+  while (true) {
+    auto count = read(file.fd, buffer, sizeof(buffer));
+    if (count > 0) {
+      file.data.append(buffer, count);
+    } else if (count == 0) {
+      finishRead(id, true, done);
+      return;
+    } else if (errno == EAGAIN) {
+      return;
+    } else if (errno != EINTR) {
+      finishRead(id, false, done);
+      return;
+    }
+  }
+}
+
+void EventLoop::finishRead(uint64_t id, bool ok,
+                           std::vector<Completion> &done) {
+  auto node = reads_.extract(id);
+  auto &read = node.mapped();
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, read.fd, nullptr);
+  close(read.fd);
+  done.push_back(Completion{id, ok, std::move(read.data)});
+  pending_--;
+}
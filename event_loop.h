@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Waits on timers and file reads for one VM using epoll and timerfd. Each
+// wait gets an id that comes back in a Completion once it finishes, so
+// any number of waits can overlap on the one thread. Timers share a single
+// timerfd armed for the earliest deadline, so they cost no descriptors.
+class EventLoop {
+public:
+  struct Completion {
+    uint64_t id;
+    bool ok;
+    // Everything read, for a read; empty for a timer.
+    std::string data;
+  };
+
+  EventLoop();
+  ~EventLoop();
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  uint64_t sleep(std::chrono::milliseconds duration);
+  // Reads the whole file. Pipes, FIFOs and sockets are read as epoll
+  // reports data. Anything else, such as a regular file, a device or a
+  // directory, is read on a worker thread, and a failed read completes
+  // without ok. Returns 0 if the file cannot be opened.
+  uint64_t readFile(const std::filesystem::path &path);
+
+  // A wait that another thread finishes by calling the returned function.
+  // A weak wait may never be finished, so it only counts as pending once it
+  // is.
+  std::pair<uint64_t, std::function<void()>> expect(bool weak = false);
+
+  // Waits that have finished or are sure to, not counting weak waits still
+  // outstanding.
+  size_t pending() const;
+  // Blocks until at least one wait finishes and appends the finished ones.
+  void wait(std::vector<Completion> &done);
+
+private:
+  using Clock = std::chrono::steady_clock;
+  using Timer = std::pair<Clock::time_point, uint64_t>;
+  struct Read {
+    int fd;
+    std::string data;
+  };
+  // Where worker threads post regular file reads. Shared with the workers
+  // so that a read outliving the loop has somewhere to go.
+  struct Posted;
+
+  int add(int fd, uint64_t id);
+  void armTimer();
+  void expireTimers(std::vector<Completion> &done);
+  void readReady(uint64_t id, Read &file, std::vector<Completion> &done);
+  void finishRead(uint64_t id, bool ok, std::vector<Completion> &done);
+
+  int epoll_;
+  int timer_fd_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers_;
+  std::shared_ptr<Posted> posted_;
+  std::unordered_map<uint64_t, Read> reads_;
+  uint64_t next_id_;
+  size_t pending_ = 0;
+};
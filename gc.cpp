@@ -0,0 +1,309 @@
+#include "gc.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace {
+std::atomic<unsigned> mark_threads = 1;
+
+ThreadPool &markHelpers() {
+  static ThreadPool pool;
+  return pool;
+}
+
+// One collection's marking, shared with the helpers taking part in it. A
+// helper that starts after marking has finished finds nothing to do.
+class Marking {
+public:
+  Marking(size_t threads, uint32_t epoch) : epoch_(epoch), stacks_(threads) {}
+
+  void addRoots(const std::vector<Obj *> &roots);
+  // Marks alongside the other threads until no work is left anywhere.
+  void run(size_t index);
+
+private:
+  // Work a thread has made available to the others. Its owner traces from
+  // a private stack and only moves objects here when it has plenty.
+  struct MarkStack {
+    std::mutex mutex;
+    std::deque<Obj *> objects;
+    std::atomic<size_t> size = 0;
+  };
+  static constexpr size_t SHARE_AT = 256;
+
+  bool mark(Obj *object);
+  void visit(Obj *object, std::vector<Obj *> &stack);
+  void visit(const Value &value, std::vector<Obj *> &stack);
+  void trace(Obj *object, std::vector<Obj *> &stack);
+  void share(size_t index, std::vector<Obj *> &stack);
+  bool refill(size_t index, std::vector<Obj *> &stack);
+
+  uint32_t epoch_;
+  std::vector<MarkStack> stacks_;
+  // Objects in the shared stacks, and threads holding or looking for work.
+  std::atomic<size_t> pending_ = 0;
+  std::atomic<size_t> active_ = 0;
+  std::atomic<bool> finished_ = false;
+};
+
+void Marking::addRoots(const std::vector<Obj *> &roots) {
+  size_t next = 0;
+  for (auto root : roots) {
+    if (root != nullptr && mark(root)) {
+      stacks_[next++ % stacks_.size()].objects.push_back(root);
+    }
+  }
+  for (auto &stack : stacks_) {
+    stack.size = stack.objects.size();
+  }
+  pending_ = next;
+}
+
+bool Marking::mark(Obj *object) {
+  switch (object->type) {
+  case Obj::Type::STRING:
+  case Obj::Type::FUNCTION:
+  case Obj::Type::NATIVE:
+  case Obj::Type::CHANNEL:
+    // Hold no references the collector follows.
+    return false;
+  default:
+    return !object->frozen &&
+           object->mark.exchange(epoch_, std::memory_order_relaxed) != epoch_;
+  }
+}
+
+void Marking::visit(Obj *object, std::vector<Obj *> &stack) {
+  if (object != nullptr && mark(object)) {
+    stack.push_back(object);
+  }
+}
+
+void Marking::visit(const Value &value, std::vector<Obj *> &stack) {
+  if (Value::IsObject(value)) {
+    visit(Value::AsObject(value), stack);
+  }
+}
+
+void Marking::trace(Obj *object, std::vector<Obj *> &stack) {
+  switch (object->type) {
+  case Obj::Type::UPVALUE:
+    visit(static_cast<ObjUpvalue *>(object)->value(), stack);
+    break;
+  case Obj::Type::CLOSURE:
+    for (const auto &upvalue : static_cast<ObjClosure *>(object)->upvalues) {
+      visit(upvalue.get(), stack);
+    }
+    break;
+  case Obj::Type::CLASS:
+    for (const auto &[name, method] :
+         static_cast<ObjClass *>(object)->methods) {
+      visit(method, stack);
+    }
+    break;
+  case Obj::Type::INSTANCE: {
+    auto instance = static_cast<ObjInstance *>(object);
+    visit(instance->klass.get(), stack);
+    for (const auto &[name, field] : instance->fields) {
+      visit(field, stack);
+    }
+    break;
+  }
+  case Obj::Type::BOUND_METHOD: {
+    auto bound = static_cast<ObjBoundMethod *>(object);
+    visit(bound->receiver, stack);
+    visit(bound->method, stack);
+    break;
+  }
+  case Obj::Type::FIBER: {
+    auto fiber = static_cast<ObjFiber *>(object);
+    for (const auto &value : fiber->stack) {
+      visit(value, stack);
+    }
+    for (const auto &frame : fiber->frames) {
+      visit(frame.closure, stack);
+    }
+    for (const auto &upvalue : fiber->open_upvalues) {
+      visit(upvalue.get(), stack);
+    }
+    visit(fiber->resumer.get(), stack);
+    for (const auto &joiner : fiber->joiners) {
+      visit(joiner.get(), stack);
+    }
+    visit(fiber->result, stack);
+    break;
+  }
+  case Obj::Type::ARRAY:
+    for (const auto &item : static_cast<ObjArray *>(object)->items) {
+      visit(item, stack);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void Marking::share(size_t index, std::vector<Obj *> &stack) {
+  // The bottom half: the oldest objects, which tend to lead to the most.
+  auto half = stack.begin() + stack.size() / 2;
+  auto &own = stacks_[index];
+  {
+    std::lock_guard lock(own.mutex);
+    own.objects.insert(own.objects.end(), stack.begin(), half);
+    own.size = own.objects.size();
+  }
+  pending_ += half - stack.begin();
+  stack.erase(stack.begin(), half);
+}
+
+bool Marking::refill(size_t index, std::vector<Obj *> &stack) {
+  for (size_t i = 0; i < stacks_.size(); i++) {
+    auto &victim = stacks_[(index + i) % stacks_.size()];
+    if (victim.size == 0) {
+      continue;
+    }
+    std::lock_guard lock(victim.mutex);
+    // All of its own stack, half of another's.
+    size_t count = i == 0 ? victim.objects.size()
+                          : (victim.objects.size() + 1) / 2;
+    auto end = victim.objects.begin() + count;
+    stack.insert(stack.end(), victim.objects.begin(), end);
+    victim.objects.erase(victim.objects.begin(), end);
+    victim.size = victim.objects.size();
+    pending_ -= count;
+    if (count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Marking::run(size_t index) {
+  std::vector<Obj *> stack;
+  active_++;
+  while (true) {
+    while (!stack.empty()) {
+      auto object = stack.back();
+      stack.pop_back();
+      trace(object, stack);
+      if (stack.size() > SHARE_AT && stacks_.size() > 1 &&
+          stacks_[index].size == 0) {
+        share(index, stack);
+      }
+    }
+    if (refill(index, stack)) {
+      continue;
+    }
+    // Work only appears in a shared stack while some thread is active, so
+    // none active and none shared means marking is over.
+    active_--;
+    while (true) {
+      if (finished_) {
+        return;
+      }
+      if (pending_ > 0) {
+        active_++;
+        break;
+      }
+      if (active_ == 0) {
+        finished_ = true;
+        return;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+
+// Drops the references a garbage object holds. Objects it was the last
+// holder of are freed then, or with the rest of the garbage.
+void clearReferences(Obj &object) {
+  switch (object.type) {
+  case Obj::Type::UPVALUE: {
+    auto &upvalue = static_cast<ObjUpvalue &>(object);
+    if (upvalue.stack_idx < 0) {
+      upvalue.closed = Value::Nil();
+    }
+    break;
+  }
+  case Obj::Type::CLOSURE:
+    for (auto &upvalue : static_cast<ObjClosure &>(object).upvalues) {
+      upvalue.reset();
+    }
+    break;
+  case Obj::Type::CLASS:
+    static_cast<ObjClass &>(object).methods.clear();
+    break;
+  case Obj::Type::INSTANCE:
+    static_cast<ObjInstance &>(object).fields.clear();
+    break;
+  case Obj::Type::BOUND_METHOD:
+    static_cast<ObjBoundMethod &>(object).receiver = Value::Nil();
+    break;
+  case Obj::Type::FIBER: {
+    // Live closures may still use its open upvalues.
+    auto &fiber = static_cast<ObjFiber &>(object);
+    fiber.closeUpvalues();
+    fiber.stack.clear();
+    fiber.frames.clear();
+    fiber.resumer.reset();
+    fiber.joiners.clear();
+    fiber.result = Value::Nil();
+    break;
+  }
+  case Obj::Type::ARRAY:
+    static_cast<ObjArray &>(object).items.clear();
+    break;
+  default:
+    break;
+  }
+}
+} // namespace
+
+void Heap::setMarkThreads(unsigned threads) {
+  mark_threads = std::max(threads, 1u);
+}
+
+size_t Heap::collect(const std::vector<Obj *> &roots) {
+  // Zero is what new objects start with, so no epoch uses it.
+  if (++epoch_ == 0) {
+    epoch_ = 1;
+  }
+  // Without roots, as when a VM goes away, nothing is marked and the
+  // helpers are left alone; they may be gone already at exit.
+  if (!roots.empty()) {
+    unsigned threads = mark_threads;
+    auto marking = std::make_shared<Marking>(threads, epoch_);
+    marking->addRoots(roots);
+    for (unsigned i = 1; i < threads; i++) {
+      markHelpers().submit([marking, i] { marking->run(i); });
+    }
+    marking->run(0);
+  }
+
+  // Held until every reference is cleared, so none is freed while another
+  // is still being cleared.
+  std::vector<std::shared_ptr<Obj>> garbage;
+  std::erase_if(tracked_, [this, &garbage](const std::weak_ptr<Obj> &weak) {
+    auto object = weak.lock();
+    if (object == nullptr) {
+      return true;
+    }
+    if (object->frozen || object->mark == epoch_) {
+      return false;
+    }
+    garbage.push_back(std::move(object));
+    return true;
+  });
+  // Fibers first, since closing their upvalues stores values in them.
+  std::ranges::partition(garbage, [](const std::shared_ptr<Obj> &object) {
+    return object->type == Obj::Type::FIBER;
+  });
+  for (auto &object : garbage) {
+    clearReferences(*object);
+  }
+  next_collection_ = std::max(MIN_COLLECTION, tracked_.size() * 2);
+  return garbage.size();
+}
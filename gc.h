@@ -0,0 +1,49 @@
+#pragma once
+
+#include "object.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Frees the cycles that reference counting leaves behind, like an instance
+// whose field holds a closure over the instance. Every object that can hold
+// references is tracked as it is made. A collection marks what the roots
+// reach and clears the references of tracked objects it did not reach, so
+// the cycles they form come apart.
+//
+// Marking is split over several threads. Each has its own mark stack and
+// steals the oldest half of another's when it runs dry; mark bits are
+// atomic, so an object two threads reach at once is traced once. Frozen
+// objects may be reachable from other VMs, so they are neither traced nor
+// cleared.
+class Heap {
+public:
+  // Threads marking in each collection, the collecting one included.
+  // Defaults to one; helpers start on the first collection that uses them.
+  static void setMarkThreads(unsigned threads);
+
+  Heap() = default;
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  template <typename T, typename... Args>
+  std::shared_ptr<T> make(Args &&...args) {
+    auto object = std::make_shared<T>(std::forward<Args>(args)...);
+    tracked_.push_back(object);
+    return object;
+  }
+
+  // Whether enough objects were made since the last collection.
+  bool due() const { return tracked_.size() >= next_collection_; }
+  // Frees the tracked objects `roots` do not reach. Returns how many.
+  size_t collect(const std::vector<Obj *> &roots);
+
+private:
+  static constexpr size_t MIN_COLLECTION = 1 << 16;
+
+  std::vector<std::weak_ptr<Obj>> tracked_;
+  size_t next_collection_ = MIN_COLLECTION;
+  uint32_t epoch_ = 0;
+};
@@ -0,0 +1,75 @@
+// Collection pauses: gc_bench [max mark threads] [objects]
+// Builds a heap of instances whose fields point at each other, plus arrays
+// holding them, all reachable from a single root, and times collections of
+// it. Nothing is garbage, so each pause is a full mark and a sweep over the
+// tracked objects. Thread counts double up to the maximum (default:
+// hardware threads).
+#include "gc.h"
+#include "intern.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+constexpr int FIELDS = 4;
+constexpr int ROUNDS = 5;
+
+// Returns the root: an array of arrays that together hold every instance.
+std::shared_ptr<ObjArray> buildHeap(Heap &heap, size_t objects) {
+  auto klass = heap.make<ObjClass>(ObjString::getObject("Node").get());
+  std::vector<std::shared_ptr<ObjInstance>> nodes;
+  for (size_t i = 0; i < objects; i++) {
+    nodes.push_back(heap.make<ObjInstance>(klass));
+  }
+  std::mt19937_64 random(42);
+  std::uniform_int_distribution<size_t> pick(0, objects - 1);
+  for (auto &node : nodes) {
+    for (int f = 0; f < FIELDS; f++) {
+      node->fields["f" + std::to_string(f)] =
+          Value::Object(nodes[pick(random)]);
+    }
+  }
+
+  auto root = heap.make<ObjArray>();
+  std::shared_ptr<ObjArray> chunk;
+  for (size_t i = 0; i < objects; i++) {
+    if (i % 1024 == 0) {
+      chunk = heap.make<ObjArray>();
+      root->items.push_back(Value::Object(chunk));
+    }
+    chunk->items.push_back(Value::Object(nodes[i]));
+  }
+  return root;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                                  : std::thread::hardware_concurrency();
+  size_t objects = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1'000'000;
+
+  Heap heap;
+  auto root = buildHeap(heap, std::max<size_t>(objects, 1));
+  std::cout << "threads  pause ms" << std::endl;
+  for (unsigned threads = 1; threads <= std::max(max_threads, 1u);
+       threads *= 2) {
+    Heap::setMarkThreads(threads);
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+      auto start = std::chrono::steady_clock::now();
+      heap.collect({root.get()});
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      if (round == 0 || elapsed.count() < best) {
+        best = elapsed.count();
+      }
+    }
+    std::cout << threads << "\t " << best << std::endl;
+  }
+  heap.collect({});
+  return 0;
+}
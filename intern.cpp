@@ -0,0 +1,90 @@
+#include "intern.h"
+#include <functional>
+#include <limits>
+
+namespace {
+thread_local InternTable *current_table = nullptr;
+} // namespace
+
+InternTable::Slots::Slots(size_t capacity)
+    : mask(capacity - 1),
+      entries(std::make_unique<std::atomic<const Entry *>[]>(capacity)) {}
+
+InternTable::InternTable() {
+  for (auto &shard : shards_) {
+    shard.arrays.push_back(std::make_unique<Slots>(INITIAL_SLOTS));
+    shard.slots.store(shard.arrays.back().get(), std::memory_order_release);
+  }
+}
+
+std::shared_ptr<ObjString> InternTable::intern(std::string_view chars) {
+  size_t hash = std::hash<std::string_view>()(chars);
+  // Low bits pick the slot, so the shard comes from the high ones.
+  auto &shard =
+      shards_[hash >> (std::numeric_limits<size_t>::digits - SHARD_BITS)];
+  if (auto entry =
+          find(*shard.slots.load(std::memory_order_acquire), chars, hash)) {
+    return entry->string;
+  }
+
+  std::lock_guard lock(shard.mutex);
+  auto &slots = *shard.arrays.back();
+  if (auto entry = find(slots, chars, hash)) {
+    return entry->string;
+  }
+  // Keep the load factor at one half so probes stay short.
+  if ((shard.count + 1) * 2 > slots.mask + 1) {
+    grow(shard);
+  }
+  auto &entry =
+      shard.entries.emplace_back(hash, std::make_shared<ObjString>(chars));
+  insert(*shard.arrays.back(), &entry);
+  shard.count++;
+  return entry.string;
+}
+
+const InternTable::Entry *InternTable::find(const Slots &slots,
+                                            std::string_view chars,
+                                            size_t hash) {
+  for (size_t i = hash & slots.mask;; i = (i + 1) & slots.mask) {
+    auto entry = slots.entries[i].load(std::memory_order_acquire);
+    if (entry == nullptr) {
+      return nullptr;
+    }
+    if (entry->hash == hash && entry->string->str == chars) {
+      return entry;
+    }
+  }
+}
+
+void InternTable::insert(Slots &slots, const Entry *entry) {
+  size_t i = entry->hash & slots.mask;
+  while (slots.entries[i].load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & slots.mask;
+  }
+  // Release, so a reader that sees the pointer sees a complete entry.
+  slots.entries[i].store(entry, std::memory_order_release);
+}
+
+void InternTable::grow(Shard &shard) {
+  auto &old_slots = *shard.arrays.back();
+  auto slots = std::make_unique<Slots>((old_slots.mask + 1) * 2);
+  for (size_t i = 0; i <= old_slots.mask; i++) {
+    if (auto entry = old_slots.entries[i].load(std::memory_order_relaxed)) {
+      insert(*slots, entry);
+    }
+  }
+  shard.slots.store(slots.get(), std::memory_order_release);
+  shard.arrays.push_back(std::move(slots));
+}
+
+InternTable &InternTable::current() {
+  static InternTable process_table;
+  return current_table != nullptr ? *current_table : process_table;
+}
+
+InternTable::Scope::Scope(InternTable &table) : previous_(current_table) {
+  current_table = &table;
+}
+
+InternTable::Scope::~Scope() { current_table = previous_; }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "object.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+// Interned strings, safe to share between threads. ObjString::getObject
+// interns into the calling thread's current table: a process-wide one,
+// unless a Scope installed another, as a running VM does.
+//
+// The table is split into shards by hash. Each shard is an open-addressing
+// array of entry pointers that readers probe without locking; only inserts
+// take the shard's lock. A shard that grows publishes a new array and keeps
+// the old one until the table dies, since a reader may still be probing it.
+class InternTable {
+public:
+  InternTable();
+  InternTable(const InternTable &) = delete;
+  InternTable &operator=(const InternTable &) = delete;
+
+  std::shared_ptr<ObjString> intern(std::string_view chars);
+
+  static InternTable &current();
+
+  // Makes `table` the current one on this thread until destroyed.
+  class Scope {
+  public:
+    explicit Scope(InternTable &table);
+    ~Scope();
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    InternTable *previous_;
+  };
+
+private:
+  static constexpr int SHARD_BITS = 5;
+  static constexpr size_t SHARDS = 1 << SHARD_BITS;
+  static constexpr size_t INITIAL_SLOTS = 16;
+
+  struct Entry {
+    size_t hash;
+    std::shared_ptr<ObjString> string;
+  };
+
+  struct Slots {
+    explicit Slots(size_t capacity);
+
+    size_t mask;
+    std::unique_ptr<std::atomic<const Entry *>[]> entries;
+  };
+
+  struct alignas(64) Shard {
+    std::atomic<const Slots *> slots;
+    std::mutex mutex;
+    size_t count = 0;
+    // The live array last; earlier ones may still have readers.
+    std::vector<std::unique_ptr<Slots>> arrays;
+    std::deque<Entry> entries;
+  };
+
+  static const Entry *find(const Slots &slots, std::string_view chars,
+                           size_t hash);
+  static void insert(Slots &slots, const Entry *entry);
+  static void grow(Shard &shard);
+
+  std::array<Shard, SHARDS> shards_;
+};
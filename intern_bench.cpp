@@ -0,0 +1,90 @@
+// Intern throughput: intern_bench [max threads] [operations per thread]
+// Each thread interns a mix of shared hot names (hits after the first round)
+// and strings of its own (misses), against one shared InternTable and, for
+// comparison, a map behind a single mutex. Thread counts double up to the
+// maximum (default: hardware threads).
+#include "intern.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+// What InternTable replaced: one map, one lock.
+class LockedTable {
+public:
+  std::shared_ptr<ObjString> intern(std::string_view chars) {
+    std::lock_guard lock(mutex_);
+    auto it = strings_.find(chars);
+    if (it != strings_.end()) {
+      return it->second;
+    }
+    auto string = std::make_shared<ObjString>(chars);
+    strings_.emplace(string->str, string);
+    return string;
+  }
+
+private:
+  std::mutex mutex_;
+  std::unordered_map<std::string_view, std::shared_ptr<ObjString>> strings_;
+};
+
+// One in MISS_EVERY operations interns a string no one has seen.
+constexpr size_t MISS_EVERY = 16;
+
+std::vector<std::string> hotNames() {
+  std::vector<std::string> names;
+  for (int i = 0; i < 4096; i++) {
+    names.push_back("identifier_" + std::to_string(i * 7919));
+  }
+  return names;
+}
+
+template <typename Table>
+double run(unsigned threads, size_t operations,
+           const std::vector<std::string> &names) {
+  Table table;
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&table, &names, operations, t] {
+      std::string fresh = "t" + std::to_string(t) + "_";
+      for (size_t i = 0; i < operations; i++) {
+        if (i % MISS_EVERY == 0) {
+          table.intern(fresh + std::to_string(i));
+        } else {
+          table.intern(names[(i * 31 + t) % names.size()]);
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return threads * operations / elapsed.count() / 1e6;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                                  : std::thread::hardware_concurrency();
+  size_t operations =
+      argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2'000'000;
+  auto names = hotNames();
+
+  std::cout << "threads  sharded Mops/s  locked Mops/s" << std::endl;
+  for (unsigned threads = 1; threads <= std::max(max_threads, 1u);
+       threads *= 2) {
+    double sharded = run<InternTable>(threads, operations, names);
+    double locked = run<LockedTable>(threads, operations, names);
+    std::cout << threads << "\t " << sharded << "\t\t " << locked
+              << std::endl;
+  }
+  return 0;
+}
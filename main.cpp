@@ -1,73 +1,234 @@
+#include "bytecode.h"
+#include "compile_cache.h"
+#include "compiler.h"
+#include "gc.h"
+#include "module_cache.h"
 #include "vm.h"
+#include "source.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdlib>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 namespace {
-void repl() {
+// One VM serves the whole session, so globals and the functions they hold
+// carry over from line to line. Each entry compiles on its own; input that
+// stops inside a string or bracket continues on the next line.
+void repl(CompilerOptions options) {
+  VM vm(options);
+  std::string pending;
   std::string line;
+  int line_number = 1;
   while (true) {
-    std::cout << "> ";
+    std::cout << (pending.empty() ? "> " : "... ");
     if (!std::getline(std::cin, line)) {
       std::cout << std::endl;
       break;
     }
-    VM vm;
-    vm.interpret(line);
+    pending += line;
+    pending += '\n';
+    if (needsMoreInput(pending)) {
+      continue;
+    }
+    auto source = std::make_shared<const Source>(std::move(pending));
+    pending.clear();
+    auto function = Compiler(options).compile(source, line_number);
+    line_number += std::ranges::count(source->text(), '\n');
+    if (function != nullptr) {
+      vm.interpret(std::move(function));
+    }
   }
 }
 
-std::string readFile(const std::filesystem::path &path) {
-  if (!std::filesystem::exists(path)) {
+// Lazy bodies compile from the text long after the script starts, so in that
+// mode it is copied rather than mapped.
+std::shared_ptr<const Source> openFile(const std::filesystem::path &path,
+                                       CompilerOptions options) {
+  auto source = options.lazy ? Source::read(path) : Source::map(path);
+  if (source == nullptr) {
     std::cerr << "Could not open file \"" << path.string() << "\"" << std::endl;
     std::exit(74);
   }
+  return source;
+}
+
+void exitOnError(InterpretResult result) {
+  if (result == InterpretResult::InterpretCompileError) {
+    std::exit(65);
+  }
+  if (result == InterpretResult::InterpretRuntimeError) {
+    std::exit(70);
+  }
+}
 
-  std::ifstream file(path, std::ios::binary);
-  if (!file) {
+// Returns the exit status, since it may run on a worker thread.
+int compileFile(const std::filesystem::path &path,
+                std::filesystem::path output, CompilerOptions options) {
+  auto source = Source::map(path);
+  if (source == nullptr) {
     std::cerr << "Could not open file \"" << path.string() << "\"" << std::endl;
-    std::exit(74);
+    return 74;
+  }
+  Compiler compiler(options);
+  auto function = compiler.compile(source);
+  if (function == nullptr) {
+    return 65;
   }
 
-  // Get file size
-  file.seekg(0, std::ios::end);
-  const auto file_size = file.tellg();
-  file.seekg(0, std::ios::beg);
+  if (output.empty()) {
+    output = path;
+    output.replace_extension(".loxc");
+  }
+  if (!BytecodeWriter().write(function.get(), output)) {
+    std::cerr << "Could not write file \"" << output.string() << "\""
+              << std::endl;
+    return 74;
+  }
+  return 0;
+}
 
-  // Read file
-  std::string content(file_size, '\0');
-  if (!file.read(content.data(), file_size)) {
-    std::cerr << "Could not read file \"" << path.string() << "\"" << std::endl;
-    std::exit(74);
+// Compiles each file to its own .loxc, one task per file.
+void compileFiles(const std::vector<std::string_view> &paths,
+                  CompilerOptions options) {
+  std::atomic<int> status = 0;
+  {
+    ThreadPool pool(std::min<size_t>(paths.size(),
+                                     std::thread::hardware_concurrency()));
+    for (auto path : paths) {
+      pool.submit([path, options, &status] {
+        if (int result = compileFile(path, {}, options); result != 0) {
+          status = result;
+        }
+      });
+    }
+  }
+  if (status != 0) {
+    std::exit(status);
   }
+}
 
-  return content;
+void runFile(const std::filesystem::path &path, CompilerOptions options) {
+  VM vm(options);
+  InterpretResult result;
+  if (bytecode::isBytecodeFile(path)) {
+    BytecodeReader reader;
+    auto function = reader.read(path);
+    if (function == nullptr) {
+      std::cerr << "Could not load bytecode: " << reader.error() << std::endl;
+      std::exit(65);
+    }
+    result = vm.interpret(std::move(function), path.parent_path());
+  } else {
+    auto source = openFile(path, options);
+    CompileCache cache(CompileCache::defaultDirectory());
+    auto function = cache.load(source->text(), options);
+    if (function == nullptr) {
+      function = Compiler(options).compile(source);
+      if (function == nullptr) {
+        std::exit(65);
+      }
+      cache.store(source->text(), options, function.get());
+    }
+    ModuleCache::instance().preload(source->text(), path.parent_path(),
+                                    options);
+    result = vm.interpret(std::move(function), path.parent_path());
+  }
+  exitOnError(result);
 }
 
-void runFile(const std::filesystem::path &path) {
-  std::string source = readFile(path);
-  VM vm;
-  InterpretResult result = vm.interpret(source);
+// Runs a program from standard input as it arrives: each read's worth of
+// whole top-level declarations is compiled and run at once, in one VM so
+// that globals carry over.
+void runStream(CompilerOptions options) {
+  VM vm(options);
+  std::string pending;
+  int line = 1;
+  char buffer[1 << 16];
+  bool at_end = false;
+  while (!at_end) {
+    ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      std::cerr << "Could not read standard input" << std::endl;
+      std::exit(74);
+    }
+    at_end = count == 0;
+    pending.append(buffer, count);
 
-  if (result == InterpretResult::InterpretCompileError) {
-    std::exit(65);
-  }
-  if (result == InterpretResult::InterpretRuntimeError) {
-    std::exit(70);
+    size_t length = completeDeclarations(pending, at_end);
+    if (length == 0) {
+      continue;
+    }
+    auto source = std::make_shared<const Source>(pending.substr(0, length));
+    pending.erase(0, length);
+    auto function = Compiler(options).compile(source, line);
+    line += std::ranges::count(source->text(), '\n');
+    if (function == nullptr) {
+      std::exit(65);
+    }
+    exitOnError(vm.interpret(std::move(function)));
   }
 }
 } // namespace
 
 int main(int argc, char **argv) {
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  CompilerOptions options;
+  bool compile = false;
+  std::filesystem::path output;
+  std::vector<std::string_view> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (arg == "--optimize") {
+      options.optimize = true;
+    } else if (arg == "--lazy") {
+      options.lazy = true;
+    } else if (arg == "--gc-threads" && i + 1 < argc) {
+      Heap::setMarkThreads(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--compile") {
+      compile = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      paths.push_back(arg);
+    }
+  }
+
+  // A .loxc file holds bytecode only, so every body is compiled up front.
+  if (compile && paths.size() == 1) {
+    options.lazy = false;
+    if (int status = compileFile(paths[0], output, options); status != 0) {
+      std::exit(status);
+    }
+  } else if (compile && !paths.empty() && output.empty()) {
+    options.lazy = false;
+    compileFiles(paths, options);
+  } else if (compile) {
+    std::cout << "Usage: cpplox [--optimize] --compile path [-o output]\n"
+              << "       cpplox [--optimize] --compile path..." << std::endl;
+    std::exit(64);
+  } else if ((paths.empty() && !isatty(STDIN_FILENO)) ||
+             (paths.size() == 1 && paths[0] == "-")) {
+    runStream(options);
+  } else if (paths.empty()) {
+    repl(options);
+  } else if (paths.size() == 1) {
+    runFile(paths[0], options);
   } else {
-    std::cout << "Usage: cpplox [path]" << std::endl;
+    std::cout << "Usage: cpplox [--optimize | --lazy] [--gc-threads n] "
+                 "[path | -]"
+              << std::endl;
     std::exit(64);
   }
   return 0;
-}
+}
\ No newline at end of file
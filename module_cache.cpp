@@ -0,0 +1,129 @@
+#include "module_cache.h"
+#include "compile_cache.h"
+#include "intern.h"
+#include "scanner.h"
+#include "thread_pool.h"
+#include "verifier.h"
+#include <deque>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <unordered_set>
+
+ModuleCache &ModuleCache::instance() {
+  static ModuleCache cache;
+  return cache;
+}
+
+ModuleCache::Compiled
+ModuleCache::load(const std::filesystem::path &path, CompilerOptions options) {
+  std::promise<Compiled> promise;
+  std::shared_future<Compiled> pending;
+  {
+    std::lock_guard lock(mutex_);
+    auto [it, inserted] = modules_.try_emplace(path.string());
+    if (inserted) {
+      it->second = promise.get_future().share();
+    } else {
+      pending = it->second;
+    }
+  }
+  if (pending.valid()) {
+    return pending.get();
+  }
+
+  Compiled compiled;
+  if (auto source = Source::map(path); source != nullptr) {
+    InternTable::Scope strings(strings_);
+    compiled = compile(std::move(source), options);
+  }
+  if (compiled.module == nullptr) {
+    std::lock_guard lock(mutex_);
+    modules_.erase(path.string());
+  }
+  promise.set_value(compiled);
+  return compiled;
+}
+
+ModuleCache::Compiled
+ModuleCache::compile(std::shared_ptr<const Source> source,
+                     CompilerOptions options) {
+  // Errors go back to each importer, which reports them on its own stream.
+  std::ostringstream errors;
+  options.lazy = false;
+  options.errors = &errors;
+  CompileCache cache(CompileCache::defaultDirectory());
+  auto module = cache.load(source->text(), options);
+  if (module == nullptr) {
+    module = Compiler(options).compile(source);
+    if (module == nullptr) {
+      return {nullptr, errors.str()};
+    }
+    cache.store(source->text(), options, module.get());
+  }
+  if (!Verifier(errors).verify(module.get())) {
+    return {nullptr, errors.str()};
+  }
+  return {std::move(module), {}};
+}
+
+void ModuleCache::preload(std::string_view source,
+                          const std::filesystem::path &directory,
+                          CompilerOptions options) {
+  struct Unit {
+    std::filesystem::path path;
+    std::shared_ptr<ObjFunction> module;
+  };
+  if (importPaths(source).empty()) {
+    return;
+  }
+  std::deque<Unit> units;
+  std::unordered_set<std::string> queued;
+  std::mutex units_mutex;
+  ThreadPool pool;
+
+  std::function<void(std::string_view, const std::filesystem::path &)>
+      enqueue_imports = [&](std::string_view text,
+                            const std::filesystem::path &from) {
+        for (auto name : importPaths(text)) {
+          std::error_code error;
+          auto path = std::filesystem::weakly_canonical(from / name, error);
+          std::lock_guard lock(units_mutex);
+          if (error || !queued.insert(path.string()).second) {
+            continue;
+          }
+          auto &unit = units.emplace_back(Unit{path, nullptr});
+          pool.submit([&unit, &enqueue_imports, options, this] {
+            auto source = Source::map(unit.path);
+            if (source == nullptr) {
+              return;
+            }
+            enqueue_imports(source->text(), unit.path.parent_path());
+            // Tasks intern straight into the cache's table, which is safe
+            // to share between threads.
+            InternTable::Scope strings(strings_);
+            unit.module = compile(std::move(source), options).module;
+          });
+        }
+      };
+
+  {
+    std::lock_guard lock(mutex_);
+    for (const auto &[path, module] : modules_) {
+      queued.insert(path);
+    }
+  }
+  enqueue_imports(source, directory);
+  pool.wait();
+
+  // Failures are left for the import to retry and report.
+  std::lock_guard lock(mutex_);
+  for (auto &unit : units) {
+    if (unit.module == nullptr) {
+      continue;
+    }
+    std::promise<Compiled> ready;
+    ready.set_value({std::move(unit.module), {}});
+    modules_.try_emplace(unit.path.string(), ready.get_future().share());
+  }
+}
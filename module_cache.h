@@ -0,0 +1,50 @@
+#pragma once
+
+#include "compiler.h"
+#include "intern.h"
+#include "object.h"
+#include "source.h"
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Compiled modules, shared by every VM in the process and keyed by canonical
+// path, so a file is compiled once however often it is imported. Running a
+// module's top-level code is up to each VM. Since VMs on other threads may
+// share a module, it is compiled in full up front and never changes after,
+// and its strings live in the cache's own intern table.
+class ModuleCache {
+public:
+  // A verified module, or null and the errors that kept it from compiling.
+  // Both are empty when the file can't be read.
+  struct Compiled {
+    std::shared_ptr<ObjFunction> module;
+    std::string errors;
+  };
+
+  static ModuleCache &instance();
+
+  // The module at canonical `path`, compiled with the options of its first
+  // import. Imports of a path that is still compiling wait for that compile
+  // and see its result. A failure is not kept, so a later import retries.
+  Compiled load(const std::filesystem::path &path, CompilerOptions options);
+
+  // Compiles everything `source` imports, directly or not, on a thread pool
+  // so that the imports themselves find their modules ready. Relative paths
+  // resolve against `directory`.
+  void preload(std::string_view source, const std::filesystem::path &directory,
+               CompilerOptions options);
+
+private:
+  Compiled compile(std::shared_ptr<const Source> source,
+                   CompilerOptions options);
+
+  // Guards the map only; compiles run outside it.
+  std::mutex mutex_;
+  InternTable strings_;
+  std::unordered_map<std::string, std::shared_future<Compiled>> modules_;
+};
@@ -1,7 +1,47 @@
 #include "object.h"
+#include "intern.h"
 #include "value.h"
 #include <iostream>
 
+std::shared_ptr<ObjString> ObjString::getObject(const char *chars,
+                                                int length) {
+  return InternTable::current().intern(std::string_view(chars, length));
+}
+
+void ObjFiber::closeUpvalues() {
+  for (auto &upvalue : open_upvalues) {
+    upvalue->closed = stack[upvalue->stack_idx];
+    upvalue->stack_idx = -1;
+  }
+  open_upvalues.clear();
+}
+
+void ObjChannel::send(Value value) {
+  Delivery deliver;
+  {
+    std::lock_guard lock(mutex_);
+    if (receivers_.empty()) {
+      values_.push_back(std::move(value));
+      return;
+    }
+    deliver = std::move(receivers_.front());
+    receivers_.pop_front();
+  }
+  deliver(std::move(value));
+}
+
+std::optional<Value>
+ObjChannel::receive(const std::function<Delivery()> &wait) {
+  std::lock_guard lock(mutex_);
+  if (values_.empty()) {
+    receivers_.push_back(wait());
+    return std::nullopt;
+  }
+  auto value = std::move(values_.front());
+  values_.pop_front();
+  return value;
+}
+
 std::ostream &operator<<(std::ostream &os, const Obj &obj) {
   switch (obj.type) {
   case Obj::Type::STRING:
@@ -32,6 +72,15 @@ std::ostream &operator<<(std::ostream &os, const Obj &obj) {
   case Obj::Type::BOUND_METHOD:
     os << "<bound method>";
     break;
+  case Obj::Type::FIBER:
+    os << "<fiber>";
+    break;
+  case Obj::Type::ARRAY:
+    os << "<array>";
+    break;
+  case Obj::Type::CHANNEL:
+    os << "<channel>";
+    break;
   }
   return os;
 }
@@ -3,16 +3,30 @@
 #include "chunk.h"
 #include "common.h"
 #include "value.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <format>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <forward_list>
 #include <unordered_map>
+#include <vector>
 
 using NativeFunction = Value (*)(int argCount, Value *args);
 
+class VM;
+// A native that works on the VM itself, like the fiber primitives. It finds
+// its arguments on the stack, leaves its result there and reports its own
+// errors.
+using VMFunction = bool (VM::*)(uint8_t arg_count);
+
 struct Obj {
   enum class Type {
     STRING,
@@ -23,38 +37,30 @@ struct Obj {
     CLASS,
     INSTANCE,
     BOUND_METHOD,
+    FIBER,
+    ARRAY,
+    CHANNEL,
   };
 
   Type type;
+  // Never modified again, so VMs on other threads can share the object.
+  // Set by freeze(), and from the start for strings and channels.
+  bool frozen = false;
+  // The last collection that reached the object; see Heap.
+  std::atomic<uint32_t> mark = 0;
 };
 
 struct ObjString : Obj {
   std::string str;
 
-  static std::shared_ptr<ObjString> getObject(const char *chars, int length) {
-    static std::unordered_map<std::string_view, std::shared_ptr<ObjString>>
-        interned_strings;
-    static std::vector<std::string> string_storage;
-
-    std::string_view key(chars, length);
-    auto it = interned_strings.find(key);
-    if (it != interned_strings.end()) {
-      return it->second;
-    }
-
-    string_storage.emplace_back(chars, length);
-    key = string_storage.back();
-
-    auto obj = std::make_shared<ObjString>(key);
-    interned_strings[key] = obj;
-    return obj;
-  }
+  // The interned string with these contents; see InternTable.
+  static std::shared_ptr<ObjString> getObject(const char *chars, int length);
 
   static std::shared_ptr<ObjString> getObject(const std::string &str) {
     return getObject(str.c_str(), str.length());
   }
 
-  ObjString(std::string_view str) : Obj{Type::STRING}, str(str) {}
+  ObjString(std::string_view str) : Obj{Type::STRING, true}, str(str) {}
 
 private:
   ObjString() = delete;
@@ -62,11 +68,26 @@ private:
   ObjString &operator=(const ObjString &) = delete;
 };
 
+struct ObjClosure;
+struct LazyFunction;
+
 struct ObjFunction : Obj {
   int arity;
   int upvalue_count;
   std::shared_ptr<Chunk> chunk;
+  // Variant of chunk with unchecked number opcodes, valid when every
+  // argument is a number. Null when inference found nothing to specialize.
+  std::shared_ptr<Chunk> number_chunk;
   ObjString *name;
+  // Cleared by the compiler's escape analysis when every closure created
+  // from this function is expected to stay inside the scope that declares
+  // it. Only a hint: the VM checks that a closure is unused before reusing
+  // it.
+  bool escapes = true;
+  // Deepest value stack the function's frame reaches, set by the verifier.
+  int max_stack = 0;
+  // Set while the body is still uncompiled; the chunk is empty until then.
+  std::shared_ptr<LazyFunction> lazy;
 
   ObjFunction(int arity, ObjString *name)
       : Obj{Type::FUNCTION}, arity(arity), upvalue_count(0),
@@ -74,16 +95,58 @@ struct ObjFunction : Obj {
 };
 
 struct ObjNative : Obj {
-  NativeFunction function;
+  NativeFunction function = nullptr;
+  VMFunction vm_function = nullptr;
 
   ObjNative(NativeFunction function) : Obj{Type::NATIVE}, function(function) {}
+  ObjNative(VMFunction vm_function)
+      : Obj{Type::NATIVE}, vm_function(vm_function) {}
+};
+
+struct ObjUpvalue;
+
+struct CallFrame {
+  ObjClosure *closure;
+  const Chunk *chunk;
+  int code_idx;
+  size_t value_idx;
+};
+
+// A coroutine with its own value stack and call frames. The VM runs one
+// fiber at a time, so switching to another is swapping a pointer.
+struct ObjFiber : Obj {
+  // WAITING fibers are parked on I/O or a join until the VM wakes them.
+  enum class State { NEW, SUSPENDED, RUNNING, WAITING, DONE };
+
+  State state = State::NEW;
+  std::vector<Value> stack;
+  std::vector<CallFrame> frames;
+  std::forward_list<std::shared_ptr<ObjUpvalue>> open_upvalues;
+  // The fiber that resumed this one and gets control back when it yields
+  // or finishes. Null for the fibers the VM runs scripts and modules on.
+  std::shared_ptr<ObjFiber> resumer;
+  // Fibers parked in join() on this one, and what they get once it is done.
+  std::vector<std::shared_ptr<ObjFiber>> joiners;
+  Value result;
+
+  ObjFiber() : Obj{Type::FIBER} {}
+  // A fiber dropped while suspended closes the upvalues still pointing into
+  // its stack.
+  ~ObjFiber() { closeUpvalues(); }
+
+  void closeUpvalues();
 };
 
 struct ObjUpvalue : Obj {
   Value closed;
+  // While open, the slot lives on the stack of the fiber that declared it.
+  ObjFiber *fiber;
   int stack_idx;
 
-  ObjUpvalue(int stack_idx) : Obj{Type::UPVALUE}, stack_idx(stack_idx) {}
+  ObjUpvalue(ObjFiber *fiber, int stack_idx)
+      : Obj{Type::UPVALUE}, fiber(fiber), stack_idx(stack_idx) {}
+
+  Value &value() { return stack_idx >= 0 ? fiber->stack[stack_idx] : closed; }
 };
 
 struct ObjClosure : Obj {
@@ -99,15 +162,20 @@ struct ObjClosure : Obj {
 struct ObjClass : Obj {
   ObjString *name;
   std::unordered_map<std::string, Value> methods;
+  // Owns the functions behind the methods and the name. Set when an
+  // instance is frozen, since other VMs may then outlive the one that
+  // defined the class.
+  std::shared_ptr<const void> code;
 
   ObjClass(ObjString *name) : Obj{Type::CLASS}, name(name) {}
 };
 
 struct ObjInstance : Obj {
-  ObjClass *klass;
+  std::shared_ptr<ObjClass> klass;
   std::unordered_map<std::string, Value> fields;
 
-  ObjInstance(ObjClass *klass) : Obj{Type::INSTANCE}, klass(klass) {}
+  ObjInstance(std::shared_ptr<ObjClass> klass)
+      : Obj{Type::INSTANCE}, klass(std::move(klass)) {}
 };
 
 struct ObjBoundMethod : Obj {
@@ -117,6 +185,33 @@ struct ObjBoundMethod : Obj {
       : Obj{Type::BOUND_METHOD}, receiver(receiver), method(method) {}
 };
 
+struct ObjArray : Obj {
+  std::vector<Value> items;
+
+  ObjArray() : Obj{Type::ARRAY} {}
+};
+
+// A queue of values between VMs, which may run on different threads. Only
+// frozen values go through, so they are passed by pointer, not copied.
+struct ObjChannel : Obj {
+  // Hands a sent value to a receiver that was waiting for one.
+  using Delivery = std::function<void(Value)>;
+
+  ObjChannel() : Obj{Type::CHANNEL, true} {}
+
+  // Called on the sender's thread, which runs the delivery if a receiver
+  // is waiting.
+  void send(Value value);
+  // The oldest value not yet received. If there is none, `wait` is called
+  // under the channel's lock and its delivery gets the next value sent.
+  std::optional<Value> receive(const std::function<Delivery()> &wait);
+
+private:
+  std::mutex mutex_;
+  std::deque<Value> values_;
+  std::deque<Delivery> receivers_;
+};
+
 namespace obj_helpers {
 inline bool IsObjType(const Value &value, Obj::Type type) {
   return value.type == Value::Type::OBJECT &&
@@ -155,6 +250,23 @@ inline bool IsBoundMethod(const Value &value) {
   return IsObjType(value, Obj::Type::BOUND_METHOD);
 }
 
+inline bool IsFiber(const Value &value) {
+  return IsObjType(value, Obj::Type::FIBER);
+}
+
+inline bool IsArray(const Value &value) {
+  return IsObjType(value, Obj::Type::ARRAY);
+}
+
+inline bool IsChannel(const Value &value) {
+  return IsObjType(value, Obj::Type::CHANNEL);
+}
+
+// Whether the value can be handed to another VM as it is.
+inline bool IsFrozen(const Value &value) {
+  return !Value::IsObject(value) || Value::AsObject(value)->frozen;
+}
+
 inline ObjString *AsString(const Value &value) {
   return static_cast<ObjString *>(Value::AsObject(value));
 }
@@ -163,8 +275,8 @@ inline ObjFunction *AsFunction(const Value &value) {
   return static_cast<ObjFunction *>(Value::AsObject(value));
 }
 
-inline NativeFunction AsNative(const Value &value) {
-  return static_cast<ObjNative *>(Value::AsObject(value))->function;
+inline ObjNative *AsNative(const Value &value) {
+  return static_cast<ObjNative *>(Value::AsObject(value));
 }
 
 inline ObjClosure *AsClosure(const Value &value) {
@@ -186,6 +298,24 @@ inline ObjInstance *AsInstance(const Value &value) {
 inline ObjBoundMethod *AsBoundMethod(const Value &value) {
   return static_cast<ObjBoundMethod *>(Value::AsObject(value));
 }
+
+inline ObjFiber *AsFiber(const Value &value) {
+  return static_cast<ObjFiber *>(Value::AsObject(value));
+}
+
+inline ObjArray *AsArray(const Value &value) {
+  return static_cast<ObjArray *>(Value::AsObject(value));
+}
+
+inline ObjChannel *AsChannel(const Value &value) {
+  return static_cast<ObjChannel *>(Value::AsObject(value));
+}
+
+// An owning pointer to the object, for keeping it past the value.
+template <typename T> std::shared_ptr<T> AsShared(const Value &value) {
+  return std::static_pointer_cast<T>(
+      std::get<std::shared_ptr<Obj>>(value.data));
+}
 } // namespace obj_helpers
 
 template <> struct std::formatter<Obj> {
@@ -222,6 +352,12 @@ template <> struct std::formatter<Obj> {
       return std::format_to(
           ctx.out(), "<bound method {}>",
           static_cast<const ObjBoundMethod &>(obj).method->function->name->str);
+    case Obj::Type::FIBER:
+      return std::format_to(ctx.out(), "<fiber>");
+    case Obj::Type::ARRAY:
+      return std::format_to(ctx.out(), "<array>");
+    case Obj::Type::CHANNEL:
+      return std::format_to(ctx.out(), "<channel>");
     }
     return ctx.out();
   }
@@ -0,0 +1,1345 @@
+#include "optimizer.h"
+#include "chunk.h"
+#include "object.h"
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <tuple>
+
+namespace {
+bool isJump(OpCode op) {
+  return op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE ||
+         op == OpCode::LOOP || op == OpCode::GUARD_CALLEE ||
+         op == OpCode::GUARD_METHOD || op == OpCode::FOR_INCR_LT;
+}
+
+bool isBackwardJump(OpCode op) {
+  return op == OpCode::LOOP || op == OpCode::FOR_INCR_LT;
+}
+
+// Index of the 16-bit jump offset within a jump instruction's operands.
+int jumpOperand(OpCode op) {
+  return op == OpCode::GUARD_CALLEE || op == OpCode::GUARD_METHOD ||
+                 op == OpCode::FOR_INCR_LT
+             ? 2
+             : 0;
+}
+
+// Instructions allowed in the body of an inlined function: straight-line
+// code that cannot call back into another frame.
+bool isInlinableOp(OpCode op) {
+  switch (op) {
+  case OpCode::CONSTANT:
+  case OpCode::NIL:
+  case OpCode::TRUE:
+  case OpCode::FALSE:
+  case OpCode::NEGATE:
+  case OpCode::NOT:
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::GET_LOCAL:
+  case OpCode::SET_LOCAL:
+  case OpCode::GET_GLOBAL:
+  case OpCode::SET_GLOBAL:
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Number-only variant of an arithmetic or comparison opcode, or the opcode
+// itself when it has none.
+OpCode numberVariant(OpCode op) {
+  switch (op) {
+  case OpCode::ADD:
+    return OpCode::ADD_NUMBER;
+  case OpCode::SUBTRACT:
+    return OpCode::SUBTRACT_NUMBER;
+  case OpCode::MULTIPLY:
+    return OpCode::MULTIPLY_NUMBER;
+  case OpCode::DIVIDE:
+    return OpCode::DIVIDE_NUMBER;
+  case OpCode::NEGATE:
+    return OpCode::NEGATE_NUMBER;
+  case OpCode::GREATER:
+    return OpCode::GREATER_NUMBER;
+  case OpCode::LESS:
+    return OpCode::LESS_NUMBER;
+  default:
+    return op;
+  }
+}
+
+bool hasConstantOperand(OpCode op) {
+  switch (op) {
+  case OpCode::CONSTANT:
+  case OpCode::GET_GLOBAL:
+  case OpCode::SET_GLOBAL:
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Records that `name` is bound to `function`. A name bound to two different
+// functions is ambiguous and never inlined.
+void bindCandidate(std::unordered_map<std::string, Value> &candidates,
+                   const std::string &name, Value function) {
+  auto [it, inserted] = candidates.try_emplace(name, function);
+  if (!inserted && (Value::IsNil(it->second) ||
+                    obj_helpers::AsFunction(it->second) !=
+                        obj_helpers::AsFunction(function))) {
+    it->second = Value::Nil();
+  }
+}
+
+bool isNumberConstant(const Chunk &chunk, uint8_t index) {
+  return Value::IsNumber(chunk.constants[index]);
+}
+
+// Instructions that push a value without any side effect.
+bool isPurePush(OpCode op) {
+  switch (op) {
+  case OpCode::CONSTANT:
+  case OpCode::NIL:
+  case OpCode::TRUE:
+  case OpCode::FALSE:
+  case OpCode::GET_LOCAL:
+  case OpCode::GET_UPVALUE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Instructions after which a local may be observed through something other
+// than GET_LOCAL (a call reading it through an upvalue, a closure capturing
+// it) or after which control leaves the basic block.
+bool endsStoreScan(OpCode op) {
+  switch (op) {
+  case OpCode::CALL:
+  case OpCode::INVOKE:
+  case OpCode::SUPER_INVOKE:
+  case OpCode::CLOSURE:
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::RETURN:
+  case OpCode::JUMP:
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::LOOP:
+  case OpCode::GUARD_CALLEE:
+  case OpCode::GUARD_METHOD:
+  case OpCode::INLINE_RETURN:
+  case OpCode::FOR_INCR_LT:
+    return true;
+  default:
+    return false;
+  }
+}
+bool usesLongForms(const Chunk &chunk) {
+  for (int offset = 0; offset < chunk.code.size();
+       offset += chunk.InstructionLength(offset)) {
+    switch (from_uint8(chunk.code[offset])) {
+    case OpCode::WIDE:
+    case OpCode::JUMP_LONG:
+    case OpCode::JUMP_IF_FALSE_LONG:
+    case OpCode::LOOP_LONG:
+      return true;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+} // namespace
+
+void Optimizer::optimize(ObjFunction *script) {
+  global_functions_.clear();
+  methods_.clear();
+  collectInlineCandidates(script, true);
+  optimizeFunction(script);
+}
+
+void Optimizer::optimizeFunction(ObjFunction *function) {
+  auto &chunk = *function->chunk;
+  for (const auto &constant : chunk.constants) {
+    if (obj_helpers::IsFunction(constant)) {
+      optimizeFunction(obj_helpers::AsFunction(constant));
+    }
+  }
+  // Chunks big enough to need wide operands or long jumps are left to the
+  // baseline tier.
+  if (usesLongForms(chunk)) {
+    return;
+  }
+
+  instructions_ = decode(chunk);
+  inlineCalls(function);
+  markLeaders();
+  if (eliminateCommonSubexpressions(function)) {
+    compact();
+  }
+  while (hoistLoopInvariant(function)) {
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    // Every pass may retarget or remove jumps, so block boundaries are
+    // recomputed before each one.
+    markLeaders();
+    changed |= foldConstants(chunk);
+    markLeaders();
+    changed |= foldBranches(chunk);
+    markLeaders();
+    changed |= removeDeadPushes();
+    markLeaders();
+    changed |= removeDeadStores();
+    markLeaders();
+    changed |= threadJumps();
+    markLeaders();
+    changed |= removeUnreachable();
+  }
+  if (encode(chunk)) {
+    specializeNumbers(function);
+  }
+}
+
+std::vector<Optimizer::Instruction> Optimizer::decode(const Chunk &chunk) {
+  std::vector<Instruction> instructions;
+  std::vector<int> index_at(chunk.code.size() + 1, -1);
+  for (int offset = 0; offset < chunk.code.size();) {
+    int length = chunk.InstructionLength(offset);
+    index_at[offset] = instructions.size();
+    instructions.push_back(Instruction{from_uint8(chunk.code[offset]),
+                                       {chunk.code.begin() + offset + 1,
+                                        chunk.code.begin() + offset + length},
+                                       chunk.GetLine(offset),
+                                       chunk.StackEffect(offset),
+                                       chunk.PopCount(offset), -1, false,
+                                       false});
+    offset += length;
+  }
+  // A jump past the last instruction targets the end sentinel.
+  index_at[chunk.code.size()] = instructions.size();
+
+  int offset = 0;
+  for (auto &instruction : instructions) {
+    int length = 1 + instruction.operands.size();
+    if (isJump(instruction.op)) {
+      int operand = jumpOperand(instruction.op);
+      int jump = instruction.operands[operand] << 8 |
+                 instruction.operands[operand + 1];
+      int sign = isBackwardJump(instruction.op) ? -1 : 1;
+      instruction.target = index_at[offset + length + sign * jump];
+    }
+    offset += length;
+  }
+  return instructions;
+}
+
+// Leaves the chunk untouched and returns false if inlining pushed a jump out
+// of 16-bit range.
+bool Optimizer::encode(Chunk &chunk) {
+  std::vector<int> offsets(instructions_.size() + 1);
+  int offset = 0;
+  for (int i = 0; i < instructions_.size(); i++) {
+    offsets[i] = offset;
+    if (!instructions_[i].removed) {
+      offset += 1 + instructions_[i].operands.size();
+    }
+  }
+  offsets[instructions_.size()] = offset;
+  for (int i = 0; i < instructions_.size(); i++) {
+    const auto &instruction = instructions_[i];
+    if (instruction.removed || !isJump(instruction.op)) {
+      continue;
+    }
+    int end = offsets[i] + 1 + instruction.operands.size();
+    int target = offsets[resolve(instruction.target)];
+    if (std::abs(target - end) > UINT16_MAX) {
+      return false;
+    }
+  }
+
+  chunk.code.clear();
+  chunk.lines.clear();
+  chunk.inlined.clear();
+  for (const auto &instruction : instructions_) {
+    if (instruction.removed) {
+      continue;
+    }
+    int start = chunk.code.size();
+    int end = start + 1 + instruction.operands.size();
+    if (instruction.callee != -1) {
+      auto &runs = chunk.inlined;
+      if (!runs.empty() && runs.back().end == start &&
+          runs.back().callee == instruction.callee &&
+          runs.back().line == instruction.callee_line) {
+        runs.back().end = end;
+      } else {
+        runs.push_back({start, end, instruction.callee_line,
+                        instruction.callee});
+      }
+    }
+    chunk.Write(instruction.op, instruction.line);
+    if (isJump(instruction.op)) {
+      int operand = jumpOperand(instruction.op);
+      for (int i = 0; i < operand; i++) {
+        chunk.Write(instruction.operands[i], instruction.line);
+      }
+      int end = chunk.code.size() + 2;
+      int target = offsets[resolve(instruction.target)];
+      int jump =
+          isBackwardJump(instruction.op) ? end - target : target - end;
+      chunk.Write(static_cast<uint8_t>((jump >> 8) & 0xFF), instruction.line);
+      chunk.Write(static_cast<uint8_t>(jump & 0xFF), instruction.line);
+      continue;
+    }
+    for (auto byte : instruction.operands) {
+      chunk.Write(byte, instruction.line);
+    }
+  }
+  return true;
+}
+
+void Optimizer::markLeaders() {
+  for (auto &instruction : instructions_) {
+    instruction.is_leader = false;
+  }
+  for (const auto &instruction : instructions_) {
+    if (!instruction.removed && instruction.target != -1) {
+      int target = resolve(instruction.target);
+      if (target < instructions_.size()) {
+        instructions_[target].is_leader = true;
+      }
+    }
+  }
+}
+
+void Optimizer::compact() {
+  std::vector<int> remap(instructions_.size() + 1);
+  std::vector<Instruction> live;
+  for (int i = 0; i < instructions_.size(); i++) {
+    remap[i] = live.size();
+    if (!instructions_[i].removed) {
+      live.push_back(instructions_[i]);
+    }
+  }
+  remap[instructions_.size()] = live.size();
+  for (auto &instruction : live) {
+    if (instruction.target != -1) {
+      instruction.target = remap[resolve(instruction.target)];
+    }
+  }
+  instructions_ = std::move(live);
+}
+
+int Optimizer::next(int index) const {
+  do {
+    index++;
+  } while (index < instructions_.size() && instructions_[index].removed);
+  return index;
+}
+
+int Optimizer::resolve(int index) const {
+  while (index < instructions_.size() && instructions_[index].removed) {
+    index++;
+  }
+  return index;
+}
+
+void Optimizer::collectInlineCandidates(ObjFunction *function,
+                                        bool is_script) {
+  const auto &chunk = *function->chunk;
+  auto instructions = decode(chunk);
+  for (int i = 0; i < instructions.size(); i++) {
+    const auto &instruction = instructions[i];
+    if (instruction.op == OpCode::CLOSURE) {
+      auto constant = chunk.constants[instruction.operands[0]];
+      collectInlineCandidates(obj_helpers::AsFunction(constant), false);
+      if (i + 1 == instructions.size()) {
+        continue;
+      }
+      const auto &binding = instructions[i + 1];
+      auto name = [&]() {
+        return obj_helpers::AsString(chunk.constants[binding.operands[0]])->str;
+      };
+      if (binding.op == OpCode::DEFINE_GLOBAL && is_script) {
+        bindCandidate(global_functions_, name(), constant);
+      } else if (binding.op == OpCode::METHOD) {
+        bindCandidate(methods_, name(), constant);
+      }
+    } else if (instruction.op == OpCode::SET_GLOBAL ||
+               (instruction.op == OpCode::DEFINE_GLOBAL &&
+                (i == 0 || instructions[i - 1].op != OpCode::CLOSURE))) {
+      auto name =
+          obj_helpers::AsString(chunk.constants[instruction.operands[0]])->str;
+      global_functions_[name] = Value::Nil();
+    }
+  }
+}
+
+bool Optimizer::isInlinable(ObjFunction *function) const {
+  if (function->upvalue_count != 0) {
+    return false;
+  }
+  int size = 0;
+  for (const auto &instruction : decode(*function->chunk)) {
+    size += 1 + instruction.operands.size();
+    if (size > INLINE_MAX_CODE) {
+      return false;
+    }
+    if (instruction.op == OpCode::RETURN) {
+      return true;
+    }
+    if (!isInlinableOp(instruction.op)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+std::vector<int> Optimizer::stackHeights(const ObjFunction *function) const {
+  std::vector<int> heights(instructions_.size() + 1, -1);
+  std::vector<int> worklist{0};
+  heights[0] = function->arity + 1;
+  while (!worklist.empty()) {
+    int index = worklist.back();
+    worklist.pop_back();
+    if (index >= instructions_.size()) {
+      continue;
+    }
+
+    const auto &instruction = instructions_[index];
+    int height = heights[index] + instruction.stack_effect;
+    if (height < 0) {
+      return {};
+    }
+    std::vector<int> successors;
+    if (instruction.target != -1) {
+      successors.push_back(instruction.target);
+    }
+    if (instruction.op != OpCode::JUMP && instruction.op != OpCode::LOOP &&
+        instruction.op != OpCode::RETURN) {
+      successors.push_back(index + 1);
+    }
+    for (int successor : successors) {
+      if (heights[successor] == -1) {
+        heights[successor] = height;
+        worklist.push_back(successor);
+      } else if (heights[successor] != height) {
+        return {};
+      }
+    }
+  }
+  return heights;
+}
+
+bool Optimizer::inlineCalls(ObjFunction *function) {
+  auto &chunk = *function->chunk;
+  auto heights = stackHeights(function);
+  if (heights.empty()) {
+    return false;
+  }
+
+  std::vector<Instruction> out;
+  // Old index of each emitted instruction's jump target still needs to be
+  // translated, except for jumps created here.
+  std::vector<bool> translated;
+  std::vector<int> remap(instructions_.size() + 1);
+  bool changed = false;
+
+  for (int i = 0; i < instructions_.size(); i++) {
+    const auto &instruction = instructions_[i];
+    remap[i] = out.size();
+
+    Value callee = Value::Nil();
+    int base = -1;
+    if (heights[i] != -1 && instruction.op == OpCode::CALL) {
+      base = heights[i] - instruction.operands[0] - 1;
+      // Find the instruction that pushed the callee.
+      for (int j = i - 1; j >= 0; j--) {
+        const auto &producer = instructions_[j];
+        if (heights[j] == base) {
+          if (producer.op == OpCode::GET_GLOBAL) {
+            auto name =
+                obj_helpers::AsString(chunk.constants[producer.operands[0]]);
+            auto it = global_functions_.find(name->str);
+            if (it != global_functions_.end()) {
+              callee = it->second;
+            }
+          }
+          break;
+        }
+        if (heights[j] == -1 ||
+            heights[j] - producer.pops <= base) {
+          break;
+        }
+      }
+    } else if (heights[i] != -1 && instruction.op == OpCode::INVOKE) {
+      base = heights[i] - instruction.operands[1] - 1;
+      auto name =
+          obj_helpers::AsString(chunk.constants[instruction.operands[0]]);
+      auto it = methods_.find(name->str);
+      if (it != methods_.end()) {
+        callee = it->second;
+      }
+    }
+
+    size_t start = out.size();
+    if (!Value::IsNil(callee) && emitInlined(chunk, instruction, callee, base,
+                                             out)) {
+      translated.resize(out.size(), true);
+      // Guard failure falls back to the original call.
+      out[start].target = out.size();
+      translated[start] = false;
+      changed = true;
+    }
+    out.push_back(instruction);
+    translated.push_back(true);
+  }
+  remap[instructions_.size()] = out.size();
+
+  for (int i = 0; i < out.size(); i++) {
+    if (translated[i] && out[i].target != -1) {
+      out[i].target = remap[out[i].target];
+    }
+  }
+  instructions_ = std::move(out);
+  return changed;
+}
+
+bool Optimizer::emitInlined(Chunk &chunk, const Instruction &call,
+                           Value callee, int base,
+                           std::vector<Instruction> &out) {
+  auto function = obj_helpers::AsFunction(callee);
+  int arg_count = call.op == OpCode::CALL ? call.operands[0]
+                                          : call.operands[1];
+  if (function->arity != arg_count || !isInlinable(function)) {
+    return false;
+  }
+
+  int guard_constant = chunk.AddConstant(callee);
+  if (guard_constant >= UINT8_MAX) {
+    return false;
+  }
+
+  auto guard_op = call.op == OpCode::CALL ? OpCode::GUARD_CALLEE
+                                          : OpCode::GUARD_METHOD;
+  std::vector<Instruction> inlined{
+      Instruction{guard_op,
+                  {static_cast<uint8_t>(arg_count),
+                   static_cast<uint8_t>(guard_constant), 0, 0},
+                  call.line, 0, 0, -1, false, false}};
+
+  const auto &callee_chunk = *function->chunk;
+  int height = function->arity + 1;
+  for (auto instruction : decode(callee_chunk)) {
+    if (instruction.op == OpCode::RETURN) {
+      // Drop the inlined frame's slots from under the return value, then
+      // continue after the slow-path call.
+      int drop = height - 1;
+      inlined.push_back(Instruction{OpCode::INLINE_RETURN,
+                                    {static_cast<uint8_t>(drop)},
+                                    call.line, -drop, drop + 1, -1, false,
+                                    false});
+      break;
+    }
+
+    instruction.callee = guard_constant;
+    instruction.callee_line = instruction.line;
+    instruction.line = call.line;
+    if (instruction.op == OpCode::GET_LOCAL ||
+        instruction.op == OpCode::SET_LOCAL) {
+      int slot = base + instruction.operands[0];
+      if (slot >= UINT8_MAX) {
+        return false;
+      }
+      instruction.operands[0] = slot;
+    } else if (hasConstantOperand(instruction.op)) {
+      int index =
+          chunk.AddConstant(callee_chunk.constants[instruction.operands[0]]);
+      if (index >= UINT8_MAX) {
+        return false;
+      }
+      instruction.operands[0] = index;
+    }
+    height += instruction.stack_effect;
+    inlined.push_back(instruction);
+  }
+
+  // The jump's target is the instruction after the call, in old indices.
+  int after = &call - instructions_.data() + 1;
+  inlined.push_back(
+      Instruction{OpCode::JUMP, {0, 0}, call.line, 0, 0, after, false, false});
+  out.insert(out.end(), inlined.begin(), inlined.end());
+  return true;
+}
+
+void Optimizer::specializeNumbers(ObjFunction *function) {
+  const auto &chunk = *function->chunk;
+  instructions_ = decode(chunk);
+  auto heights = stackHeights(function);
+  if (heights.empty()) {
+    return;
+  }
+
+  auto captured = capturedSlots();
+
+  // Forward dataflow over the value stack: whether each slot is known to
+  // hold a number. Arguments are numbers under the entry guard in VM::call.
+  std::vector<std::vector<bool>> states(instructions_.size() + 1);
+  std::vector<bool> visited(instructions_.size() + 1, false);
+  std::vector<bool> entry(function->arity + 1, true);
+  entry[0] = false;
+  for (int slot = 0; slot < entry.size(); slot++) {
+    entry[slot] = entry[slot] && !captured[slot];
+  }
+  states[0] = entry;
+  visited[0] = true;
+
+  std::vector<int> worklist{0};
+  while (!worklist.empty()) {
+    int index = worklist.back();
+    worklist.pop_back();
+    if (index >= instructions_.size()) {
+      continue;
+    }
+
+    const auto &instruction = instructions_[index];
+    auto stack = states[index];
+    auto pop = [&stack]() {
+      bool is_number = stack.back();
+      stack.pop_back();
+      return is_number;
+    };
+    switch (instruction.op) {
+    case OpCode::RETURN:
+      continue;
+    case OpCode::CONSTANT:
+      stack.push_back(
+          Value::IsNumber(chunk.constants[instruction.operands[0]]));
+      break;
+    case OpCode::GET_LOCAL: {
+      uint8_t slot = instruction.operands[0];
+      stack.push_back(slot < stack.size() && stack[slot]);
+      break;
+    }
+    case OpCode::SET_LOCAL: {
+      uint8_t slot = instruction.operands[0];
+      if (slot < stack.size()) {
+        stack[slot] = stack.back() && !captured[slot];
+      }
+      break;
+    }
+    case OpCode::ADD: {
+      bool b = pop();
+      bool a = pop();
+      stack.push_back(a && b);
+      break;
+    }
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+      // Either both operands are numbers or the instruction throws.
+      pop();
+      pop();
+      stack.push_back(true);
+      break;
+    case OpCode::NEGATE:
+      pop();
+      stack.push_back(true);
+      break;
+    case OpCode::FOR_INCR_LT: {
+      // The counter is a number on both edges or the instruction throws.
+      uint8_t slot = instruction.operands[0];
+      pop();
+      if (slot < stack.size()) {
+        stack[slot] = !captured[slot];
+      }
+      break;
+    }
+    default: {
+      int pops = instruction.pops;
+      int pushes = instruction.stack_effect + pops;
+      for (int i = 0; i < pops; i++) {
+        pop();
+      }
+      for (int i = 0; i < pushes; i++) {
+        stack.push_back(false);
+      }
+      break;
+    }
+    }
+
+    std::vector<int> successors;
+    if (instruction.target != -1) {
+      successors.push_back(instruction.target);
+    }
+    if (instruction.op != OpCode::JUMP && instruction.op != OpCode::LOOP) {
+      successors.push_back(index + 1);
+    }
+    for (int successor : successors) {
+      if (!visited[successor]) {
+        visited[successor] = true;
+        states[successor] = stack;
+        worklist.push_back(successor);
+        continue;
+      }
+      // Merge: a slot stays a number only if it is one on every path.
+      bool changed = false;
+      auto &state = states[successor];
+      for (int i = 0; i < state.size(); i++) {
+        if (state[i] && !stack[i]) {
+          state[i] = false;
+          changed = true;
+        }
+      }
+      if (changed) {
+        worklist.push_back(successor);
+      }
+    }
+  }
+
+  auto number_chunk = std::make_shared<Chunk>(chunk);
+  bool specialized = false;
+  int offset = 0;
+  for (int i = 0; i < instructions_.size(); i++) {
+    const auto &instruction = instructions_[i];
+    const auto &stack = states[i];
+    auto variant = numberVariant(instruction.op);
+    bool operands_known =
+        instruction.op == OpCode::NEGATE
+            ? !stack.empty() && stack.back()
+            : stack.size() >= 2 && stack[stack.size() - 1] &&
+                  stack[stack.size() - 2];
+    if (visited[i] && variant != instruction.op && operands_known) {
+      number_chunk->code[offset] = to_underlying(variant);
+      specialized = true;
+    }
+    offset += 1 + instruction.operands.size();
+  }
+  if (specialized) {
+    function->number_chunk = number_chunk;
+  }
+}
+
+// Slots captured by a closure can be written by any call, so nothing is
+// known about them.
+std::vector<bool> Optimizer::capturedSlots() const {
+  std::vector<bool> captured(UINT8_MAX + 1, false);
+  for (const auto &instruction : instructions_) {
+    if (instruction.op != OpCode::CLOSURE) {
+      continue;
+    }
+    for (int i = 1; i < instruction.operands.size(); i += 2) {
+      if (instruction.operands[i]) {
+        captured[instruction.operands[i + 1]] = true;
+      }
+    }
+  }
+  return captured;
+}
+
+// Local value numbering over each basic block. The value stack doubles as
+// the frame's slots, so an expression whose value already sits in a slot,
+// as a local or as a temporary under the current one, is replaced by a load
+// of that slot. Only pure operators over literals and uncaptured locals are
+// numbered; the first evaluation already threw if it was going to.
+bool Optimizer::eliminateCommonSubexpressions(ObjFunction *function) {
+  auto heights = stackHeights(function);
+  if (heights.empty()) {
+    return false;
+  }
+  auto captured = capturedSlots();
+
+  struct Entry {
+    int number;
+    // First instruction of the pure code that computed this value, or -1.
+    int start;
+  };
+  std::vector<Entry> stack;
+  std::map<std::tuple<OpCode, int, int>, int> numbers;
+  int next_number = 0;
+  auto number = [&](OpCode op, int a, int b) {
+    auto [it, inserted] = numbers.try_emplace({op, a, b}, next_number);
+    if (inserted) {
+      next_number++;
+    }
+    return it->second;
+  };
+  auto unknown = [&next_number]() { return Entry{next_number++, -1}; };
+
+  bool changed = false;
+  for (int i = 0; i < instructions_.size(); i++) {
+    auto &instruction = instructions_[i];
+    if (heights[i] == -1) {
+      continue;
+    }
+    if (instruction.is_leader || heights[i] != stack.size()) {
+      // Nothing is known about values flowing in from other blocks.
+      stack.clear();
+      for (int slot = 0; slot < heights[i]; slot++) {
+        stack.push_back(unknown());
+      }
+    }
+
+    switch (instruction.op) {
+    case OpCode::CONSTANT:
+      stack.push_back({number(instruction.op, instruction.operands[0], -1), i});
+      continue;
+    case OpCode::NIL:
+    case OpCode::TRUE:
+    case OpCode::FALSE:
+      stack.push_back({number(instruction.op, -1, -1), i});
+      continue;
+    case OpCode::GET_LOCAL: {
+      uint8_t slot = instruction.operands[0];
+      stack.push_back(slot < stack.size() && !captured[slot]
+                          ? Entry{stack[slot].number, i}
+                          : unknown());
+      continue;
+    }
+    case OpCode::SET_LOCAL: {
+      uint8_t slot = instruction.operands[0];
+      if (slot < stack.size()) {
+        stack[slot].number = stack.back().number;
+      }
+      stack.back().start = -1;
+      continue;
+    }
+    case OpCode::FOR_INCR_LT: {
+      uint8_t slot = instruction.operands[0];
+      stack.pop_back();
+      if (slot < stack.size()) {
+        stack[slot] = unknown();
+      }
+      continue;
+    }
+    case OpCode::NEGATE:
+    case OpCode::NOT: {
+      auto a = stack.back();
+      stack.pop_back();
+      stack.push_back({number(instruction.op, a.number, -1), a.start});
+      break;
+    }
+    case OpCode::ADD:
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::EQUAL:
+    case OpCode::GREATER:
+    case OpCode::LESS: {
+      auto b = stack.back();
+      stack.pop_back();
+      auto a = stack.back();
+      stack.pop_back();
+      stack.push_back({number(instruction.op, a.number, b.number),
+                       a.start != -1 && b.start != -1 ? a.start : -1});
+      break;
+    }
+    default:
+      for (int k = 0; k < instruction.pops; k++) {
+        stack.pop_back();
+      }
+      for (int k = 0; k < instruction.stack_effect + instruction.pops; k++) {
+        stack.push_back(unknown());
+      }
+      continue;
+    }
+
+    auto &result = stack.back();
+    if (result.start == -1) {
+      continue;
+    }
+    for (int slot = 0; slot + 1 < stack.size() && slot <= UINT8_MAX; slot++) {
+      if (stack[slot].number != result.number || captured[slot]) {
+        continue;
+      }
+      auto &first = instructions_[result.start];
+      first = Instruction{OpCode::GET_LOCAL, {static_cast<uint8_t>(slot)},
+                          instruction.line, 1, 0, -1, first.is_leader,
+                          false};
+      for (int k = result.start + 1; k <= i; k++) {
+        instructions_[k].removed = true;
+      }
+      changed = true;
+      break;
+    }
+  }
+  return changed;
+}
+
+// Moves one pure expression that cannot change between iterations out of a
+// loop. It must sit in the loop's first block with nothing before it that
+// has a side effect or can throw, so evaluating it once ahead of the loop
+// fails exactly when the first iteration would have. The value stays in a
+// new slot under the loop, so the loop's slots above it shift up by one and
+// every exit pops it.
+bool Optimizer::hoistLoopInvariant(ObjFunction *function) {
+  auto heights = stackHeights(function);
+  if (heights.empty()) {
+    return false;
+  }
+  markLeaders();
+  auto captured = capturedSlots();
+  int count = instructions_.size();
+  auto falls_through = [](OpCode op) {
+    return op != OpCode::JUMP && op != OpCode::LOOP && op != OpCode::RETURN;
+  };
+
+  for (int end = 0; end < count; end++) {
+    if (!isBackwardJump(instructions_[end].op)) {
+      continue;
+    }
+    int header = instructions_[end].target;
+    int height = header < count ? heights[header] : -1;
+    if (height == -1 || height >= UINT8_MAX) {
+      continue;
+    }
+    auto in_loop = [header, end](int index) {
+      return index >= header && index <= end;
+    };
+
+    std::vector<bool> written(UINT8_MAX + 1, false);
+    for (int i = header; i <= end; i++) {
+      const auto &instruction = instructions_[i];
+      if (instruction.op == OpCode::SET_LOCAL ||
+          instruction.op == OpCode::FOR_INCR_LT) {
+        written[instruction.operands[0]] = true;
+      }
+    }
+
+    // Scan the first block for the outermost invariant expression.
+    struct Entry {
+      int start;
+      bool invariant;
+    };
+    std::vector<Entry> stack;
+    int first = -1;
+    int last = -1;
+    for (int i = header; i <= end; i++) {
+      const auto &instruction = instructions_[i];
+      if (i != header && instruction.is_leader) {
+        break;
+      }
+      bool pure = true;
+      switch (instruction.op) {
+      case OpCode::CONSTANT:
+      case OpCode::NIL:
+      case OpCode::TRUE:
+      case OpCode::FALSE:
+        stack.push_back({i, true});
+        break;
+      case OpCode::GET_LOCAL: {
+        uint8_t slot = instruction.operands[0];
+        stack.push_back(
+            {i, slot < height && !written[slot] && !captured[slot]});
+        break;
+      }
+      case OpCode::NEGATE:
+      case OpCode::NOT:
+      case OpCode::ADD:
+      case OpCode::SUBTRACT:
+      case OpCode::MULTIPLY:
+      case OpCode::DIVIDE:
+      case OpCode::EQUAL:
+      case OpCode::GREATER:
+      case OpCode::LESS: {
+        int operands = instruction.pops;
+        if (stack.size() < operands) {
+          pure = false;
+          break;
+        }
+        Entry result{stack[stack.size() - operands].start, true};
+        for (int k = 0; k < operands; k++) {
+          result.invariant &= stack.back().invariant;
+          stack.pop_back();
+        }
+        // A variant operator may throw, so nothing after it can move.
+        pure = result.invariant;
+        if (result.invariant && (first == -1 || result.start <= first)) {
+          first = result.start;
+          last = i;
+        }
+        stack.push_back(result);
+        break;
+      }
+      default:
+        pure = false;
+        break;
+      }
+      if (!pure) {
+        break;
+      }
+    }
+    if (first == -1) {
+      continue;
+    }
+
+    // The loop may only be entered through its header, and every way out
+    // must lead to one place that nothing else reaches, where the value can
+    // be popped.
+    bool shaped = true;
+    int exit = -1;
+    for (int i = header; i <= end; i++) {
+      const auto &instruction = instructions_[i];
+      for (int successor :
+           {instruction.target, falls_through(instruction.op) ? i + 1 : -1}) {
+        if (successor == -1 || in_loop(successor)) {
+          continue;
+        }
+        shaped &= successor > end && (exit == -1 || exit == successor);
+        exit = successor;
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      int target = instructions_[i].target;
+      if (!in_loop(i) && target != -1) {
+        shaped &= target == header || !in_loop(target);
+        shaped &= target != exit || exit == -1;
+      }
+    }
+    if (!shaped || exit >= count ||
+        (exit != -1 && exit != end + 1 &&
+         falls_through(instructions_[exit - 1].op))) {
+      continue;
+    }
+    // The exit either starts at the loop's height, or holds the condition
+    // on top and pops it first.
+    bool pop_before = exit != -1 && heights[exit] == height;
+    bool pop_after = exit != -1 && heights[exit] == height + 1 &&
+                     instructions_[exit].op == OpCode::POP;
+    if (exit != -1 && !pop_before && !pop_after) {
+      continue;
+    }
+
+    auto shift = [height](Instruction &instruction) {
+      auto bump = [height](uint8_t &slot) {
+        if (slot >= height) {
+          if (slot == UINT8_MAX) {
+            return false;
+          }
+          slot++;
+        }
+        return true;
+      };
+      switch (instruction.op) {
+      case OpCode::GET_LOCAL:
+      case OpCode::SET_LOCAL:
+      case OpCode::FOR_INCR_LT:
+        return bump(instruction.operands[0]);
+      case OpCode::CLOSURE:
+        for (int i = 1; i < instruction.operands.size(); i += 2) {
+          if (instruction.operands[i] && !bump(instruction.operands[i + 1])) {
+            return false;
+          }
+        }
+        return true;
+      default:
+        return true;
+      }
+    };
+
+    Instruction pop{OpCode::POP, {}, 0, -1, 1, -1, false, false};
+    std::vector<Instruction> out;
+    std::vector<int> old_index;
+    std::vector<int> remap(count + 1);
+    int preheader = -1;
+    int exit_pop = -1;
+    bool fits = true;
+    for (int i = 0; i < count; i++) {
+      auto instruction = instructions_[i];
+      if (i == header) {
+        preheader = out.size();
+        for (int k = first; k <= last; k++) {
+          out.push_back(instructions_[k]);
+          out.back().target = -1;
+          old_index.push_back(-1);
+        }
+      }
+      if (i == exit && pop_before) {
+        exit_pop = out.size();
+        pop.line = instruction.line;
+        out.push_back(pop);
+        old_index.push_back(-1);
+      }
+      remap[i] = out.size();
+      if (i > first && i <= last) {
+        continue;
+      }
+      if (i == first) {
+        instruction = Instruction{OpCode::GET_LOCAL,
+                                  {static_cast<uint8_t>(height)},
+                                  instructions_[last].line, 1, 0, -1, false,
+                                  false};
+      } else if (in_loop(i)) {
+        fits &= shift(instruction);
+      }
+      out.push_back(instruction);
+      old_index.push_back(i);
+      if (i == exit && pop_after) {
+        pop.line = instruction.line;
+        out.push_back(pop);
+        old_index.push_back(-1);
+      }
+    }
+    remap[count] = out.size();
+    if (!fits) {
+      continue;
+    }
+
+    for (int k = 0; k < out.size(); k++) {
+      int i = old_index[k];
+      if (i == -1 || out[k].target == -1) {
+        continue;
+      }
+      int target = out[k].target;
+      if (!in_loop(i) && target == header) {
+        out[k].target = preheader;
+      } else if (in_loop(i) && target == exit && pop_before) {
+        out[k].target = exit_pop;
+      } else {
+        out[k].target = remap[target];
+      }
+    }
+    instructions_ = std::move(out);
+    return true;
+  }
+  return false;
+}
+
+bool Optimizer::foldConstants(Chunk &chunk) {
+  bool changed = false;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    auto &first = instructions_[i];
+    int j = next(i);
+    if (j >= instructions_.size() || instructions_[j].is_leader) {
+      continue;
+    }
+    auto &second = instructions_[j];
+
+    // Unary operators on a literal.
+    if (second.op == OpCode::NOT) {
+      bool folded = true;
+      switch (first.op) {
+      case OpCode::TRUE:
+        first.op = OpCode::FALSE;
+        break;
+      case OpCode::FALSE:
+      case OpCode::NIL:
+        first.op = OpCode::TRUE;
+        break;
+      case OpCode::CONSTANT:
+        first.op = OpCode::FALSE;
+        first.operands.clear();
+        break;
+      default:
+        folded = false;
+      }
+      if (folded) {
+        second.removed = true;
+        changed = true;
+      }
+      continue;
+    }
+    if (first.op == OpCode::CONSTANT && second.op == OpCode::NEGATE &&
+        isNumberConstant(chunk, first.operands[0])) {
+      int index = chunk.AddConstant(
+          Value::Number(-Value::AsNumber(chunk.constants[first.operands[0]])));
+      if (index < UINT8_MAX) {
+        first.operands[0] = index;
+        second.removed = true;
+        changed = true;
+      }
+      continue;
+    }
+
+    // Binary operators on two numeric literals.
+    int k = next(j);
+    if (k >= instructions_.size() || instructions_[k].is_leader ||
+        first.op != OpCode::CONSTANT || second.op != OpCode::CONSTANT ||
+        !isNumberConstant(chunk, first.operands[0]) ||
+        !isNumberConstant(chunk, second.operands[0])) {
+      continue;
+    }
+    auto &third = instructions_[k];
+    double a = Value::AsNumber(chunk.constants[first.operands[0]]);
+    double b = Value::AsNumber(chunk.constants[second.operands[0]]);
+
+    std::optional<Value> result;
+    switch (third.op) {
+    case OpCode::ADD:
+      result = Value::Number(a + b);
+      break;
+    case OpCode::SUBTRACT:
+      result = Value::Number(a - b);
+      break;
+    case OpCode::MULTIPLY:
+      result = Value::Number(a * b);
+      break;
+    case OpCode::DIVIDE:
+      result = Value::Number(a / b);
+      break;
+    case OpCode::GREATER:
+      result = Value::Bool(a > b);
+      break;
+    case OpCode::LESS:
+      result = Value::Bool(a < b);
+      break;
+    case OpCode::EQUAL:
+      result = Value::Bool(a == b);
+      break;
+    default:
+      continue;
+    }
+
+    if (Value::IsBool(*result)) {
+      first.op = Value::AsBool(*result) ? OpCode::TRUE : OpCode::FALSE;
+      first.operands.clear();
+    } else {
+      int index = chunk.AddConstant(*result);
+      if (index >= UINT8_MAX) {
+        continue;
+      }
+      first.operands[0] = index;
+    }
+    second.removed = true;
+    third.removed = true;
+    changed = true;
+  }
+  return changed;
+}
+
+bool Optimizer::foldBranches(Chunk &chunk) {
+  bool changed = false;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    int j = next(i);
+    if (j >= instructions_.size() || instructions_[j].is_leader ||
+        instructions_[j].op != OpCode::JUMP_IF_FALSE) {
+      continue;
+    }
+    switch (instructions_[i].op) {
+    case OpCode::TRUE:
+    case OpCode::CONSTANT:
+      // Never taken; the condition stays on the stack for the POP after it.
+      instructions_[j].removed = true;
+      changed = true;
+      break;
+    case OpCode::FALSE:
+    case OpCode::NIL:
+      instructions_[j].op = OpCode::JUMP;
+      changed = true;
+      break;
+    default:
+      break;
+    }
+  }
+  return changed;
+}
+
+bool Optimizer::removeDeadPushes() {
+  bool changed = false;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    int j = next(i);
+    if (j < instructions_.size() && !instructions_[j].is_leader &&
+        instructions_[j].op == OpCode::POP && isPurePush(instructions_[i].op)) {
+      instructions_[i].removed = true;
+      instructions_[j].removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool Optimizer::removeDeadStores() {
+  bool changed = false;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    int j = next(i);
+    if (instructions_[i].op != OpCode::SET_LOCAL || j >= instructions_.size() ||
+        instructions_[j].is_leader || instructions_[j].op != OpCode::POP) {
+      continue;
+    }
+
+    uint8_t slot = instructions_[i].operands[0];
+    for (int k = next(j); k < instructions_.size(); k = next(k)) {
+      const auto &later = instructions_[k];
+      if (later.is_leader || endsStoreScan(later.op) ||
+          (later.op == OpCode::GET_LOCAL && later.operands[0] == slot)) {
+        break;
+      }
+      if (later.op == OpCode::SET_LOCAL && later.operands[0] == slot) {
+        // Overwritten before any read: keep evaluating the value, drop the
+        // store.
+        instructions_[i].removed = true;
+        changed = true;
+        break;
+      }
+    }
+  }
+  return changed;
+}
+
+bool Optimizer::threadJumps() {
+  bool changed = false;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    auto &instruction = instructions_[i];
+    if (instruction.op != OpCode::JUMP &&
+        instruction.op != OpCode::JUMP_IF_FALSE) {
+      continue;
+    }
+
+    int target = resolve(instruction.target);
+    if (instruction.op == OpCode::JUMP && target == next(i)) {
+      instruction.removed = true;
+      changed = true;
+      continue;
+    }
+    // Follow forward chains of unconditional jumps.
+    while (target < instructions_.size() &&
+           instructions_[target].op == OpCode::JUMP) {
+      int final_target = resolve(instructions_[target].target);
+      if (final_target <= target) {
+        break;
+      }
+      target = final_target;
+    }
+    if (target != resolve(instruction.target)) {
+      instruction.target = target;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool Optimizer::removeUnreachable() {
+  bool changed = false;
+  bool reachable = true;
+  for (int i = resolve(0); i < instructions_.size(); i = next(i)) {
+    auto &instruction = instructions_[i];
+    if (instruction.is_leader) {
+      reachable = true;
+    }
+    if (!reachable) {
+      instruction.removed = true;
+      changed = true;
+      continue;
+    }
+    if (instruction.op == OpCode::JUMP || instruction.op == OpCode::LOOP ||
+        instruction.op == OpCode::RETURN) {
+      reachable = false;
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "chunk.h"
+#include "object.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Optimizing tier. Runs over the function tree produced by the single-pass
+// compiler and rewrites every chunk in place, emitting the same opcodes.
+class Optimizer {
+public:
+  static constexpr int INLINE_MAX_CODE = 32;
+
+  void optimize(ObjFunction *script);
+
+private:
+  struct Instruction {
+    OpCode op;
+    std::vector<uint8_t> operands;
+    int line;
+    int stack_effect;
+    int pops;
+    int target; // instruction index for jumps, -1 otherwise
+    bool is_leader;
+    bool removed;
+    // Constant index of the function this was inlined from, and its line
+    // there.
+    int callee = -1;
+    int callee_line = 0;
+  };
+
+  static std::vector<Instruction> decode(const Chunk &chunk);
+  bool encode(Chunk &chunk);
+  void optimizeFunction(ObjFunction *function);
+  void markLeaders();
+  // Drops removed instructions, so indices match stack heights again.
+  void compact();
+  int next(int index) const;
+  int resolve(int index) const;
+
+  void collectInlineCandidates(ObjFunction *function, bool is_script);
+  bool isInlinable(ObjFunction *function) const;
+  std::vector<int> stackHeights(const ObjFunction *function) const;
+  bool inlineCalls(ObjFunction *function);
+  bool emitInlined(Chunk &chunk, const Instruction &call, Value callee,
+                   int base, std::vector<Instruction> &out);
+
+  void specializeNumbers(ObjFunction *function);
+  std::vector<bool> capturedSlots() const;
+
+  bool eliminateCommonSubexpressions(ObjFunction *function);
+  bool hoistLoopInvariant(ObjFunction *function);
+
+  bool foldConstants(Chunk &chunk);
+  bool foldBranches(Chunk &chunk);
+  bool removeDeadPushes();
+  bool removeDeadStores();
+  bool removeUnreachable();
+  bool threadJumps();
+
+  std::vector<Instruction> instructions_;
+  // Globals and method names bound to exactly one function in the program,
+  // keyed by name. Ambiguous names map to nil.
+  std::unordered_map<std::string, Value> global_functions_;
+  std::unordered_map<std::string, Value> methods_;
+};
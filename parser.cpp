@@ -1,7 +1,9 @@
 #include "parser.h"
 #include <iostream>
 #include <string_view>
-Parser::Parser(const std::string &source) : scanner_(source) {}
+Parser::Parser(std::string_view source, size_t offset, int line,
+               std::ostream &errors)
+    : scanner_(source, offset, line), errors_(errors) {}
 
 void Parser::advance() {
   previous_ = current_;
@@ -35,17 +37,17 @@ void Parser::errorAt(const Token &token, const std::string &message) {
   }
 
   panic_mode_ = true;
-  std::cerr << std::format("[line {}] Error", token.line);
+  errors_ << std::format("[line {}] Error", token.line);
 
   if (token.type == TokenType::END_OF_FILE) {
-    std::cerr << " at end";
+    errors_ << " at end";
   } else if (token.type == TokenType::ERROR) {
     // nothing
   } else {
-    std::cerr << std::format(" at '{}'",
+    errors_ << std::format(" at '{}'",
                              std::string_view(token.start, token.length));
   }
-  std::cerr << std::format(": {}", message) << std::endl;
+  errors_ << std::format(": {}", message) << std::endl;
 
   had_error_ = true;
 }
@@ -58,4 +60,13 @@ bool Parser::match(TokenType type) {
   return true;
 }
 
-bool Parser::check(TokenType type) const { return current_.type == type; }
\ No newline at end of file
+bool Parser::check(TokenType type) const { return current_.type == type; }
+
+std::vector<Token> Parser::lookahead(int count) const {
+  Scanner scanner = scanner_;
+  std::vector<Token> tokens;
+  for (int i = 0; i < count; i++) {
+    tokens.push_back(scanner.scanToken());
+  }
+  return tokens;
+}
\ No newline at end of file
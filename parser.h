@@ -1,10 +1,14 @@
 #pragma once
 
 #include "scanner.h"
+#include <iostream>
+#include <string_view>
+#include <vector>
 
 class Parser {
 public:
-  Parser(const std::string &source);
+  Parser(std::string_view source, size_t offset = 0, int line = 1,
+         std::ostream &errors = std::cerr);
 
   void advance();
   void consume(TokenType type, const std::string &message);
@@ -20,12 +24,15 @@ public:
 
   bool match(TokenType type);
   bool check(TokenType type) const;
+  // The `count` tokens after current(), without consuming them.
+  std::vector<Token> lookahead(int count) const;
 
   bool panicMode() const { return panic_mode_; }
   void resetPanicMode() { panic_mode_ = false; }
 
 private:
   Scanner scanner_;
+  std::ostream &errors_;
   Token current_;
   Token previous_;
   bool had_error_{false};
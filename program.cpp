@@ -0,0 +1,28 @@
+#include "program.h"
+#include "compile_cache.h"
+#include "verifier.h"
+
+std::shared_ptr<const Program>
+Program::compile(std::shared_ptr<const Source> source, CompilerOptions options,
+                 std::filesystem::path directory) {
+  // Lazy bodies would be compiled, and so written, by whichever VM calls
+  // them first.
+  options.lazy = false;
+  std::shared_ptr<Program> program(new Program);
+  InternTable::Scope strings(program->strings_);
+  CompileCache cache(CompileCache::defaultDirectory());
+  auto script = cache.load(source->text(), options);
+  if (script == nullptr) {
+    script = Compiler(options).compile(source);
+    if (script == nullptr) {
+      return nullptr;
+    }
+    cache.store(source->text(), options, script.get());
+  }
+  if (!Verifier(*options.errors).verify(script.get())) {
+    return nullptr;
+  }
+  program->script_ = std::move(script);
+  program->directory_ = std::move(directory);
+  return program;
+}
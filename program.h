@@ -0,0 +1,35 @@
+#pragma once
+
+#include "compiler.h"
+#include "intern.h"
+#include "object.h"
+#include "source.h"
+#include <filesystem>
+#include <memory>
+
+// A script compiled once for any number of VMs, on any threads, to run. Like
+// a cached module it is compiled in full up front, verified, and never
+// changes after; its strings live in its own intern table. What a run
+// changes, such as globals and reused closures, stays in each VM.
+class Program {
+public:
+  Program(const Program &) = delete;
+  Program &operator=(const Program &) = delete;
+
+  // Null if `source` doesn't compile or verify; the errors go to
+  // options.errors. Imports resolve against `directory`.
+  static std::shared_ptr<const Program>
+  compile(std::shared_ptr<const Source> source, CompilerOptions options,
+          std::filesystem::path directory = {});
+
+  ObjFunction *script() const { return script_.get(); }
+  const std::filesystem::path &directory() const { return directory_; }
+
+private:
+  Program() = default;
+
+  // Declared first so that it outlives the functions naming its strings.
+  InternTable strings_;
+  std::shared_ptr<ObjFunction> script_;
+  std::filesystem::path directory_;
+};
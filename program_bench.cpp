@@ -0,0 +1,87 @@
+// VMs sharing a program: program_bench shared|each <script> [vms]
+// Runs the script in each of `vms` VMs (default 100) on a thread pool and
+// keeps them all alive, then reports the time taken and how much resident
+// memory grew. "shared" compiles the script once into a Program that every
+// VM runs; "each" has every VM compile its own copy. Run the modes as
+// separate processes, since freed memory is not returned between them.
+#include "program.h"
+#include "source.h"
+#include "thread_pool.h"
+#include "vm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t total = 0;
+  size_t resident = 0;
+  statm >> total >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string_view mode = argc > 1 ? argv[1] : "";
+  if (argc < 3 || (mode != "shared" && mode != "each")) {
+    std::cerr << "Usage: program_bench shared|each <script> [vms]"
+              << std::endl;
+    return 64;
+  }
+  std::filesystem::path path = argv[2];
+  size_t count = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100;
+  auto source = Source::map(path);
+  if (source == nullptr) {
+    std::cerr << "Could not open file \"" << path.string() << "\""
+              << std::endl;
+    return 74;
+  }
+
+  // Output is dropped; errors are not.
+  std::ostream discard(nullptr);
+  std::vector<std::unique_ptr<VM>> vms(count);
+  std::vector<InterpretResult> results(count);
+  size_t before = residentBytes();
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::shared_ptr<const Program> program;
+    if (mode == "shared") {
+      program = Program::compile(source, {}, path.parent_path());
+      if (program == nullptr) {
+        return 65;
+      }
+    }
+    ThreadPool pool;
+    for (size_t i = 0; i < count; i++) {
+      pool.submit([&, i] {
+        vms[i] = std::make_unique<VM>(CompilerOptions{}, discard);
+        results[i] = program != nullptr
+                         ? vms[i]->interpret(program)
+                         : vms[i]->interpret(std::string(source->text()));
+      });
+    }
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  size_t after = residentBytes();
+  size_t grown = after > before ? after - before : 0;
+
+  for (auto result : results) {
+    if (result != InterpretResult::InterpretOk) {
+      std::cerr << "A VM failed to run the script." << std::endl;
+      return 70;
+    }
+  }
+  std::cout << "vms  ms  KiB per vm" << std::endl;
+  std::cout << count << "\t" << elapsed.count() << "\t"
+            << grown / 1024 / std::max<size_t>(count, 1) << std::endl;
+  return 0;
+}
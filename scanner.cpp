@@ -1,9 +1,175 @@
 #include "scanner.h"
-#include <cctype>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-Scanner::Scanner(const std::string &source)
-    : current_(source.c_str()), start_(source.c_str()),
-      end_(source.c_str() + source.size()), line_(1) {}
+namespace {
+// Block-at-a-time scanning of character runs: AVX2 or SSE2 blocks when the
+// build enables them, otherwise single bytes. Each Mask bit says whether the
+// byte at that position belongs to the run being skipped.
+#if defined(__AVX2__)
+using Vec = __m256i;
+using Mask = uint32_t;
+constexpr int BLOCK = 32;
+constexpr Mask FULL = 0xFFFFFFFF;
+
+Vec load(const char *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const Vec *>(p));
+}
+Mask eq(Vec v, char c) {
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+// Bytes in [lo, hi]; both bounds are ASCII, so the signed compare is safe.
+Mask range(Vec v, char lo, char hi) {
+  return _mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v)));
+}
+#elif defined(__SSE2__)
+using Vec = __m128i;
+using Mask = uint32_t;
+constexpr int BLOCK = 16;
+constexpr Mask FULL = 0xFFFF;
+
+Vec load(const char *p) {
+  return _mm_loadu_si128(reinterpret_cast<const Vec *>(p));
+}
+Mask eq(Vec v, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+Mask range(Vec v, char lo, char hi) {
+  return _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                    _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v)));
+}
+#else
+using Vec = char;
+using Mask = uint32_t;
+constexpr int BLOCK = 1;
+constexpr Mask FULL = 1;
+
+Vec load(const char *p) { return *p; }
+Mask eq(Vec v, char c) { return v == c; }
+Mask range(Vec v, char lo, char hi) { return v >= lo && v <= hi; }
+#endif
+
+Mask isBlank(Vec v) {
+  return eq(v, ' ') | eq(v, '\t') | eq(v, '\r') | eq(v, '\n');
+}
+Mask isAlnum(Vec v) {
+  return range(v, 'a', 'z') | range(v, 'A', 'Z') | range(v, '0', '9');
+}
+Mask isDigit(Vec v) { return range(v, '0', '9'); }
+Mask isNotNewline(Vec v) { return ~eq(v, '\n'); }
+Mask isNotQuote(Vec v) { return ~eq(v, '"'); }
+
+// Scalar character classes, one bit per kind of run.
+enum CharClass : uint8_t {
+  BLANK = 1,
+  DIGIT = 2,
+  ALNUM = 4,
+  NOT_NEWLINE = 8,
+  NOT_QUOTE = 16,
+};
+
+constexpr auto CHAR_CLASSES = [] {
+  std::array<uint8_t, 256> classes{};
+  for (int c = 0; c < 256; c++) {
+    bool digit = c >= '0' && c <= '9';
+    bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    bool blank = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    classes[c] = (blank ? BLANK : 0) | (digit ? DIGIT : 0) |
+                 (digit || alpha ? ALNUM : 0) |
+                 (c != '\n' ? NOT_NEWLINE : 0) | (c != '"' ? NOT_QUOTE : 0);
+  }
+  return classes;
+}();
+
+bool is(char c, CharClass char_class) {
+  return CHAR_CLASSES[static_cast<unsigned char>(c)] & char_class;
+}
+
+// Skips the run of `char_class` characters starting at `p` and returns its
+// end, adding the newlines skipped to `lines`. Most runs are a few bytes,
+// so blocks only take over once a run outlasts the first SHORT_RUN bytes.
+template <CharClass char_class>
+const char *skipRun(const char *p, const char *end, int &lines,
+                    Mask (*in_run)(Vec)) {
+  constexpr int SHORT_RUN = 8;
+  constexpr bool has_newlines = char_class & (BLANK | NOT_QUOTE);
+  auto scalar = [&](const char *limit) {
+    while (p < limit && is(*p, char_class)) {
+      if constexpr (has_newlines) {
+        lines += *p == '\n';
+      }
+      p++;
+    }
+  };
+  const char *short_end = end - p > SHORT_RUN ? p + SHORT_RUN : end;
+  scalar(short_end);
+  if (p < short_end) {
+    return p;
+  }
+  while (BLOCK > 1 && end - p >= BLOCK) {
+    Vec v = load(p);
+    int length = std::countr_one(in_run(v) & FULL);
+    Mask taken = length == BLOCK ? FULL : (Mask{1} << length) - 1;
+    lines += std::popcount(eq(v, '\n') & taken);
+    if (length < BLOCK) {
+      return p + length;
+    }
+    p += BLOCK;
+  }
+  scalar(end);
+  return p;
+}
+
+// Keywords by a perfect hash of first char, last char and length, checked
+// at compile time.
+struct Keyword {
+  std::string_view text;
+  TokenType type;
+};
+
+constexpr std::array<Keyword, 17> KEYWORDS = {{
+    {"and", TokenType::AND},       {"class", TokenType::CLASS},
+    {"else", TokenType::ELSE},     {"false", TokenType::FALSE},
+    {"for", TokenType::FOR},       {"fun", TokenType::FUN},
+    {"if", TokenType::IF},         {"import", TokenType::IMPORT},
+    {"nil", TokenType::NIL},       {"or", TokenType::OR},
+    {"print", TokenType::PRINT},   {"return", TokenType::RETURN},
+    {"super", TokenType::SUPER},   {"this", TokenType::THIS},
+    {"true", TokenType::TRUE},     {"var", TokenType::VAR},
+    {"while", TokenType::WHILE},
+}};
+
+constexpr size_t keywordHash(std::string_view text) {
+  return (7 * static_cast<unsigned char>(text.front()) +
+          static_cast<unsigned char>(text.back()) + text.size()) &
+         31;
+}
+
+constexpr auto KEYWORD_TABLE = [] {
+  std::array<Keyword, 32> table{};
+  for (const auto &keyword : KEYWORDS) {
+    table[keywordHash(keyword.text)] = keyword;
+  }
+  return table;
+}();
+
+static_assert(std::ranges::all_of(KEYWORDS, [](const Keyword &keyword) {
+  return KEYWORD_TABLE[keywordHash(keyword.text)].text == keyword.text;
+}));
+} // namespace
+
+Scanner::Scanner(std::string_view source, size_t offset, int line)
+    : current_(source.data() + offset), start_(source.data() + offset),
+      end_(source.data() + source.size()), line_(line) {}
 
 Token Scanner::scanToken() {
   skipWhitespace();
@@ -15,11 +181,11 @@ Token Scanner::scanToken() {
   }
 
   char c = advance();
-  if (isdigit(c)) {
+  if (is(c, DIGIT)) {
     return number();
   }
 
-  if (isalpha(c)) {
+  if (is(c, ALNUM)) {
     return identifier();
   }
 
@@ -80,10 +246,10 @@ Token Scanner::errorToken(const char *message) {
 
 char Scanner::advance() { return *current_++; }
 
-char Scanner::peek() const { return *current_; }
+char Scanner::peek() const { return isAtEnd() ? '\0' : *current_; }
 
 char Scanner::peekNext() const {
-  if (isAtEnd()) {
+  if (end_ - current_ < 2) {
     return '\0';
   }
   return current_[1];
@@ -101,41 +267,19 @@ bool Scanner::match(char expected) {
 }
 
 void Scanner::skipWhitespace() {
-  while (!isAtEnd()) {
-    char c = peek();
-    switch (c) {
-    case ' ':
-    case '\r':
-    case '\t':
-      advance();
-      break;
-    case '\n':
-      line_++;
-      advance();
-      break;
-    case '/':
-      if (peekNext() == '/') {
-        // Skip the rest of the line
-        while (!isAtEnd() && peek() != '\n') {
-          advance();
-        }
-      } else {
-        return;
-      }
-      break;
-    default:
+  while (true) {
+    current_ = skipRun<BLANK>(current_, end_, line_, isBlank);
+    if (peek() == '/' && peekNext() == '/') {
+      // Skip the rest of the line
+      current_ = skipRun<NOT_NEWLINE>(current_, end_, line_, isNotNewline);
+    } else {
       return;
     }
   }
 }
 
 Token Scanner::string() {
-  while (!isAtEnd() && peek() != '"') {
-    if (peek() == '\n') {
-      line_++;
-    }
-    advance();
-  }
+  current_ = skipRun<NOT_QUOTE>(current_, end_, line_, isNotQuote);
 
   if (isAtEnd()) {
     return errorToken("Unterminated string.");
@@ -148,83 +292,98 @@ Token Scanner::string() {
 }
 
 Token Scanner::number() {
-  while (isdigit(peek())) {
-    advance();
-  }
+  current_ = skipRun<DIGIT>(current_, end_, line_, isDigit);
 
-  if (peek() == '.' && isdigit(peekNext())) {
+  if (peek() == '.' && is(peekNext(), DIGIT)) {
     advance(); // consume the '.'
-    while (isdigit(peek())) {
-      advance();
-    }
+    current_ = skipRun<DIGIT>(current_, end_, line_, isDigit);
   }
 
   return makeToken(TokenType::NUMBER);
 }
 
 Token Scanner::identifier() {
-  while (isalpha(peek()) || isdigit(peek())) {
-    advance();
-  }
+  current_ = skipRun<ALNUM>(current_, end_, line_, isAlnum);
 
   return makeToken(identifierType());
 }
 
 TokenType Scanner::identifierType() const {
-  switch (start_[0]) {
-  case 'a':
-    return checkKeyword(1, 2, "nd", TokenType::AND);
-  case 'c':
-    return checkKeyword(1, 4, "lass", TokenType::CLASS);
-  case 'e':
-    return checkKeyword(1, 3, "lse", TokenType::ELSE);
-  case 'f':
-    if (current_ - start_ > 1) {
-      switch (start_[1]) {
-      case 'a':
-        return checkKeyword(2, 3, "lse", TokenType::FALSE);
-      case 'o':
-        return checkKeyword(2, 1, "r", TokenType::FOR);
-      case 'u':
-        return checkKeyword(2, 1, "n", TokenType::FUN);
-      }
+  std::string_view text(start_, current_ - start_);
+  const auto &keyword = KEYWORD_TABLE[keywordHash(text)];
+  return keyword.text == text ? keyword.type : TokenType::IDENTIFIER;
+}
+
+size_t completeDeclarations(std::string_view source, bool at_end) {
+  Scanner scanner(source);
+  size_t complete = 0;
+  int depth = 0;
+  // End of a `;` or `}` that closed a declaration, if the last token was one.
+  size_t boundary = 0;
+  while (true) {
+    auto token = scanner.scanToken();
+    // Error tokens point at their message, and may just be cut short.
+    if (token.type == TokenType::END_OF_FILE ||
+        token.type == TokenType::ERROR) {
+      return at_end ? source.size() : complete;
     }
-    break;
-  case 'i':
-    return checkKeyword(1, 1, "f", TokenType::IF);
-  case 'n':
-    return checkKeyword(1, 2, "il", TokenType::NIL);
-  case 'o':
-    return checkKeyword(1, 1, "r", TokenType::OR);
-  case 'p':
-    return checkKeyword(1, 4, "rint", TokenType::PRINT);
-  case 'r':
-    return checkKeyword(1, 5, "eturn", TokenType::RETURN);
-  case 's':
-    return checkKeyword(1, 4, "uper", TokenType::SUPER);
-  case 't':
-    if (current_ - start_ > 1) {
-      switch (start_[1]) {
-      case 'h':
-        return checkKeyword(2, 2, "is", TokenType::THIS);
-      case 'r':
-        return checkKeyword(2, 1, "ue", TokenType::TRUE);
-      }
+    size_t end = token.start - source.data() + token.length;
+    if (!at_end && end == source.size()) {
+      return complete;
+    }
+    if (boundary != 0 && token.type != TokenType::ELSE) {
+      complete = boundary;
+    }
+    boundary = 0;
+
+    if (token.type == TokenType::LEFT_BRACE ||
+        token.type == TokenType::LEFT_PAREN) {
+      depth++;
+    } else if (token.type == TokenType::RIGHT_BRACE ||
+               token.type == TokenType::RIGHT_PAREN) {
+      depth--;
+    }
+    if (depth <= 0 && (token.type == TokenType::SEMICOLON ||
+                       token.type == TokenType::RIGHT_BRACE)) {
+      boundary = end;
     }
-    break;
-  case 'v':
-    return checkKeyword(1, 4, "ar", TokenType::VAR);
-  case 'w':
-    return checkKeyword(1, 5, "hile", TokenType::WHILE);
   }
-  return TokenType::IDENTIFIER;
 }
 
-TokenType Scanner::checkKeyword(int start, int length, const char *rest,
-                                TokenType type) const {
-  if (current_ - start_ == start + length &&
-      memcmp(start_ + start, rest, length) == 0) {
-    return type;
+bool needsMoreInput(std::string_view source) {
+  Scanner scanner(source);
+  int depth = 0;
+  while (true) {
+    auto token = scanner.scanToken();
+    if (token.type == TokenType::END_OF_FILE) {
+      return depth > 0;
+    }
+    if (token.type == TokenType::ERROR) {
+      return std::string_view(token.start, token.length) ==
+             "Unterminated string.";
+    }
+    if (token.type == TokenType::LEFT_BRACE ||
+        token.type == TokenType::LEFT_PAREN) {
+      depth++;
+    } else if (token.type == TokenType::RIGHT_BRACE ||
+               token.type == TokenType::RIGHT_PAREN) {
+      depth--;
+    }
+  }
+}
+
+std::vector<std::string_view> importPaths(std::string_view source) {
+  Scanner scanner(source);
+  std::vector<std::string_view> paths;
+  bool after_import = false;
+  while (true) {
+    auto token = scanner.scanToken();
+    if (token.type == TokenType::END_OF_FILE) {
+      return paths;
+    }
+    if (after_import && token.type == TokenType::STRING) {
+      paths.emplace_back(token.start + 1, token.length - 2);
+    }
+    after_import = token.type == TokenType::IMPORT;
   }
-  return TokenType::IDENTIFIER;
 }
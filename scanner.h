@@ -2,6 +2,8 @@
 
 #include <cstring>
 #include <string>
+#include <string_view>
+#include <vector>
 
 enum class TokenType {
   // Single-character tokens
@@ -40,6 +42,7 @@ enum class TokenType {
   FUN,
   FOR,
   IF,
+  IMPORT,
   NIL,
   OR,
   PRINT,
@@ -64,7 +67,7 @@ struct Token {
   bool operator==(const Token &other) const {
     if (length != other.length)
       return false;
-    return memcmp(start, other.start, length);
+    return memcmp(start, other.start, length) == 0;
   }
 
   static Token emptyToken() { return Token{.start = "", .length = 0}; }
@@ -80,7 +83,8 @@ struct Token {
 
 class Scanner {
 public:
-  Scanner(const std::string &source);
+  // Starts scanning at `offset`, which is on source line `line`.
+  Scanner(std::string_view source, size_t offset = 0, int line = 1);
   Token scanToken();
 
 private:
@@ -96,11 +100,21 @@ private:
   Token number();
   Token identifier();
   TokenType identifierType() const;
-  TokenType checkKeyword(int start, int length, const char *rest,
-                         TokenType type) const;
 
   const char *current_;
   const char *start_;
   const char *end_;
   int line_;
 };
+
+// Length of the longest prefix of `source` made of whole top-level
+// declarations. Until `at_end`, a declaration only counts once the token
+// after it has fully arrived, since an `else` could still continue it.
+size_t completeDeclarations(std::string_view source, bool at_end);
+
+// Whether `source` stops inside a string or an unclosed bracket, so that more
+// input has to follow before it can be compiled.
+bool needsMoreInput(std::string_view source);
+
+// Paths named by the `import` statements in `source`, as written.
+std::vector<std::string_view> importPaths(std::string_view source);
@@ -0,0 +1,69 @@
+// Scanner throughput: scanner_bench [path] [megabytes]
+// Scans the file at `path`, or a generated Lox source of the given size
+// (default 8 MB), several times and reports tokens and bytes per second.
+#include "scanner.h"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+std::string generateSource(size_t size) {
+  static const char *lines[] = {
+      "fun fibonacci(n) {\n",
+      "  if (n < 2) return n; // base case\n",
+      "  return fibonacci(n - 2) + fibonacci(n - 1);\n",
+      "}\n",
+      "var message = \"the quick brown fox jumps over the lazy dog\";\n",
+      "for (var i = 0; i < 1000000; i = i + 1) {\n",
+      "    total = total + i * 3.14159 / 2.71828;\n",
+      "}\n",
+      "class Point { init(x, y) { this.x = x; this.y = y; } }\n",
+      "\n",
+  };
+  std::string source;
+  for (size_t i = 0; source.size() < size; i++) {
+    source += lines[i % std::size(lines)];
+  }
+  return source;
+}
+
+std::string readSource(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Could not open file \"" << path << "\"" << std::endl;
+    std::exit(74);
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  constexpr int ROUNDS = 5;
+  size_t megabytes = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8;
+  std::string source = argc > 1 && std::string(argv[1]) != "-"
+                           ? readSource(argv[1])
+                           : generateSource(megabytes << 20);
+
+  size_t tokens = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < ROUNDS; round++) {
+    Scanner scanner(source);
+    while (scanner.scanToken().type != TokenType::END_OF_FILE) {
+      tokens++;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << tokens / ROUNDS << " tokens in " << source.size()
+            << " bytes\n"
+            << tokens / elapsed.count() / 1e6 << " Mtokens/s, "
+            << source.size() * ROUNDS / elapsed.count() / (1 << 20)
+            << " MB/s" << std::endl;
+  return 0;
+}
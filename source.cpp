@@ -0,0 +1,83 @@
+#include "source.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Source::Source(std::string text) : owned_(std::move(text)), text_(owned_) {}
+
+Source::~Source() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+std::shared_ptr<const Source>
+Source::map(const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  // A pipe or device reports no size, and may not be mappable at all.
+  if (!S_ISREG(st.st_mode)) {
+    auto source = readAll(fd);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return source;
+  }
+
+  std::shared_ptr<Source> source(new Source());
+  // An empty file has nothing to map.
+  if (st.st_size > 0) {
+    void *mapping =
+        mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    source->mapping_ = mapping;
+    source->mapping_size_ = st.st_size;
+    source->text_ = {static_cast<const char *>(mapping),
+                     static_cast<size_t>(st.st_size)};
+  }
+  close(fd);
+  return source;
+}
+
+std::shared_ptr<const Source>
+Source::read(const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto source = readAll(fd);
+  int error = errno;
+  close(fd);
+  errno = error;
+  return source;
+}
+
+std::shared_ptr<const Source> Source::readAll(int fd) {
+  std::string text;
+  char buffer[1 << 16];
+  while (true) {
+    ssize_t count = ::read(fd, buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      return nullptr;
+    }
+    if (count == 0) {
+      return std::make_shared<const Source>(std::move(text));
+    }
+    text.append(buffer, count);
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Program text that tokens point into. Either held in memory or mapped
+// read-only from a file; whatever still refers to the text (lazy function
+// bodies, loaded chunks) shares ownership of it.
+class Source {
+public:
+  explicit Source(std::string text);
+  ~Source();
+  Source(const Source &) = delete;
+  Source &operator=(const Source &) = delete;
+
+  // Maps the file at `path`, or returns null and sets errno. Anything but a
+  // regular file, such as a pipe, is read instead.
+  static std::shared_ptr<const Source> map(const std::filesystem::path &path);
+  // Copies the file at `path` into memory, for text that must stay as it was
+  // when a later write or truncation would show through a mapping.
+  static std::shared_ptr<const Source> read(const std::filesystem::path &path);
+
+  std::string_view text() const { return text_; }
+
+private:
+  Source() = default;
+  static std::shared_ptr<const Source> readAll(int fd);
+
+  std::string owned_;
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  std::string_view text_;
+};
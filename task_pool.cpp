@@ -0,0 +1,209 @@
+#include "task_pool.h"
+#include "vm.h"
+#include <algorithm>
+#include <sstream>
+
+namespace {
+// The pool and worker the current thread belongs to, if any.
+thread_local TaskPool *current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+void run(VM &vm, std::ostringstream &errors, Task &task) {
+  errors.str("");
+  vm.runTask(task);
+  if (!task.ok) {
+    task.error = errors.str();
+  }
+  task.done();
+}
+} // namespace
+
+bool toPortable(const Value &value, PortableValue &portable) {
+  if (obj_helpers::IsFrozen(value)) {
+    portable.data = value;
+    return true;
+  }
+  if (!obj_helpers::IsArray(value)) {
+    return false;
+  }
+  std::vector<PortableValue> items;
+  for (const auto &item : obj_helpers::AsArray(value)->items) {
+    if (!toPortable(item, items.emplace_back())) {
+      return false;
+    }
+  }
+  portable.data = std::move(items);
+  return true;
+}
+
+Value fromPortable(const PortableValue &portable) {
+  if (auto value = std::get_if<Value>(&portable.data)) {
+    return *value;
+  }
+  auto array = std::make_shared<ObjArray>();
+  for (const auto &item :
+       std::get<std::vector<PortableValue>>(portable.data)) {
+    array->items.push_back(fromPortable(item));
+  }
+  return Value::Object(array);
+}
+
+void TaskGroup::add() {
+  std::lock_guard lock(mutex_);
+  count_++;
+}
+
+void TaskGroup::finish() {
+  std::lock_guard lock(mutex_);
+  if (--count_ == 0) {
+    idle_.notify_all();
+  }
+}
+
+void TaskGroup::wait() {
+  std::unique_lock lock(mutex_);
+  idle_.wait(lock, [this] { return count_ == 0; });
+}
+
+TaskPool::TaskPool(unsigned workers) {
+  workers = std::max(workers, 1u);
+  for (unsigned i = 0; i < workers; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < workers_.size(); i++) {
+    workers_[i]->thread = std::thread(&TaskPool::work, this, i);
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_all();
+  for (auto &worker : workers_) {
+    worker->thread.join();
+  }
+  std::unique_lock lock(mutex_);
+  spares_done_.wait(lock, [this] { return live_spares_ == 0; });
+}
+
+TaskPool &TaskPool::instance() {
+  static TaskPool pool;
+  return pool;
+}
+
+void TaskPool::submit(std::shared_ptr<Task> task) {
+  size_t index = current_pool == this ? current_worker
+                                      : next_++ % workers_.size();
+  {
+    std::lock_guard lock(workers_[index]->mutex);
+    workers_[index]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard lock(mutex_);
+    queued_++;
+    compensate();
+  }
+  ready_.notify_one();
+}
+
+void TaskPool::compensate() {
+  // One spare per blocked thread at most, and none while a worker is idle,
+  // since that worker takes the task itself.
+  if (queued_ == 0 || idle_ > 0 || spares_ >= blocked_ || stopping_) {
+    return;
+  }
+  spares_++;
+  live_spares_++;
+  std::thread(&TaskPool::spare, this, next_++ % workers_.size()).detach();
+}
+
+TaskPool::Blocking::Blocking() : pool_(current_pool) {
+  if (pool_ != nullptr) {
+    std::lock_guard lock(pool_->mutex_);
+    pool_->blocked_++;
+    pool_->compensate();
+  }
+}
+
+TaskPool::Blocking::~Blocking() {
+  if (pool_ != nullptr) {
+    std::lock_guard lock(pool_->mutex_);
+    pool_->blocked_--;
+  }
+}
+
+std::shared_ptr<Task> TaskPool::take(size_t index) {
+  std::shared_ptr<Task> task;
+  {
+    auto &own = *workers_[index];
+    std::lock_guard lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+    }
+  }
+  for (size_t i = 1; task == nullptr && i < workers_.size(); i++) {
+    auto &victim = *workers_[(index + i) % workers_.size()];
+    std::lock_guard lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+    }
+  }
+  if (task != nullptr) {
+    std::lock_guard lock(mutex_);
+    queued_--;
+  }
+  return task;
+}
+
+void TaskPool::work(size_t index) {
+  current_pool = this;
+  current_worker = index;
+  std::ostringstream errors;
+  VM vm({}, std::cout, errors);
+  while (true) {
+    auto task = take(index);
+    if (task == nullptr) {
+      std::unique_lock lock(mutex_);
+      idle_++;
+      ready_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+      idle_--;
+      if (stopping_) {
+        return;
+      }
+      continue;
+    }
+    run(vm, errors, *task);
+  }
+}
+
+void TaskPool::spare(size_t home) {
+  // Takes tasks as if it were the worker at `home`, so its own submits
+  // stay local too.
+  current_pool = this;
+  current_worker = home;
+  {
+    std::ostringstream errors;
+    VM vm({}, std::cout, errors);
+    while (true) {
+      auto task = take(home);
+      if (task != nullptr) {
+        run(vm, errors, *task);
+        continue;
+      }
+      // Stops counting as a spare under the same lock submit() checks, so
+      // a task queued after this is left to a new spare.
+      std::lock_guard lock(mutex_);
+      if (queued_ == 0) {
+        spares_--;
+        break;
+      }
+    }
+  }
+  std::lock_guard lock(mutex_);
+  live_spares_--;
+  spares_done_.notify_all();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "object.h"
+#include "value.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// A value taken out of one VM to be used in another. Frozen values,
+// strings included, are shared as they are; arrays that are not frozen are
+// copied element by element.
+struct PortableValue {
+  std::variant<Value, std::vector<PortableValue>> data = Value::Nil();
+};
+
+// Fails for values that cannot leave their VM, like functions.
+bool toPortable(const Value &value, PortableValue &portable);
+Value fromPortable(const PortableValue &portable);
+
+// Global functions a task can call, by name. Taken from the VM that
+// submitted the task; only functions that capture nothing qualify.
+using TaskGlobals =
+    std::vector<std::pair<std::string, std::shared_ptr<ObjFunction>>>;
+
+// A call to run on a worker VM. The function and everything it reaches are
+// compiled before submission and only read from then on, so workers share
+// them with the submitting VM.
+struct Task {
+  std::shared_ptr<ObjFunction> function;
+  std::shared_ptr<const TaskGlobals> globals;
+  std::vector<PortableValue> args;
+  PortableValue result;
+  bool ok = false;
+  // What the worker reported if the task failed.
+  std::string error;
+  // Called on the worker thread once the task has finished.
+  std::function<void()> done;
+};
+
+// Counts unfinished tasks so their submitter can wait for them before the
+// functions they run go away.
+class TaskGroup {
+public:
+  void add();
+  void finish();
+  void wait();
+
+private:
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t count_ = 0;
+};
+
+// Worker threads, each with its own VM and task deque. A worker runs the
+// newest task in its own deque and, when that is empty, steals the oldest
+// from another worker's. A task waiting on a channel or a join keeps its
+// worker, so while workers are blocked, spare threads are started to run
+// the queued tasks; they exit once the queue is empty.
+class TaskPool {
+public:
+  explicit TaskPool(unsigned workers = std::thread::hardware_concurrency());
+  ~TaskPool();
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  static TaskPool &instance();
+
+  // Tasks submitted by a worker's own VM go on its deque; others are
+  // spread over the workers in turn.
+  void submit(std::shared_ptr<Task> task);
+
+  // Marks the calling thread as blocked for its lifetime, if it is one of
+  // a pool's workers.
+  class Blocking {
+  public:
+    Blocking();
+    ~Blocking();
+    Blocking(const Blocking &) = delete;
+    Blocking &operator=(const Blocking &) = delete;
+
+  private:
+    TaskPool *pool_;
+  };
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Task>> tasks;
+    std::thread thread;
+  };
+
+  void work(size_t index);
+  void spare(size_t home);
+  std::shared_ptr<Task> take(size_t index);
+  // Starts a spare if tasks wait with every thread busy or blocked. Called
+  // with mutex_ held.
+  void compensate();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_ = 0;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  size_t queued_ = 0;
+  bool stopping_ = false;
+  // Workers waiting for a task, threads blocked in a task, and spares
+  // still taking tasks. A spare counts in live_spares_ until it exits.
+  size_t idle_ = 0;
+  size_t blocked_ = 0;
+  size_t spares_ = 0;
+  size_t live_spares_ = 0;
+  std::condition_variable spares_done_;
+};
@@ -0,0 +1,52 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) {
+  for (unsigned i = 0; i < std::max(threads, 1u); i++) {
+    threads_.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  {
+    std::lock_guard lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  ready_.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock lock(mutex_);
+  idle_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+}
+
+void ThreadPool::work() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+    if (tasks_.empty()) {
+      return;
+    }
+    auto task = std::move(tasks_.front());
+    tasks_.pop_front();
+    running_++;
+    lock.unlock();
+    task();
+    lock.lock();
+    running_--;
+    if (tasks_.empty() && running_ == 0) {
+      idle_.notify_all();
+    }
+  }
+}
@@ -1,6 +1,7 @@
 #include "value.h"
 #include "object.h"
 #include <iostream>
+#include <utility>
 
 std::ostream &operator<<(std::ostream &os, const Value &value) {
   switch (value.type) {
@@ -16,6 +17,13 @@ std::ostream &operator<<(std::ostream &os, const Value &value) {
   case Value::Type::OBJECT:
     if (obj_helpers::IsString(value)) {
       os << obj_helpers::AsString(value)->str;
+    } else if (obj_helpers::IsArray(value)) {
+      os << "[";
+      const char *separator = "";
+      for (const auto &item : obj_helpers::AsArray(value)->items) {
+        os << std::exchange(separator, ", ") << item;
+      }
+      os << "]";
     } else {
       os << "<object>";
     }
@@ -35,10 +43,13 @@ bool Value::operator==(const Value &other) const {
   case Type::NUMBER:
     return std::get<double>(data) == std::get<double>(other.data);
   case Type::OBJECT: {
-    // TODO: support other object types
-    ObjString *obj1 = obj_helpers::AsString(*this);
-    ObjString *obj2 = obj_helpers::AsString(other);
-    return obj1->str == obj2->str;
+    // Strings compare by contents, since each VM interns its own; every
+    // other object by identity.
+    if (obj_helpers::IsString(*this) && obj_helpers::IsString(other)) {
+      return obj_helpers::AsString(*this)->str ==
+             obj_helpers::AsString(other)->str;
+    }
+    return Value::AsObject(*this) == Value::AsObject(other);
   }
   default:
     return false; // unreachable
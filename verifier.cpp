@@ -0,0 +1,572 @@
+#include "verifier.h"
+#include "chunk.h"
+#include "object.h"
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+namespace {
+bool isKnownOpCode(OpCode op) {
+  switch (op) {
+  case OpCode::CONSTANT:
+  case OpCode::RETURN:
+  case OpCode::NEGATE:
+  case OpCode::ADD:
+  case OpCode::SUBTRACT:
+  case OpCode::MULTIPLY:
+  case OpCode::DIVIDE:
+  case OpCode::FALSE:
+  case OpCode::TRUE:
+  case OpCode::NIL:
+  case OpCode::NOT:
+  case OpCode::EQUAL:
+  case OpCode::GREATER:
+  case OpCode::LESS:
+  case OpCode::PRINT:
+  case OpCode::POP:
+  case OpCode::DEFINE_GLOBAL:
+  case OpCode::GET_GLOBAL:
+  case OpCode::SET_GLOBAL:
+  case OpCode::GET_LOCAL:
+  case OpCode::SET_LOCAL:
+  case OpCode::JUMP_IF_FALSE:
+  case OpCode::JUMP:
+  case OpCode::LOOP:
+  case OpCode::CALL:
+  case OpCode::CLOSURE:
+  case OpCode::GET_UPVALUE:
+  case OpCode::SET_UPVALUE:
+  case OpCode::CLOSE_UPVALUE:
+  case OpCode::CLASS:
+  case OpCode::SET_PROPERTY:
+  case OpCode::GET_PROPERTY:
+  case OpCode::METHOD:
+  case OpCode::INVOKE:
+  case OpCode::INHERIT:
+  case OpCode::GET_SUPER:
+  case OpCode::SUPER_INVOKE:
+  case OpCode::GUARD_CALLEE:
+  case OpCode::GUARD_METHOD:
+  case OpCode::INLINE_RETURN:
+  case OpCode::ADD_NUMBER:
+  case OpCode::SUBTRACT_NUMBER:
+  case OpCode::MULTIPLY_NUMBER:
+  case OpCode::DIVIDE_NUMBER:
+  case OpCode::NEGATE_NUMBER:
+  case OpCode::GREATER_NUMBER:
+  case OpCode::LESS_NUMBER:
+  case OpCode::FOR_INCR_LT:
+  case OpCode::WIDE:
+  case OpCode::JUMP_LONG:
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::LOOP_LONG:
+  case OpCode::IMPORT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// What the one-byte (or, after WIDE, two-byte) index operand refers to.
+enum class IndexOperand { NONE, CONSTANT, NAME, FUNCTION, LOCAL, UPVALUE };
+
+IndexOperand indexOperand(OpCode op) {
+  switch (op) {
+  case OpCode::CONSTANT:
+    return IndexOperand::CONSTANT;
+  case OpCode::DEFINE_GLOBAL:
+  case OpCode::GET_GLOBAL:
+  case OpCode::SET_GLOBAL:
+  case OpCode::CLASS:
+  case OpCode::GET_PROPERTY:
+  case OpCode::SET_PROPERTY:
+  case OpCode::METHOD:
+  case OpCode::GET_SUPER:
+  case OpCode::INVOKE:
+  case OpCode::SUPER_INVOKE:
+  case OpCode::IMPORT:
+    return IndexOperand::NAME;
+  case OpCode::CLOSURE:
+    return IndexOperand::FUNCTION;
+  case OpCode::GET_LOCAL:
+  case OpCode::SET_LOCAL:
+    return IndexOperand::LOCAL;
+  case OpCode::GET_UPVALUE:
+  case OpCode::SET_UPVALUE:
+    return IndexOperand::UPVALUE;
+  default:
+    return IndexOperand::NONE;
+  }
+}
+
+bool isWide(const Chunk &chunk, int offset) {
+  return from_uint8(chunk.code[offset]) == OpCode::WIDE;
+}
+
+// Opcode and index operand of the instruction at `offset`, looking through
+// the WIDE prefix.
+OpCode opAt(const Chunk &chunk, int offset) {
+  return from_uint8(chunk.code[isWide(chunk, offset) ? offset + 1 : offset]);
+}
+
+int indexAt(const Chunk &chunk, int offset) {
+  if (isWide(chunk, offset)) {
+    return chunk.code[offset + 2] << 8 | chunk.code[offset + 3];
+  }
+  return chunk.code[offset + 1];
+}
+
+uint16_t shortAt(const Chunk &chunk, int offset) {
+  return chunk.code[offset] << 8 | chunk.code[offset + 1];
+}
+
+// Target offset of a jump, or nothing for other instructions.
+std::optional<int64_t> jumpTarget(const Chunk &chunk, int offset) {
+  int64_t end = offset + chunk.InstructionLength(offset);
+  switch (from_uint8(chunk.code[offset])) {
+  case OpCode::JUMP:
+  case OpCode::JUMP_IF_FALSE:
+    return end + shortAt(chunk, offset + 1);
+  case OpCode::LOOP:
+    return end - shortAt(chunk, offset + 1);
+  case OpCode::GUARD_CALLEE:
+  case OpCode::GUARD_METHOD:
+    return end + shortAt(chunk, offset + 3);
+  case OpCode::FOR_INCR_LT:
+    return end - shortAt(chunk, offset + 3);
+  case OpCode::JUMP_LONG:
+  case OpCode::JUMP_IF_FALSE_LONG:
+    return end + chunk.long_jumps[shortAt(chunk, offset + 1)];
+  case OpCode::LOOP_LONG:
+    return end - chunk.long_jumps[shortAt(chunk, offset + 1)];
+  default:
+    return std::nullopt;
+  }
+}
+
+bool isNumberOp(OpCode op) {
+  switch (op) {
+  case OpCode::ADD_NUMBER:
+  case OpCode::SUBTRACT_NUMBER:
+  case OpCode::MULTIPLY_NUMBER:
+  case OpCode::DIVIDE_NUMBER:
+  case OpCode::NEGATE_NUMBER:
+  case OpCode::GREATER_NUMBER:
+  case OpCode::LESS_NUMBER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool fallsThrough(OpCode op) {
+  switch (op) {
+  case OpCode::JUMP:
+  case OpCode::JUMP_LONG:
+  case OpCode::LOOP:
+  case OpCode::LOOP_LONG:
+  case OpCode::RETURN:
+    return false;
+  default:
+    return true;
+  }
+}
+} // namespace
+
+bool Verifier::verify(ObjFunction *script) {
+  verified_.clear();
+  // The VM calls a script with no arguments and no upvalues to capture.
+  if (script->arity != 0 || script->upvalue_count != 0) {
+    return fail(*script->chunk, 0,
+                "Script cannot take arguments or upvalues.");
+  }
+  return verifyFunction(script);
+}
+
+bool Verifier::verifyCompiled(ObjFunction *function) {
+  verified_.clear();
+  return verifyFunction(function);
+}
+
+bool Verifier::verifyFunction(ObjFunction *function) {
+  // A lazy function is verified once the VM compiles it.
+  if (function->lazy != nullptr || !verified_.insert(function).second) {
+    return true;
+  }
+  // Bounds of what CALL and CLOSURE operands can encode.
+  if (function->arity < 0 || function->arity > UINT8_MAX ||
+      function->upvalue_count < 0 || function->upvalue_count > UINT16_MAX) {
+    return fail(*function->chunk, 0, "Function header out of range.");
+  }
+  if (!verifyChunk(function, *function->chunk)) {
+    return false;
+  }
+  if (function->number_chunk != nullptr &&
+      !verifyChunk(function, *function->number_chunk)) {
+    return false;
+  }
+  for (const auto &constant : function->chunk->constants) {
+    if (obj_helpers::IsFunction(constant) &&
+        !verifyFunction(obj_helpers::AsFunction(constant))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that the instruction at `offset` is complete and that its constant,
+// upvalue and jump table operands are in range. Local slots depend on the
+// stack height and are checked in verifyChunk.
+bool Verifier::checkOperands(const ObjFunction *function, const Chunk &chunk,
+                             int offset) {
+  int size = chunk.code.size();
+  auto op = from_uint8(chunk.code[offset]);
+  if (!isKnownOpCode(op)) {
+    return fail(chunk, offset, "Unknown opcode.");
+  }
+  if (op == OpCode::WIDE) {
+    if (offset + 1 >= size) {
+      return fail(chunk, offset, "Truncated instruction.");
+    }
+    op = from_uint8(chunk.code[offset + 1]);
+    if (indexOperand(op) == IndexOperand::NONE) {
+      return fail(chunk, offset, "Instruction has no wide form.");
+    }
+  }
+
+  auto kind = indexOperand(op);
+  if (kind != IndexOperand::NONE) {
+    if (offset + (isWide(chunk, offset) ? 4 : 2) > size) {
+      return fail(chunk, offset, "Truncated instruction.");
+    }
+    int index = indexAt(chunk, offset);
+    bool in_pool = index < chunk.constants.size();
+    if (kind == IndexOperand::CONSTANT && !in_pool) {
+      return fail(chunk, offset, "Constant index out of range.");
+    }
+    if (kind == IndexOperand::NAME &&
+        !(in_pool && obj_helpers::IsString(chunk.constants[index]))) {
+      return fail(chunk, offset, "Expected a name constant.");
+    }
+    if (kind == IndexOperand::FUNCTION &&
+        !(in_pool && obj_helpers::IsFunction(chunk.constants[index]))) {
+      return fail(chunk, offset, "Expected a function constant.");
+    }
+    if (kind == IndexOperand::UPVALUE && index >= function->upvalue_count) {
+      return fail(chunk, offset, "Upvalue index out of range.");
+    }
+  }
+
+  // Safe now that a CLOSURE's function constant is known to exist.
+  if (offset + chunk.InstructionLength(offset) > size) {
+    return fail(chunk, offset, "Truncated instruction.");
+  }
+
+  switch (op) {
+  case OpCode::GUARD_CALLEE:
+  case OpCode::GUARD_METHOD: {
+    int index = chunk.code[offset + 2];
+    if (index >= chunk.constants.size() ||
+        !obj_helpers::IsFunction(chunk.constants[index])) {
+      return fail(chunk, offset, "Expected a function constant.");
+    }
+    break;
+  }
+  case OpCode::FOR_INCR_LT: {
+    int index = chunk.code[offset + 2];
+    if (index >= chunk.constants.size() ||
+        !Value::IsNumber(chunk.constants[index])) {
+      return fail(chunk, offset, "Expected a number constant.");
+    }
+    break;
+  }
+  case OpCode::JUMP_LONG:
+  case OpCode::JUMP_IF_FALSE_LONG:
+  case OpCode::LOOP_LONG:
+    if (shortAt(chunk, offset + 1) >= chunk.long_jumps.size()) {
+      return fail(chunk, offset, "Long jump index out of range.");
+    }
+    break;
+  case OpCode::CLOSURE: {
+    auto closure_function =
+        obj_helpers::AsFunction(chunk.constants[indexAt(chunk, offset)]);
+    bool wide = isWide(chunk, offset);
+    int entry = offset + (wide ? 4 : 2);
+    for (int i = 0; i < closure_function->upvalue_count; i++) {
+      uint8_t is_local = chunk.code[entry];
+      int index = wide ? shortAt(chunk, entry + 1) : chunk.code[entry + 1];
+      if (is_local > 1) {
+        return fail(chunk, offset, "Malformed upvalue capture.");
+      }
+      if (!is_local && index >= function->upvalue_count) {
+        return fail(chunk, offset, "Upvalue index out of range.");
+      }
+      entry += wide ? 3 : 2;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  return true;
+}
+
+bool Verifier::verifyChunk(ObjFunction *function, const Chunk &chunk) {
+  int size = chunk.code.size();
+  if (size == 0) {
+    return fail(chunk, 0, "Empty chunk.");
+  }
+
+  std::vector<bool> is_boundary(size, false);
+  for (int offset = 0; offset < size;
+       offset += chunk.InstructionLength(offset)) {
+    if (!checkOperands(function, chunk, offset)) {
+      return false;
+    }
+    is_boundary[offset] = true;
+  }
+  int previous_end = 0;
+  for (const auto &run : chunk.inlined) {
+    if (run.start < previous_end || run.end <= run.start || run.end > size) {
+      return fail(chunk, 0, "Malformed inlined run.");
+    }
+    if (run.callee < 0 || run.callee >= chunk.constants.size() ||
+        !obj_helpers::IsFunction(chunk.constants[run.callee])) {
+      return fail(chunk, run.start, "Expected a function constant.");
+    }
+    previous_end = run.end;
+  }
+
+  // Stack height on entry to each instruction, counting slot 0 and the
+  // arguments. Every path into an instruction must agree on it.
+  std::vector<int> heights(size, -1);
+  heights[0] = function->arity + 1;
+  int max_height = heights[0];
+  std::vector<int> worklist{0};
+  while (!worklist.empty()) {
+    int offset = worklist.back();
+    worklist.pop_back();
+    int height = heights[offset];
+    auto op = opAt(chunk, offset);
+
+    if (height < chunk.PopCount(offset)) {
+      return fail(chunk, offset, "Stack underflow.");
+    }
+    // A guard reads the callee from under its arguments.
+    if ((op == OpCode::GUARD_CALLEE || op == OpCode::GUARD_METHOD) &&
+        chunk.code[offset + 1] >= height) {
+      return fail(chunk, offset, "Argument count exceeds the stack.");
+    }
+    bool local_ok = true;
+    if (indexOperand(op) == IndexOperand::LOCAL) {
+      local_ok = indexAt(chunk, offset) < height;
+    } else if (op == OpCode::FOR_INCR_LT) {
+      // The limit is on top of the counter's frame.
+      local_ok = chunk.code[offset + 1] < height - 1;
+    } else if (op == OpCode::CLOSURE) {
+      auto closure_function =
+          obj_helpers::AsFunction(chunk.constants[indexAt(chunk, offset)]);
+      bool wide = isWide(chunk, offset);
+      int entry = offset + (wide ? 4 : 2);
+      for (int i = 0; i < closure_function->upvalue_count; i++) {
+        int index = wide ? shortAt(chunk, entry + 1) : chunk.code[entry + 1];
+        local_ok = local_ok && (!chunk.code[entry] || index < height);
+        entry += wide ? 3 : 2;
+      }
+    }
+    if (!local_ok) {
+      return fail(chunk, offset, "Local slot out of range.");
+    }
+
+    int next_height = height + chunk.StackEffect(offset);
+    max_height = std::max(max_height, next_height);
+
+    std::vector<int64_t> successors;
+    if (auto target = jumpTarget(chunk, offset)) {
+      if (*target < 0 || *target >= size || !is_boundary[*target]) {
+        return fail(chunk, offset, "Jump target is not an instruction.");
+      }
+      successors.push_back(*target);
+    }
+    if (fallsThrough(op)) {
+      int next = offset + chunk.InstructionLength(offset);
+      if (next >= size) {
+        return fail(chunk, offset, "Execution runs off the end of the chunk.");
+      }
+      successors.push_back(next);
+    }
+    for (auto successor : successors) {
+      if (heights[successor] == -1) {
+        heights[successor] = next_height;
+        worklist.push_back(successor);
+      } else if (heights[successor] != next_height) {
+        return fail(chunk, successor, "Inconsistent stack height.");
+      }
+    }
+  }
+
+  if (!checkNumberOperands(function, chunk, heights)) {
+    return false;
+  }
+  function->max_stack = std::max(function->max_stack, max_height);
+  return true;
+}
+
+// The *_NUMBER instructions skip their type checks, so their operands must be
+// numbers on every path. Tracks which stack slots are known to hold one, as
+// the optimizer did when it specialized them. Arguments are numbers only in
+// the number chunk, under the entry guard in VM::call.
+bool Verifier::checkNumberOperands(const ObjFunction *function,
+                                   const Chunk &chunk,
+                                   const std::vector<int> &heights) {
+  int size = chunk.code.size();
+  bool has_number_ops = false;
+  int max_height = 0;
+  for (int offset = 0; offset < size;
+       offset += chunk.InstructionLength(offset)) {
+    has_number_ops = has_number_ops || isNumberOp(opAt(chunk, offset));
+    max_height = std::max(max_height, heights[offset]);
+  }
+  if (!has_number_ops) {
+    return true;
+  }
+
+  // Slots captured by a closure can be written by any call.
+  std::vector<bool> captured(max_height, false);
+  for (int offset = 0; offset < size;
+       offset += chunk.InstructionLength(offset)) {
+    if (heights[offset] == -1 || opAt(chunk, offset) != OpCode::CLOSURE) {
+      continue;
+    }
+    auto closure_function =
+        obj_helpers::AsFunction(chunk.constants[indexAt(chunk, offset)]);
+    bool wide = isWide(chunk, offset);
+    int entry = offset + (wide ? 4 : 2);
+    for (int i = 0; i < closure_function->upvalue_count; i++) {
+      if (chunk.code[entry]) {
+        captured[wide ? shortAt(chunk, entry + 1) : chunk.code[entry + 1]] =
+            true;
+      }
+      entry += wide ? 3 : 2;
+    }
+  }
+
+  std::vector<std::vector<bool>> states(size);
+  std::vector<bool> entry(function->arity + 1,
+                          function->number_chunk.get() == &chunk);
+  entry[0] = false;
+  for (int slot = 0; slot < entry.size(); slot++) {
+    entry[slot] = entry[slot] && !captured[slot];
+  }
+  states[0] = entry;
+  std::vector<int> worklist{0};
+  while (!worklist.empty()) {
+    int offset = worklist.back();
+    worklist.pop_back();
+    auto stack = states[offset];
+    auto op = opAt(chunk, offset);
+    auto pop = [&stack]() {
+      bool is_number = stack.back();
+      stack.pop_back();
+      return is_number;
+    };
+
+    if (isNumberOp(op)) {
+      bool known = op == OpCode::NEGATE_NUMBER
+                       ? stack.back()
+                       : stack.back() && stack[stack.size() - 2];
+      if (!known) {
+        return fail(chunk, offset, "Operands are not known to be numbers.");
+      }
+    }
+    switch (op) {
+    case OpCode::CONSTANT:
+      stack.push_back(
+          Value::IsNumber(chunk.constants[indexAt(chunk, offset)]));
+      break;
+    case OpCode::GET_LOCAL:
+      stack.push_back(stack[indexAt(chunk, offset)]);
+      break;
+    case OpCode::SET_LOCAL: {
+      int slot = indexAt(chunk, offset);
+      stack[slot] = stack.back() && !captured[slot];
+      break;
+    }
+    case OpCode::ADD: {
+      bool b = pop();
+      bool a = pop();
+      stack.push_back(a && b);
+      break;
+    }
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::ADD_NUMBER:
+    case OpCode::SUBTRACT_NUMBER:
+    case OpCode::MULTIPLY_NUMBER:
+    case OpCode::DIVIDE_NUMBER:
+      // Either both operands are numbers or the instruction throws.
+      pop();
+      pop();
+      stack.push_back(true);
+      break;
+    case OpCode::NEGATE:
+    case OpCode::NEGATE_NUMBER:
+      pop();
+      stack.push_back(true);
+      break;
+    case OpCode::FOR_INCR_LT: {
+      int slot = chunk.code[offset + 1];
+      pop();
+      stack[slot] = !captured[slot];
+      break;
+    }
+    default: {
+      int pops = chunk.PopCount(offset);
+      int pushes = chunk.StackEffect(offset) + pops;
+      stack.resize(stack.size() - pops);
+      stack.resize(stack.size() + pushes, false);
+      break;
+    }
+    }
+
+    std::vector<int64_t> successors;
+    if (auto target = jumpTarget(chunk, offset)) {
+      successors.push_back(*target);
+    }
+    if (fallsThrough(op)) {
+      successors.push_back(offset + chunk.InstructionLength(offset));
+    }
+    for (auto successor : successors) {
+      auto &state = states[successor];
+      if (state.empty()) {
+        state = stack;
+        worklist.push_back(successor);
+        continue;
+      }
+      // A slot stays a number only if it is one on every path.
+      bool changed = false;
+      for (int i = 0; i < state.size(); i++) {
+        if (state[i] && !stack[i]) {
+          state[i] = false;
+          changed = true;
+        }
+      }
+      if (changed) {
+        worklist.push_back(successor);
+      }
+    }
+  }
+  return true;
+}
+
+bool Verifier::fail(const Chunk &chunk, int offset,
+                    const std::string &message) {
+  errors_ << std::format("[line {}] Invalid bytecode at offset {}: {}",
+                         chunk.GetLine(offset), offset, message)
+          << std::endl;
+  return false;
+}
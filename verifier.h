@@ -0,0 +1,34 @@
+#pragma once
+
+#include "chunk.h"
+#include "object.h"
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Load-time bytecode verifier. Checks every chunk in a function tree before it
+// runs: opcodes, operand bounds, jump targets, stack depth and the operand
+// types the number-specialized instructions assume. VM::run relies on a
+// verified tree to dispatch without checking for those itself.
+class Verifier {
+public:
+  explicit Verifier(std::ostream &errors = std::cerr) : errors_(errors) {}
+
+  bool verify(ObjFunction *script);
+  // Verifies a lazily compiled body, which unlike a script may take
+  // arguments and capture upvalues.
+  bool verifyCompiled(ObjFunction *function);
+
+private:
+  bool verifyFunction(ObjFunction *function);
+  bool verifyChunk(ObjFunction *function, const Chunk &chunk);
+  bool checkOperands(const ObjFunction *function, const Chunk &chunk,
+                     int offset);
+  bool checkNumberOperands(const ObjFunction *function, const Chunk &chunk,
+                           const std::vector<int> &heights);
+  bool fail(const Chunk &chunk, int offset, const std::string &message);
+
+  std::ostream &errors_;
+  std::unordered_set<ObjFunction *> verified_;
+};
@@ -2,12 +2,16 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "module_cache.h"
 #include "object.h"
+#include "verifier.h"
+#include <atomic>
 #include <cstdint>
 #include <format>
 #include <iostream>
 #include <memory>
 #include <ranges>
+#include <utility>
 
 namespace {
 Value clockNative(int arg_count, Value *args) {
@@ -16,28 +20,132 @@ Value clockNative(int arg_count, Value *args) {
 }
 } // namespace
 
+VM::VM(CompilerOptions options, std::ostream &out, std::ostream &err)
+    : compiler_options_(options), out_(out), err_(err) {
+  compiler_options_.errors = &err;
+  defineNatives();
+}
+
+VM::~VM() {
+  if (tasks_ != nullptr) {
+    tasks_->wait();
+  }
+  // With no roots, every cycle left is garbage.
+  heap_.collect({});
+}
+
+void VM::defineNatives() {
+  defineNative("spawn", &VM::spawnNative);
+  defineNative("resume", &VM::resumeNative);
+  defineNative("yield", &VM::yieldNative);
+  defineNative("done", &VM::doneNative);
+  defineNative("join", &VM::joinNative);
+  defineNative("sleep", &VM::sleepNative);
+  defineNative("readFile", &VM::readFileNative);
+  defineNative("spawnTask", &VM::spawnTaskNative);
+  defineNative("parallelMap", &VM::parallelMapNative);
+  defineNative("array", &VM::arrayNative);
+  defineNative("push", &VM::pushNative);
+  defineNative("get", &VM::getNative);
+  defineNative("set", &VM::setNative);
+  defineNative("length", &VM::lengthNative);
+  defineNative("freeze", &VM::freezeNative);
+  defineNative("isFrozen", &VM::isFrozenNative);
+  defineNative("channel", &VM::channelNative);
+  defineNative("send", &VM::sendNative);
+  defineNative("receive", &VM::receiveNative);
+}
+
 InterpretResult VM::interpret(const std::string &source) {
-  Compiler compiler;
+  InternTable::Scope strings(strings_);
+  Compiler compiler(compiler_options_);
   auto function = compiler.compile(source);
   if (function == nullptr) {
     return InterpretResult::InterpretCompileError;
   }
+  return interpret(std::move(function));
+}
+
+InterpretResult VM::interpret(std::shared_ptr<ObjFunction> function,
+                              std::filesystem::path directory) {
+  if (!Verifier(err_).verify(function.get())) {
+    return InterpretResult::InterpretCompileError;
+  }
+  return runScript(std::move(function), std::move(directory));
+}
 
-  auto closure = std::make_shared<ObjClosure>(function.get());
+InterpretResult
+VM::interpret(const std::shared_ptr<const Program> &program) {
+  return runScript(std::shared_ptr<ObjFunction>(program, program->script()),
+                   program->directory());
+}
+
+InterpretResult VM::runScript(std::shared_ptr<ObjFunction> function,
+                              std::filesystem::path directory) {
+  InternTable::Scope strings(strings_);
+  directory_ = std::move(directory);
+
+  // Globals persist from one script to the next; the stack does not.
+  fiber_ = heap_.make<ObjFiber>();
+  root_ = fiber_.get();
+  scripts_->push_back(function);
+  auto closure = heap_.make<ObjClosure>(function.get());
   push(Value::Object(closure));
   call(closure.get(), 0);
 
   return run();
 }
 
+void VM::runTask(Task &task) {
+  InternTable::Scope strings(strings_);
+  if (task.globals != task_globals_) {
+    globals_.clear();
+    defineNatives();
+    for (const auto &[name, function] : *task.globals) {
+      globals_[name] =
+          Value::Object(heap_.make<ObjClosure>(function.get()));
+    }
+    task_globals_ = task.globals;
+  }
+
+  fiber_ = heap_.make<ObjFiber>();
+  root_ = fiber_.get();
+  auto root = fiber_;
+  auto closure = heap_.make<ObjClosure>(task.function.get());
+  push(Value::Object(closure));
+  for (const auto &arg : task.args) {
+    push(fromPortable(arg));
+  }
+  task.ok = call(closure.get(), task.args.size()) &&
+            run() == InterpretResult::InterpretOk;
+  if (task.ok && !toPortable(root->result, task.result)) {
+    err_ << "A task can only return numbers, strings, booleans, nil, arrays "
+            "and frozen values."
+         << std::endl;
+    task.ok = false;
+  }
+}
+
 InterpretResult VM::run() {
-  auto &current_frame = frames_.back();
-  auto read_byte = [this, &current_frame]() -> uint8_t {
-    return current_frame.closure->function->chunk
-        ->code[current_frame.code_idx++];
+  // Calls, returns and fiber switches move this to the new top frame.
+  CallFrame *frame = &fiber_->frames.back();
+  auto read_byte = [&frame]() -> uint8_t {
+    return frame->chunk->code[frame->code_idx++];
+  };
+  auto read_short = [&read_byte]() -> uint16_t {
+    uint16_t high = read_byte();
+    return high << 8 | read_byte();
   };
-  auto read_constant = [this, &read_byte, &current_frame]() -> Value {
-    return current_frame.closure->function->chunk->constants[read_byte()];
+  // Index operands are one byte, or two after a WIDE prefix.
+  bool wide = false;
+  auto read_index = [&wide, &read_byte, &read_short]() -> uint16_t {
+    return wide ? read_short() : read_byte();
+  };
+  auto read_constant = [&frame, &read_index]() -> Value {
+    return frame->chunk->constants[read_index()];
+  };
+  auto read_long_jump = [&frame, &read_short]() -> uint32_t {
+    return frame->chunk->long_jumps[read_short()];
   };
   auto read_string = [this, &read_constant]() -> std::string {
     return obj_helpers::AsString(read_constant())->str;
@@ -52,22 +160,48 @@ InterpretResult VM::run() {
     double a = Value::AsNumber(pop());                                         \
     push(valueType(a op b));                                                   \
   } while (false)
+// Operand types were proven by inference and the entry guard in call().
+#define NUMBER_OP(valueType, op)                                               \
+  do {                                                                         \
+    double b = Value::AsNumber(pop());                                         \
+    double a = Value::AsNumber(pop());                                         \
+    push(valueType(a op b));                                                   \
+  } while (false)
 
   while (true) {
+    // Between instructions every object in use is reachable from the VM.
+    if (heap_.due()) [[unlikely]] {
+      collectGarbage();
+    }
 #ifdef DEBUG_TRACE_EXECUTION
-    disassembleInstruction(*current_frame.closure->function->chunk,
-                           current_frame.code_idx);
-    printStack();
+    if (!wide) {
+      disassembleInstruction(*frame->chunk, frame->code_idx, out_);
+      printStack();
+    }
 #endif
     uint8_t instruction = read_byte();
     switch (from_uint8(instruction)) {
     case OpCode::RETURN: {
-      closeUpvalues(frames_.back().value_idx);
-      frames_.pop_back();
-      if (frames_.empty()) {
-        pop();
-        return InterpretResult::InterpretOk;
+      auto result = pop();
+      closeUpvalues(frame->value_idx);
+      fiber_->stack.resize(frame->value_idx);
+      fiber_->frames.pop_back();
+      if (!fiber_->frames.empty()) {
+        push(result);
+      } else {
+        // A fiber's function returning finishes it. The resume() that ran
+        // it returns the result; a fiber the scheduler woke has nobody to
+        // return to and gives way to the next ready one.
+        finishFiber(*fiber_, result);
+        if (fiber_.get() == root_) {
+          return InterpretResult::InterpretOk;
+        } else if (fiber_->resumer != nullptr) {
+          returnToResumer(result);
+        } else if (!schedule()) {
+          return InterpretResult::InterpretRuntimeError;
+        }
       }
+      frame = &fiber_->frames.back();
       break;
     }
     case OpCode::NEGATE: {
@@ -80,9 +214,10 @@ InterpretResult VM::run() {
     }
     case OpCode::ADD: {
       if (obj_helpers::IsString(peek(0)) && obj_helpers::IsString(peek(1))) {
-        const auto &a = obj_helpers::AsString(peek(0))->str;
-        const auto &b = obj_helpers::AsString(peek(1))->str;
-        push(Value::Object(ObjString::getObject(a + b)));
+        auto b = pop();
+        auto a = pop();
+        push(Value::Object(ObjString::getObject(
+            obj_helpers::AsString(a)->str + obj_helpers::AsString(b)->str)));
       } else if (Value::IsNumber(peek(0)) && Value::IsNumber(peek(1))) {
         double b = Value::AsNumber(pop());
         double a = Value::AsNumber(pop());
@@ -106,7 +241,7 @@ InterpretResult VM::run() {
       break;
     }
     case OpCode::NOT: {
-      push(Value::Bool(!isFalsey(peek(0))));
+      push(Value::Bool(isFalsey(pop())));
       break;
     }
     case OpCode::FALSE: {
@@ -141,7 +276,7 @@ InterpretResult VM::run() {
       break;
     }
     case OpCode::PRINT: {
-      std::cout << pop() << std::endl;
+      out_ << pop() << std::endl;
       break;
     }
     case OpCode::POP: {
@@ -174,30 +309,77 @@ InterpretResult VM::run() {
       break;
     }
     case OpCode::GET_LOCAL: {
-      uint8_t slot = read_byte();
-      push(stack_[slot]);
+      uint16_t slot = read_index();
+      push(fiber_->stack[frame->value_idx + slot]);
       break;
     }
     case OpCode::SET_LOCAL: {
-      uint8_t slot = read_byte();
-      stack_[slot] = peek(0);
+      uint16_t slot = read_index();
+      fiber_->stack[frame->value_idx + slot] = peek(0);
       break;
     }
     case OpCode::JUMP_IF_FALSE: {
-      uint16_t offset = read_byte() << 8 | read_byte();
+      uint16_t offset = read_short();
       if (isFalsey(peek(0))) {
-        current_frame.code_idx += offset;
+        frame->code_idx += offset;
       }
       break;
     }
     case OpCode::JUMP: {
-      uint16_t offset = read_byte() << 8 | read_byte();
-      current_frame.code_idx += offset;
+      uint16_t offset = read_short();
+      frame->code_idx += offset;
       break;
     }
     case OpCode::LOOP: {
-      uint16_t offset = read_byte() << 8 | read_byte();
-      current_frame.code_idx -= offset;
+      uint16_t offset = read_short();
+      frame->code_idx -= offset;
+      break;
+    }
+    case OpCode::JUMP_IF_FALSE_LONG: {
+      uint32_t offset = read_long_jump();
+      if (isFalsey(peek(0))) {
+        frame->code_idx += offset;
+      }
+      break;
+    }
+    case OpCode::JUMP_LONG: {
+      uint32_t offset = read_long_jump();
+      frame->code_idx += offset;
+      break;
+    }
+    case OpCode::LOOP_LONG: {
+      uint32_t offset = read_long_jump();
+      frame->code_idx -= offset;
+      break;
+    }
+    case OpCode::WIDE: {
+      wide = true;
+      continue;
+    }
+    case OpCode::FOR_INCR_LT: {
+      // Fused `i = i + step; if (i < limit) loop` for counted for loops. The
+      // limit was pushed by the instructions just before.
+      size_t slot = frame->value_idx + read_byte();
+      double step = Value::AsNumber(read_constant());
+      uint16_t offset = read_short();
+      auto &stack = fiber_->stack;
+      if (!Value::IsNumber(stack[slot]) || !Value::IsNumber(peek(0))) {
+        runtimeError("Operands must be numbers.");
+        return InterpretResult::InterpretRuntimeError;
+      }
+      double limit = Value::AsNumber(pop());
+      double counter = Value::AsNumber(stack[slot]) + step;
+      stack[slot] = Value::Number(counter);
+      if (counter < limit) {
+        frame->code_idx -= offset;
+      }
+      break;
+    }
+    case OpCode::IMPORT: {
+      if (auto result = importModule(read_string());
+          result != InterpretResult::InterpretOk) {
+        return result;
+      }
       break;
     }
     case OpCode::CALL: {
@@ -205,42 +387,46 @@ InterpretResult VM::run() {
       if (!callValue(peek(arg_count), arg_count)) {
         return InterpretResult::InterpretRuntimeError;
       }
+      frame = &fiber_->frames.back();
       break;
     }
     case OpCode::CLOSURE: {
       auto function = obj_helpers::AsFunction(read_constant());
-      auto closure = std::make_shared<ObjClosure>(function);
+      auto closure = function->escapes ? heap_.make<ObjClosure>(function)
+                                       : frameClosure(function);
       push(Value::Object(closure));
       for (int i = 0; i < closure->upvalue_count; i++) {
         auto isLocal = read_byte();
-        auto index = read_byte();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(index);
+        auto index = read_index();
+        if (isLocal && !function->escapes) {
+          frameUpvalue(closure->upvalues[i], frame->value_idx + index);
+        } else if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(frame->value_idx + index);
         } else {
-          closure->upvalues[i] = current_frame.closure->upvalues[index];
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
       }
 
       break;
     }
     case OpCode::GET_UPVALUE: {
-      uint8_t slot = read_byte();
-      push(stack_[current_frame.closure->upvalues[slot]->stack_idx]);
+      uint16_t slot = read_index();
+      push(frame->closure->upvalues[slot]->value());
       break;
     }
     case OpCode::SET_UPVALUE: {
-      uint8_t slot = read_byte();
-      stack_[current_frame.closure->upvalues[slot]->stack_idx] = peek(0);
+      uint16_t slot = read_index();
+      frame->closure->upvalues[slot]->value() = peek(0);
       break;
     }
     case OpCode::CLOSE_UPVALUE: {
-      closeUpvalues(stack_.size() - 1);
+      closeUpvalues(fiber_->stack.size() - 1);
       pop();
       break;
     }
     case OpCode::CLASS: {
       push(Value::Object(
-          std::make_shared<ObjClass>(obj_helpers::AsString(read_constant()))));
+          heap_.make<ObjClass>(obj_helpers::AsString(read_constant()))));
       break;
     }
     case OpCode::GET_PROPERTY: {
@@ -251,13 +437,16 @@ InterpretResult VM::run() {
 
       auto instance = obj_helpers::AsInstance(peek(0));
       auto name = read_string();
-      if (instance->fields.contains(name)) {
+      if (auto field = instance->fields.find(name);
+          field != instance->fields.end()) {
+        // Copied first: popping may free the instance.
+        Value value = field->second;
         pop();
-        push(instance->fields[name]);
+        push(value);
         break;
       }
 
-      if (!bindMethod(instance->klass, name)) {
+      if (!bindMethod(instance->klass.get(), name)) {
         return InterpretResult::InterpretRuntimeError;
       }
       break;
@@ -268,6 +457,10 @@ InterpretResult VM::run() {
         return InterpretResult::InterpretRuntimeError;
       }
       auto instance = obj_helpers::AsInstance(peek(1));
+      if (instance->frozen) {
+        runtimeError("Cannot modify a frozen instance.");
+        return InterpretResult::InterpretRuntimeError;
+      }
       instance->fields[read_string()] = peek(0);
       auto property = pop();
       pop();
@@ -288,6 +481,7 @@ InterpretResult VM::run() {
       if (!invoke(name, arg_count)) {
         return InterpretResult::InterpretRuntimeError;
       }
+      frame = &fiber_->frames.back();
       break;
     }
     case OpCode::INHERIT: {
@@ -319,43 +513,185 @@ InterpretResult VM::run() {
       if (!invokeFromClass(super_class, method_name, arg_count)) {
         return InterpretResult::InterpretRuntimeError;
       }
+      frame = &fiber_->frames.back();
+      break;
+    }
+    case OpCode::GUARD_CALLEE: {
+      // Read in place: copying the values would cost more than the call
+      // being skipped.
+      uint8_t arg_count = read_byte();
+      const auto &guard = frame->chunk->constants[read_index()];
+      uint16_t offset = read_short();
+      const auto &stack = fiber_->stack;
+      const auto &callee = stack[stack.size() - 1 - arg_count];
+      if (!obj_helpers::IsClosure(callee) ||
+          obj_helpers::AsClosure(callee)->function !=
+              obj_helpers::AsFunction(guard)) {
+        frame->code_idx += offset;
+      }
+      break;
+    }
+    case OpCode::GUARD_METHOD: {
+      uint8_t arg_count = read_byte();
+      auto function =
+          obj_helpers::AsFunction(frame->chunk->constants[read_index()]);
+      uint16_t offset = read_short();
+      const auto &stack = fiber_->stack;
+      if (!isMethod(stack[stack.size() - 1 - arg_count], function)) {
+        frame->code_idx += offset;
+      }
+      break;
+    }
+    case OpCode::INLINE_RETURN: {
+      uint8_t slot_count = read_byte();
+      auto &stack = fiber_->stack;
+      stack[stack.size() - 1 - slot_count] = std::move(stack.back());
+      stack.resize(stack.size() - slot_count);
+      break;
+    }
+    case OpCode::ADD_NUMBER: {
+      NUMBER_OP(Value::Number, +);
+      break;
+    }
+    case OpCode::SUBTRACT_NUMBER: {
+      NUMBER_OP(Value::Number, -);
+      break;
+    }
+    case OpCode::MULTIPLY_NUMBER: {
+      NUMBER_OP(Value::Number, *);
+      break;
+    }
+    case OpCode::DIVIDE_NUMBER: {
+      NUMBER_OP(Value::Number, /);
+      break;
+    }
+    case OpCode::NEGATE_NUMBER: {
+      push(Value::Number(-Value::AsNumber(pop())));
       break;
     }
-    default: {
-      runtimeError("Unknown opcode: " + std::to_string(instruction));
-      return InterpretResult::InterpretRuntimeError;
+    case OpCode::GREATER_NUMBER: {
+      NUMBER_OP(Value::Bool, >);
+      break;
+    }
+    case OpCode::LESS_NUMBER: {
+      NUMBER_OP(Value::Bool, <);
+      break;
     }
+    default:
+      // Every opcode was checked by the verifier when the program loaded.
+      std::unreachable();
     }
+    wide = false;
   }
 #undef BINARY_OP
+#undef NUMBER_OP
 }
 
-std::shared_ptr<ObjUpvalue> VM::captureUpvalue(uint8_t index) {
-  auto prev_it = openUpvalues_.before_begin();
-  auto it = openUpvalues_.begin();
+std::shared_ptr<ObjUpvalue>
+VM::captureUpvalue(size_t index, std::shared_ptr<ObjUpvalue> reuse) {
+  auto prev_it = fiber_->open_upvalues.before_begin();
+  auto it = fiber_->open_upvalues.begin();
 
-  while (it != openUpvalues_.end() && (*it)->stack_idx > index) {
+  while (it != fiber_->open_upvalues.end() &&
+         static_cast<size_t>((*it)->stack_idx) > index) {
     ++prev_it;
     ++it;
   }
 
-  if (it != openUpvalues_.end() && (*it)->stack_idx == index) {
+  if (it != fiber_->open_upvalues.end() &&
+      static_cast<size_t>((*it)->stack_idx) == index) {
     return *it;
   }
 
-  auto upvalue = std::make_shared<ObjUpvalue>(index);
+  auto upvalue = std::move(reuse);
+  if (upvalue != nullptr) {
+    upvalue->fiber = fiber_.get();
+    upvalue->stack_idx = index;
+    upvalue->closed = Value::Nil();
+  } else {
+    upvalue = heap_.make<ObjUpvalue>(fiber_.get(), index);
+  }
+  fiber_->open_upvalues.insert_after(prev_it, upvalue);
   return upvalue;
 }
 
-void VM::closeUpvalues(uint8_t index) {
-  while (!openUpvalues_.empty() && openUpvalues_.front()->stack_idx >= index) {
-    auto upvalue = openUpvalues_.front();
-    upvalue->closed = stack_[upvalue->stack_idx];
+std::shared_ptr<ObjClosure> VM::frameClosure(ObjFunction *function) {
+  // The compiler expects the closure to stay inside the scope that defines
+  // it. Once only the cache holds it, the previous one is dead and can be
+  // reused. A recursive activation of the enclosing function, or a callee
+  // that kept it, still holds it and gets a fresh one.
+  auto &closure = frame_closures_[function];
+  if (closure == nullptr || closure.use_count() != 1) {
+    closure = heap_.make<ObjClosure>(function);
+  }
+  return closure;
+}
+
+void VM::frameUpvalue(std::shared_ptr<ObjUpvalue> &upvalue, size_t index) {
+  // Opened like any other upvalue, so an inner closure that shares it and
+  // outlives the slot still gets the value when the slot is closed. Held
+  // only by the reused closure, the previous one is closed and dead, and is
+  // reused.
+  std::shared_ptr<ObjUpvalue> reuse;
+  if (upvalue != nullptr && upvalue.use_count() == 1) {
+    reuse = std::move(upvalue);
+  }
+  upvalue = captureUpvalue(index, std::move(reuse));
+}
+
+void VM::closeUpvalues(size_t index) {
+  auto &open_upvalues = fiber_->open_upvalues;
+  while (!open_upvalues.empty() &&
+         static_cast<size_t>(open_upvalues.front()->stack_idx) >= index) {
+    auto upvalue = fiber_->open_upvalues.front();
+    upvalue->closed = fiber_->stack[upvalue->stack_idx];
     upvalue->stack_idx = -1;
-    openUpvalues_.pop_front();
+    open_upvalues.pop_front();
   }
 }
 
+InterpretResult VM::importModule(const std::string &name) {
+  std::error_code error;
+  auto path = std::filesystem::weakly_canonical(directory_ / name, error);
+  if (error) {
+    runtimeError("Could not import \"" + name + "\".");
+    return InterpretResult::InterpretRuntimeError;
+  }
+  // Importing a module again, even from inside its own import, is a no-op:
+  // its globals are already defined or on their way.
+  if (!imported_.insert(path.string()).second) {
+    return InterpretResult::InterpretOk;
+  }
+  auto [module, errors] = ModuleCache::instance().load(path, compiler_options_);
+  if (module == nullptr) {
+    imported_.erase(path.string());
+    // A module that does not compile fails the import as a compile error.
+    err_ << errors;
+    runtimeError("Could not import \"" + name + "\".");
+    return errors.empty() ? InterpretResult::InterpretRuntimeError
+                          : InterpretResult::InterpretCompileError;
+  }
+
+  // The module runs on a fiber of its own and shares only the globals, so
+  // the importer's frames are set aside until it finishes.
+  importers_.push_back(std::exchange(fiber_, heap_.make<ObjFiber>()));
+  auto importer_root = std::exchange(root_, fiber_.get());
+  auto directory = std::exchange(directory_, path.parent_path());
+  auto closure = heap_.make<ObjClosure>(module.get());
+  push(Value::Object(closure));
+  call(closure.get(), 0);
+  auto result = run();
+
+  fiber_ = std::move(importers_.back());
+  importers_.pop_back();
+  root_ = importer_root;
+  directory_ = std::move(directory);
+  if (result != InterpretResult::InterpretOk) {
+    imported_.erase(path.string());
+  }
+  return result;
+}
+
 bool VM::callValue(Value callee, uint8_t arg_count) {
   if (!Value::IsObject(callee)) {
     runtimeError("Callee need to be an object");
@@ -367,20 +703,23 @@ bool VM::callValue(Value callee, uint8_t arg_count) {
     return call(obj_helpers::AsClosure(callee), arg_count);
   case Obj::Type::NATIVE: {
     auto native = obj_helpers::AsNative(callee);
-    auto result =
-        native(arg_count, stack_.data() + stack_.size() - arg_count - 1);
-    for (int i = 0; i < arg_count; i++) {
-      pop();
+    if (native->vm_function != nullptr) {
+      return (this->*native->vm_function)(arg_count);
     }
+    auto &stack = fiber_->stack;
+    auto result =
+        native->function(arg_count, stack.data() + stack.size() - arg_count);
+    stack.resize(stack.size() - arg_count - 1);
     push(result);
     return true;
   }
   case Obj::Type::CLASS: {
-    auto klass = obj_helpers::AsClass(callee);
-    stack_[stack_.size() - arg_count - 1] =
-        Value::Object(std::make_shared<ObjInstance>(klass));
+    auto klass = obj_helpers::AsShared<ObjClass>(callee);
+    auto &stack = fiber_->stack;
+    stack[stack.size() - arg_count - 1] =
+        Value::Object(heap_.make<ObjInstance>(klass));
     if (klass->methods.contains(initName)) {
-      auto method = obj_helpers::AsClosure(klass->methods[initName]);
+      auto method = obj_helpers::AsClosure(klass->methods.at(initName));
       return call(method, arg_count);
     } else if (arg_count != 0) {
       runtimeError("Expected 0 arguments but got " + std::to_string(arg_count) +
@@ -392,7 +731,8 @@ bool VM::callValue(Value callee, uint8_t arg_count) {
   }
   case Obj::Type::BOUND_METHOD: {
     auto bound = obj_helpers::AsBoundMethod(callee);
-    stack_[stack_.size() - arg_count - 1] = bound->receiver;
+    auto &stack = fiber_->stack;
+    stack[stack.size() - arg_count - 1] = bound->receiver;
     return call(bound->method, arg_count);
   }
   default:
@@ -413,11 +753,12 @@ bool VM::invoke(const std::string &name, uint8_t arg_count) {
 
   if (instance->fields.contains(name)) {
     auto value = instance->fields[name];
-    stack_[stack_.size() - arg_count - 1] = value;
+    auto &stack = fiber_->stack;
+    stack[stack.size() - arg_count - 1] = value;
     return callValue(value, arg_count);
   }
 
-  return invokeFromClass(instance->klass, name, arg_count);
+  return invokeFromClass(instance->klass.get(), name, arg_count);
 }
 
 bool VM::invokeFromClass(ObjClass *klass, const std::string &name,
@@ -427,60 +768,119 @@ bool VM::invokeFromClass(ObjClass *klass, const std::string &name,
     return false;
   }
 
-  auto method = obj_helpers::AsClosure(klass->methods[name]);
+  auto method = obj_helpers::AsClosure(klass->methods.at(name));
   return call(method, arg_count);
 }
 
-bool VM::call(ObjClosure *closure, uint8_t arg_count) {
+bool VM::isMethod(const Value &receiver, ObjFunction *function) {
+  if (!obj_helpers::IsInstance(receiver)) {
+    return false;
+  }
+  auto instance = obj_helpers::AsInstance(receiver);
+  const auto &name = function->name->str;
+  if (instance->fields.contains(name)) {
+    return false;
+  }
+  auto it = instance->klass->methods.find(name);
+  return it != instance->klass->methods.end() &&
+         obj_helpers::IsClosure(it->second) &&
+         obj_helpers::AsClosure(it->second)->function == function;
+}
+
+bool VM::checkCall(ObjClosure *closure, uint8_t arg_count) {
   if (arg_count != closure->function->arity) {
     runtimeError("Expected " + std::to_string(closure->function->arity) +
                  " arguments but got " + std::to_string(arg_count) + ".");
     return false;
   }
+  return ensureCompiled(closure->function);
+}
 
-  if (frames_.size() + 1 > FRAMES_MAX) {
+bool VM::call(ObjClosure *closure, uint8_t arg_count) {
+  if (!checkCall(closure, arg_count)) {
+    return false;
+  }
+  auto function = closure->function;
+
+  // The verifier bounds how deep the frame's stack gets, so this one check
+  // covers every push the call makes.
+  auto base = fiber_->stack.size() - arg_count - 1;
+  if (fiber_->frames.size() + 1 > FRAMES_MAX ||
+      base + function->max_stack > STACK_MAX) {
     runtimeError("Stack overflow.");
     return false;
   }
 
-  frames_.emplace_back(CallFrame{closure, 0, stack_.size() - arg_count - 1});
+  auto chunk = function->chunk.get();
+  if (function->number_chunk != nullptr) {
+    // Entry guard for the number-specialized chunk: one check per argument
+    // instead of one per arithmetic instruction.
+    bool all_numbers = true;
+    for (int i = 0; i < arg_count; i++) {
+      all_numbers = all_numbers && Value::IsNumber(peek(i));
+    }
+    if (all_numbers) {
+      chunk = function->number_chunk.get();
+    }
+  }
+
+  fiber_->frames.emplace_back(
+      CallFrame{closure, chunk, 0, base});
+  return true;
+}
+
+bool VM::ensureCompiled(ObjFunction *function) {
+  if (function->lazy != nullptr &&
+      (!Compiler(compiler_options_).compileLazy(function) ||
+       !Verifier(err_).verifyCompiled(function))) {
+    runtimeError("Could not compile function '" + function->name->str + "'.");
+    return false;
+  }
   return true;
 }
 
 Value VM::pop() {
-  Value value = stack_.back();
-  stack_.pop_back();
+  Value value = fiber_->stack.back();
+  fiber_->stack.pop_back();
   return value;
 }
 
-void VM::push(Value value) { stack_.push_back(value); }
+void VM::push(Value value) { fiber_->stack.push_back(value); }
 
 Value VM::peek(int distance) const {
-  return stack_[stack_.size() - 1 - distance];
+  return fiber_->stack[fiber_->stack.size() - 1 - distance];
 }
 
 void VM::printStack() {
-  for (auto &value : stack_) {
-    std::cout << std::vformat("[ {} ] ", std::make_format_args(value));
+  for (auto &value : fiber_->stack) {
+    out_ << std::vformat("[ {} ] ", std::make_format_args(value));
   }
-  std::cout << std::endl;
+  out_ << std::endl;
 }
 
 void VM::resetStack() {
-  stack_.clear();
-  openUpvalues_.clear();
+  // The old fiber closes its open upvalues as it goes.
+  fiber_ = heap_.make<ObjFiber>();
 }
 
 void VM::runtimeError(const std::string &message) {
-  std::cerr << message << std::endl;
+  err_ << message << std::endl;
 
-  for (const auto &frame : std::views::reverse(frames_)) {
+  for (const auto &frame : std::views::reverse(fiber_->frames)) {
     auto function = frame.closure->function;
     auto code_idx = frame.code_idx;
-    auto chunk = function->chunk;
-    auto line = chunk->lines[code_idx];
-    auto name = function->name->str.empty() ? function->name->str : "script";
-    std::cerr << "[line " << line << "] in " << name << std::endl;
+    auto chunk = frame.chunk;
+    // Code inlined into this frame reports the call it replaced as a frame
+    // of its own.
+    if (auto inlined = chunk->GetInlined(code_idx - 1)) {
+      auto callee = obj_helpers::AsFunction(chunk->constants[inlined->callee]);
+      err_ << "[line " << inlined->line << "] in "
+           << (callee->name != nullptr ? callee->name->str : "script")
+           << std::endl;
+    }
+    auto line = chunk->GetLine(code_idx - 1);
+    auto name = function->name != nullptr ? function->name->str : "script";
+    err_ << "[line " << line << "] in " << name << std::endl;
   }
 
   resetStack();
@@ -494,15 +894,646 @@ void VM::defineNative(const std::string &name, NativeFunction function) {
   globals_[name] = Value::Object(std::make_shared<ObjNative>(function));
 }
 
+void VM::defineNative(const std::string &name, VMFunction function) {
+  globals_[name] = Value::Object(std::make_shared<ObjNative>(function));
+}
+
+bool VM::spawnNative(uint8_t arg_count) {
+  if (arg_count == 0 || !obj_helpers::IsClosure(peek(arg_count - 1))) {
+    runtimeError("spawn() takes a function and its arguments.");
+    return false;
+  }
+  // Checked while the spawner is still current, so an error traces back to
+  // the spawn() call.
+  if (!checkCall(obj_helpers::AsClosure(peek(arg_count - 1)), arg_count - 1)) {
+    return false;
+  }
+  // The function and its arguments move to the new fiber, already called,
+  // so the first resume() starts running its body.
+  auto fiber = heap_.make<ObjFiber>();
+  auto &stack = fiber_->stack;
+  fiber->stack.assign(stack.end() - arg_count, stack.end());
+  stack.resize(stack.size() - arg_count - 1);
+  auto spawner = std::exchange(fiber_, fiber);
+  bool called =
+      call(obj_helpers::AsClosure(fiber->stack.front()), arg_count - 1);
+  fiber_ = std::move(spawner);
+  if (!called) {
+    return false;
+  }
+  push(Value::Object(fiber));
+  return true;
+}
+
+bool VM::resumeNative(uint8_t arg_count) {
+  if (arg_count < 1 || arg_count > 2 ||
+      !obj_helpers::IsFiber(peek(arg_count - 1))) {
+    runtimeError("resume() takes a fiber and an optional value.");
+    return false;
+  }
+  auto target = obj_helpers::AsShared<ObjFiber>(peek(arg_count - 1));
+  if (target->state == ObjFiber::State::RUNNING) {
+    runtimeError("Cannot resume a running fiber.");
+    return false;
+  }
+  if (target->state == ObjFiber::State::WAITING) {
+    runtimeError("Cannot resume a waiting fiber.");
+    return false;
+  }
+  if (target->state == ObjFiber::State::DONE) {
+    runtimeError("Cannot resume a finished fiber.");
+    return false;
+  }
+  auto value = arg_count == 2 ? pop() : Value::Nil();
+  fiber_->stack.resize(fiber_->stack.size() - 2);
+
+  bool suspended = target->state == ObjFiber::State::SUSPENDED;
+  target->state = ObjFiber::State::RUNNING;
+  target->resumer = std::exchange(fiber_, target);
+  // A suspended fiber gets the value back from its yield(); a new one
+  // starts its function instead.
+  if (suspended) {
+    push(value);
+  }
+  return true;
+}
+
+bool VM::yieldNative(uint8_t arg_count) {
+  if (arg_count > 1) {
+    runtimeError("yield() takes an optional value.");
+    return false;
+  }
+  if (fiber_.get() == root_) {
+    runtimeError("Cannot yield outside a fiber.");
+    return false;
+  }
+  auto value = arg_count == 1 ? pop() : Value::Nil();
+  pop();
+  fiber_->state = ObjFiber::State::SUSPENDED;
+  if (fiber_->resumer != nullptr) {
+    returnToResumer(value);
+    return true;
+  }
+  // The scheduler woke this fiber, so nobody takes the value.
+  return schedule();
+}
+
+bool VM::doneNative(uint8_t arg_count) {
+  if (arg_count != 1 || !obj_helpers::IsFiber(peek(0))) {
+    runtimeError("done() takes a fiber.");
+    return false;
+  }
+  bool done = obj_helpers::AsFiber(peek(0))->state == ObjFiber::State::DONE;
+  fiber_->stack.resize(fiber_->stack.size() - 2);
+  push(Value::Bool(done));
+  return true;
+}
+
+bool VM::joinNative(uint8_t arg_count) {
+  if (arg_count != 1 || !obj_helpers::IsFiber(peek(0))) {
+    runtimeError("join() takes a fiber.");
+    return false;
+  }
+  auto target = obj_helpers::AsShared<ObjFiber>(peek(0));
+  if (target == fiber_) {
+    runtimeError("A fiber cannot join itself.");
+    return false;
+  }
+  fiber_->stack.resize(fiber_->stack.size() - 2);
+  if (target->state == ObjFiber::State::DONE) {
+    push(target->result);
+    return true;
+  }
+  target->joiners.push_back(fiber_);
+  return park();
+}
+
+bool VM::sleepNative(uint8_t arg_count) {
+  if (arg_count != 1 || !Value::IsNumber(peek(0))) {
+    runtimeError("sleep() takes a number of milliseconds.");
+    return false;
+  }
+  std::chrono::milliseconds duration(
+      static_cast<int64_t>(Value::AsNumber(pop())));
+  pop();
+  auto id = eventLoop().sleep(duration);
+  io_waits_.emplace(id, IoWait{fiber_, nullptr});
+  return park();
+}
+
+bool VM::readFileNative(uint8_t arg_count) {
+  if (arg_count != 1 || !obj_helpers::IsString(peek(0))) {
+    runtimeError("readFile() takes a path.");
+    return false;
+  }
+  auto id = eventLoop().readFile(obj_helpers::AsString(peek(0))->str);
+  fiber_->stack.resize(fiber_->stack.size() - 2);
+  if (id == 0) {
+    push(Value::Nil());
+    return true;
+  }
+  io_waits_.emplace(id, IoWait{fiber_, [](EventLoop::Completion &read) {
+                      return read.ok ? Value::Object(
+                                           ObjString::getObject(read.data))
+                                     : Value::Nil();
+                    }});
+  return park();
+}
+
+bool VM::spawnTaskNative(uint8_t arg_count) {
+  if (arg_count == 0) {
+    runtimeError("spawnTask() takes a function and its arguments.");
+    return false;
+  }
+  auto task = std::make_shared<Task>();
+  if (!prepareTask(peek(arg_count - 1), *task)) {
+    return false;
+  }
+  for (int i = arg_count - 2; i >= 0; i--) {
+    if (!toPortable(peek(i), task->args.emplace_back())) {
+      runtimeError("Tasks only take numbers, strings, booleans, nil, arrays "
+                   "and frozen values.");
+      return false;
+    }
+  }
+  fiber_->stack.resize(fiber_->stack.size() - arg_count - 1);
+
+  // The task is stood in for by a fiber without frames that finishes when
+  // the task does, so join() and done() work on it.
+  auto fiber = heap_.make<ObjFiber>();
+  fiber->state = ObjFiber::State::WAITING;
+  auto [id, complete] = eventLoop().expect();
+  task->done = std::move(complete);
+  io_waits_.emplace(id, IoWait{fiber, [this, task](EventLoop::Completion &) {
+                                 return taskResult(*task);
+                               }});
+  submitTask(task);
+  push(Value::Object(fiber));
+  return true;
+}
+
+bool VM::parallelMapNative(uint8_t arg_count) {
+  if (arg_count != 2 || !obj_helpers::IsArray(peek(0))) {
+    runtimeError("parallelMap() takes a function and an array.");
+    return false;
+  }
+  Task prototype;
+  if (!prepareTask(peek(1), prototype)) {
+    return false;
+  }
+  auto tasks = std::make_shared<std::vector<std::shared_ptr<Task>>>();
+  for (const auto &item : obj_helpers::AsArray(peek(0))->items) {
+    auto &task = tasks->emplace_back(std::make_shared<Task>());
+    task->function = prototype.function;
+    task->globals = prototype.globals;
+    if (!toPortable(item, task->args.emplace_back())) {
+      runtimeError("Tasks only take numbers, strings, booleans, nil, arrays "
+                   "and frozen values.");
+      return false;
+    }
+  }
+  fiber_->stack.resize(fiber_->stack.size() - 3);
+  if (tasks->empty()) {
+    push(Value::Object(heap_.make<ObjArray>()));
+    return true;
+  }
+
+  // One wait for the whole map, finished by whichever task ends last.
+  auto [id, complete] = eventLoop().expect();
+  auto remaining = std::make_shared<std::atomic<size_t>>(tasks->size());
+  for (auto &task : *tasks) {
+    task->done = [remaining, complete] {
+      if (--*remaining == 0) {
+        complete();
+      }
+    };
+  }
+  io_waits_.emplace(id,
+                    IoWait{fiber_, [this, tasks](EventLoop::Completion &) {
+                             auto results = heap_.make<ObjArray>();
+                             for (const auto &task : *tasks) {
+                               results->items.push_back(taskResult(*task));
+                             }
+                             return Value::Object(results);
+                           }});
+  for (auto &task : *tasks) {
+    submitTask(task);
+  }
+  return park();
+}
+
+bool VM::arrayNative(uint8_t arg_count) {
+  auto array = heap_.make<ObjArray>();
+  auto &stack = fiber_->stack;
+  array->items.assign(stack.end() - arg_count, stack.end());
+  stack.resize(stack.size() - arg_count - 1);
+  push(Value::Object(array));
+  return true;
+}
+
+bool VM::pushNative(uint8_t arg_count) {
+  if (arg_count != 2 || !obj_helpers::IsArray(peek(1))) {
+    runtimeError("push() takes an array and a value.");
+    return false;
+  }
+  if (obj_helpers::AsArray(peek(1))->frozen) {
+    runtimeError("Cannot modify a frozen array.");
+    return false;
+  }
+  auto value = pop();
+  obj_helpers::AsArray(pop())->items.push_back(value);
+  pop();
+  push(Value::Nil());
+  return true;
+}
+
+bool VM::getNative(uint8_t arg_count) {
+  if (arg_count != 2) {
+    runtimeError("get() takes an array and an index.");
+    return false;
+  }
+  size_t index;
+  if (!arrayIndex(arg_count, index)) {
+    return false;
+  }
+  auto value = obj_helpers::AsArray(peek(1))->items[index];
+  fiber_->stack.resize(fiber_->stack.size() - 3);
+  push(value);
+  return true;
+}
+
+bool VM::setNative(uint8_t arg_count) {
+  if (arg_count != 3) {
+    runtimeError("set() takes an array, an index and a value.");
+    return false;
+  }
+  size_t index;
+  if (!arrayIndex(arg_count, index)) {
+    return false;
+  }
+  if (obj_helpers::AsArray(peek(2))->frozen) {
+    runtimeError("Cannot modify a frozen array.");
+    return false;
+  }
+  auto value = peek(0);
+  obj_helpers::AsArray(peek(2))->items[index] = value;
+  fiber_->stack.resize(fiber_->stack.size() - 4);
+  push(value);
+  return true;
+}
+
+bool VM::lengthNative(uint8_t arg_count) {
+  if (arg_count != 1 || !obj_helpers::IsArray(peek(0))) {
+    runtimeError("length() takes an array.");
+    return false;
+  }
+  auto length = obj_helpers::AsArray(pop())->items.size();
+  pop();
+  push(Value::Number(length));
+  return true;
+}
+
+// Checks the array and index arguments, which come first.
+bool VM::arrayIndex(uint8_t arg_count, size_t &index) {
+  auto array = peek(arg_count - 1);
+  auto number = peek(arg_count - 2);
+  if (!obj_helpers::IsArray(array) || !Value::IsNumber(number)) {
+    runtimeError("Expected an array and an index.");
+    return false;
+  }
+  double value = Value::AsNumber(number);
+  auto size = obj_helpers::AsArray(array)->items.size();
+  if (value < 0 || value >= size || value != static_cast<size_t>(value)) {
+    runtimeError("Array index out of range.");
+    return false;
+  }
+  index = static_cast<size_t>(value);
+  return true;
+}
+
+bool VM::freezeNative(uint8_t arg_count) {
+  if (arg_count != 1) {
+    runtimeError("freeze() takes a value.");
+    return false;
+  }
+  if (!freeze(peek(0))) {
+    return false;
+  }
+  auto value = pop();
+  pop();
+  push(value);
+  return true;
+}
+
+bool VM::isFrozenNative(uint8_t arg_count) {
+  if (arg_count != 1) {
+    runtimeError("isFrozen() takes a value.");
+    return false;
+  }
+  bool frozen = obj_helpers::IsFrozen(pop());
+  pop();
+  push(Value::Bool(frozen));
+  return true;
+}
+
+bool VM::channelNative(uint8_t arg_count) {
+  if (arg_count != 0) {
+    runtimeError("channel() takes no arguments.");
+    return false;
+  }
+  pop();
+  push(Value::Object(std::make_shared<ObjChannel>()));
+  return true;
+}
+
+bool VM::sendNative(uint8_t arg_count) {
+  if (arg_count != 2 || !obj_helpers::IsChannel(peek(1))) {
+    runtimeError("send() takes a channel and a value.");
+    return false;
+  }
+  if (!obj_helpers::IsFrozen(peek(0))) {
+    runtimeError("Only frozen values can be sent.");
+    return false;
+  }
+  auto value = pop();
+  obj_helpers::AsChannel(pop())->send(value);
+  pop();
+  push(Value::Nil());
+  return true;
+}
+
+bool VM::receiveNative(uint8_t arg_count) {
+  if (arg_count != 1 || !obj_helpers::IsChannel(peek(0))) {
+    runtimeError("receive() takes a channel.");
+    return false;
+  }
+  auto channel = obj_helpers::AsShared<ObjChannel>(pop());
+  pop();
+  // The sender may be on another thread, so it leaves the value in a slot
+  // and wakes this VM's loop, which hands it to the parked fiber. Other
+  // threads only hold the channel while a task of this VM runs, which is a
+  // wait of its own, so the receive is weak and a VM left with nothing else
+  // to wait on is stuck. A task's receive may be answered by the VM that
+  // submitted it.
+  bool weak = task_globals_ == nullptr;
+  auto value = channel->receive([this, weak] {
+    auto slot = std::make_shared<Value>(Value::Nil());
+    auto [id, complete] = eventLoop().expect(weak);
+    io_waits_.emplace(id, IoWait{fiber_, [slot](EventLoop::Completion &) {
+                                   return std::move(*slot);
+                                 }});
+    return [slot, complete = std::move(complete)](Value value) {
+      *slot = std::move(value);
+      complete();
+    };
+  });
+  if (value) {
+    push(std::move(*value));
+    return true;
+  }
+  return park();
+}
+
+bool VM::freeze(const Value &value) {
+  // Other threads may take a frozen object as soon as it is marked, so the
+  // whole graph is checked before anything is, and a failure changes
+  // nothing.
+  std::vector<Obj *> objects;
+  std::unordered_set<Obj *> seen;
+  std::vector<const Value *> unvisited{&value};
+  while (!unvisited.empty()) {
+    const auto &item = *unvisited.back();
+    unvisited.pop_back();
+    if (obj_helpers::IsFrozen(item) ||
+        !seen.insert(Value::AsObject(item)).second) {
+      continue;
+    }
+    switch (Value::AsObject(item)->type) {
+    case Obj::Type::ARRAY:
+      for (const auto &element : obj_helpers::AsArray(item)->items) {
+        unvisited.push_back(&element);
+      }
+      break;
+    case Obj::Type::INSTANCE: {
+      auto instance = obj_helpers::AsInstance(item);
+      if (!freezeClass(*instance->klass)) {
+        return false;
+      }
+      for (const auto &[name, field] : instance->fields) {
+        unvisited.push_back(&field);
+      }
+      break;
+    }
+    default:
+      runtimeError("Only arrays and instances can be frozen.");
+      return false;
+    }
+    objects.push_back(Value::AsObject(item));
+  }
+  for (auto object : objects) {
+    object->frozen = true;
+  }
+  return true;
+}
+
+bool VM::freezeClass(ObjClass &klass) {
+  if (klass.frozen) {
+    return true;
+  }
+  // Other VMs will call the methods, so they are compiled now and must not
+  // capture variables this VM may still change.
+  std::unordered_set<ObjFunction *> seen;
+  for (const auto &[name, method] : klass.methods) {
+    auto closure = obj_helpers::AsClosure(method);
+    if (closure->upvalue_count != 0) {
+      runtimeError("Cannot freeze an instance whose methods capture "
+                   "variables.");
+      return false;
+    }
+    if (!compileForTasks(closure->function, seen)) {
+      return false;
+    }
+  }
+  klass.code = scripts_;
+  klass.frozen = true;
+  return true;
+}
+
+void VM::finishFiber(ObjFiber &fiber, Value result) {
+  fiber.state = ObjFiber::State::DONE;
+  fiber.result = result;
+  for (auto &joiner : fiber.joiners) {
+    ready_.emplace_back(std::move(joiner), result);
+  }
+  fiber.joiners.clear();
+}
+
+bool VM::park() {
+  // A resumed fiber hands control back as if it yielded nil; one the
+  // scheduler woke lets the next ready fiber run.
+  fiber_->state = ObjFiber::State::WAITING;
+  if (fiber_->resumer != nullptr) {
+    returnToResumer(Value::Nil());
+    return true;
+  }
+  return schedule();
+}
+
+bool VM::schedule() {
+  std::vector<EventLoop::Completion> done;
+  while (ready_.empty()) {
+    if (loop_ == nullptr || loop_->pending() == 0) {
+      runtimeError("Every fiber is waiting and nothing can wake them.");
+      return false;
+    }
+    done.clear();
+    {
+      TaskPool::Blocking blocking;
+      loop_->wait(done);
+    }
+    for (auto &completion : done) {
+      auto wait = std::move(io_waits_.extract(completion.id).mapped());
+      auto value = wait.result ? wait.result(completion) : Value::Nil();
+      if (wait.fiber->frames.empty()) {
+        // A task's stand-in, which has nothing to run.
+        finishFiber(*wait.fiber, value);
+      } else {
+        ready_.emplace_back(std::move(wait.fiber), value);
+      }
+    }
+  }
+  auto [fiber, value] = std::move(ready_.front());
+  ready_.pop_front();
+  fiber->state = ObjFiber::State::RUNNING;
+  fiber_ = std::move(fiber);
+  push(value);
+  return true;
+}
+
+void VM::collectGarbage() {
+  std::vector<Obj *> roots;
+  auto add = [&roots](const Value &value) {
+    if (Value::IsObject(value)) {
+      roots.push_back(Value::AsObject(value));
+    }
+  };
+  for (const auto &[name, value] : globals_) {
+    add(value);
+  }
+  roots.push_back(fiber_.get());
+  for (const auto &importer : importers_) {
+    roots.push_back(importer.get());
+  }
+  for (const auto &[fiber, value] : ready_) {
+    roots.push_back(fiber.get());
+    add(value);
+  }
+  for (const auto &[id, wait] : io_waits_) {
+    roots.push_back(wait.fiber.get());
+  }
+  for (const auto &[function, closure] : frame_closures_) {
+    roots.push_back(closure.get());
+  }
+  heap_.collect(roots);
+}
+
+EventLoop &VM::eventLoop() {
+  if (loop_ == nullptr) {
+    loop_ = std::make_unique<EventLoop>();
+  }
+  return *loop_;
+}
+
+bool VM::compileForTasks(ObjFunction *function,
+                         std::unordered_set<ObjFunction *> &seen) {
+  if (!seen.insert(function).second) {
+    return true;
+  }
+  if (!ensureCompiled(function)) {
+    return false;
+  }
+  for (const auto &constant : function->chunk->constants) {
+    if (obj_helpers::IsFunction(constant) &&
+        !compileForTasks(obj_helpers::AsFunction(constant), seen)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool VM::prepareTask(const Value &callee, Task &task) {
+  if (!obj_helpers::IsClosure(callee) ||
+      obj_helpers::AsClosure(callee)->upvalue_count != 0) {
+    runtimeError("Tasks can only run functions that capture no variables.");
+    return false;
+  }
+  // Workers only read the functions, so everything they can reach is
+  // compiled here first. The pointers do not own them: the destructor
+  // waits for the tasks instead.
+  std::unordered_set<ObjFunction *> seen;
+  auto function = obj_helpers::AsClosure(callee)->function;
+  if (!compileForTasks(function, seen)) {
+    return false;
+  }
+  task.function =
+      std::shared_ptr<ObjFunction>(std::shared_ptr<Obj>(), function);
+
+  auto globals = std::make_shared<TaskGlobals>();
+  for (const auto &[name, value] : globals_) {
+    if (!obj_helpers::IsClosure(value) ||
+        obj_helpers::AsClosure(value)->upvalue_count != 0) {
+      continue;
+    }
+    auto global = obj_helpers::AsClosure(value)->function;
+    if (!compileForTasks(global, seen)) {
+      return false;
+    }
+    globals->emplace_back(
+        name, std::shared_ptr<ObjFunction>(std::shared_ptr<Obj>(), global));
+  }
+  if (sent_globals_ == nullptr || *sent_globals_ != *globals) {
+    sent_globals_ = std::move(globals);
+  }
+  task.globals = sent_globals_;
+  return true;
+}
+
+void VM::submitTask(std::shared_ptr<Task> task) {
+  if (tasks_ == nullptr) {
+    tasks_ = std::make_shared<TaskGroup>();
+  }
+  tasks_->add();
+  task->done = [done = std::move(task->done), tasks = tasks_] {
+    done();
+    tasks->finish();
+  };
+  TaskPool::instance().submit(std::move(task));
+}
+
+Value VM::taskResult(const Task &task) {
+  if (!task.ok) {
+    err_ << task.error;
+    return Value::Nil();
+  }
+  return fromPortable(task.result);
+}
+
+void VM::returnToResumer(Value value) {
+  // Dropping the fiber here frees it if nothing else can resume it.
+  auto resumer = std::move(fiber_->resumer);
+  fiber_ = std::move(resumer);
+  push(value);
+}
+
 bool VM::bindMethod(ObjClass *klass, const std::string &name) {
   if (!klass->methods.contains(name)) {
     runtimeError("Undefined property '" + name + "'.");
     return false;
   }
-  auto method = klass->methods[name];
+  auto method = klass->methods.at(name);
 
   auto bound_method =
-      std::make_shared<ObjBoundMethod>(peek(0), obj_helpers::AsClosure(method));
+      heap_.make<ObjBoundMethod>(peek(0), obj_helpers::AsClosure(method));
 
   pop();
   push(Value::Object(bound_method));
@@ -1,13 +1,23 @@
 #pragma once
 
 #include "chunk.h"
+#include "compiler.h"
+#include "event_loop.h"
+#include "gc.h"
+#include "intern.h"
 #include "object.h"
+#include "program.h"
+#include "task_pool.h"
 #include "value.h"
 #include <cstddef>
-#include <forward_list>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
 #include <memory>
 #include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 enum class InterpretResult {
@@ -16,12 +26,6 @@ enum class InterpretResult {
   InterpretRuntimeError,
 };
 
-struct CallFrame {
-  ObjClosure *closure;
-  int code_idx;
-  size_t value_idx;
-};
-
 class VM {
 public:
   static constexpr int FRAMES_MAX = 64;
@@ -29,16 +33,75 @@ public:
       FRAMES_MAX * 256; // 8 bits can represent 256 values
   static constexpr const char *initName = "init";
 
+  // Everything a VM creates stays inside it: strings are interned in its
+  // own table and output goes to its own sinks, so VMs on different threads
+  // share nothing mutable. Frozen values are the exception; they go between
+  // VMs through channels and tasks.
+  explicit VM(CompilerOptions options = {}, std::ostream &out = std::cout,
+              std::ostream &err = std::cerr);
+  // Waits for the tasks this VM submitted, which may still be reading its
+  // functions, then frees the cycles left among its objects.
+  ~VM();
+
   InterpretResult interpret(const std::string &source);
+  // Runs an already compiled script, e.g. one loaded from a .loxc file.
+  // Its imports resolve against `directory`, or the working directory.
+  InterpretResult interpret(std::shared_ptr<ObjFunction> function,
+                            std::filesystem::path directory = {});
+  // Runs a program other VMs may be running too; it was verified once
+  // already, and this VM keeps it alive for as long as its functions are.
+  InterpretResult interpret(const std::shared_ptr<const Program> &program);
+  // Runs a task submitted by another VM; see TaskPool.
+  void runTask(Task &task);
 
 private:
+  CompilerOptions compiler_options_;
+  std::ostream &out_;
+  std::ostream &err_;
+  InternTable strings_;
+  // Tracks the objects this VM makes, to free the cycles among them.
+  Heap heap_;
   std::unordered_map<std::string, Value> globals_;
+  // Every script run so far. Closures do not own their functions, so a
+  // function defined by one script has to outlive it for later ones.
+  // Frozen classes share the list to keep their methods alive.
+  std::shared_ptr<std::vector<std::shared_ptr<ObjFunction>>> scripts_ =
+      std::make_shared<std::vector<std::shared_ptr<ObjFunction>>>();
+  // Canonical paths of the modules this VM has run.
+  std::unordered_set<std::string> imported_;
+  // Where the running module's relative imports resolve.
+  std::filesystem::path directory_;
 
-  std::vector<Value> stack_;
-  std::vector<CallFrame> frames_;
-  std::forward_list<std::shared_ptr<ObjUpvalue>> openUpvalues_;
+  // The running fiber; its stack and frames are the VM's.
+  std::shared_ptr<ObjFiber> fiber_;
+  // Fibers of the scripts and modules waiting on a module's import.
+  std::vector<std::shared_ptr<ObjFiber>> importers_;
+  // The fiber running the current script or module. run() returns when it
+  // finishes.
+  ObjFiber *root_ = nullptr;
+  // Parked fibers whose wait is over, with the value their call returns.
+  std::deque<std::pair<std::shared_ptr<ObjFiber>, Value>> ready_;
+  struct IoWait {
+    std::shared_ptr<ObjFiber> fiber;
+    // Makes the value the fiber's call returns; nil when null.
+    std::function<Value(EventLoop::Completion &)> result;
+  };
+  std::unordered_map<uint64_t, IoWait> io_waits_;
+  // Made on the first I/O native, so VMs that never wait hold no fds.
+  std::unique_ptr<EventLoop> loop_;
+  // Tasks submitted and not yet finished.
+  std::shared_ptr<TaskGroup> tasks_;
+  // The last globals sent with a task, reused while they stay the same.
+  std::shared_ptr<const TaskGlobals> sent_globals_;
+  // On a worker, the globals of the last task run.
+  std::shared_ptr<const TaskGlobals> task_globals_;
+  // Last closure made from each non-escaping function, for frameClosure.
+  std::unordered_map<ObjFunction *, std::shared_ptr<ObjClosure>>
+      frame_closures_;
 
   InterpretResult run();
+  InterpretResult runScript(std::shared_ptr<ObjFunction> function,
+                            std::filesystem::path directory);
 
   Value pop();
   void push(Value value);
@@ -46,16 +109,63 @@ private:
   void printStack();
   void resetStack();
   bool callValue(Value callee, uint8_t arg_count);
+  InterpretResult importModule(const std::string &name);
   bool call(ObjClosure *closure, uint8_t arg_count);
+  // The checks call() makes before pushing a frame: arity and compiling a
+  // lazy body. Errors trace the current fiber.
+  bool checkCall(ObjClosure *closure, uint8_t arg_count);
+  bool ensureCompiled(ObjFunction *function);
 
   void runtimeError(const std::string &message);
+  void defineNatives();
   void defineNative(const std::string &name, NativeFunction function);
-  std::shared_ptr<ObjUpvalue> captureUpvalue(uint8_t index);
-  void closeUpvalues(uint8_t last_idx);
+  void defineNative(const std::string &name, VMFunction function);
+  // Opens an upvalue on the slot, or returns the one already open there.
+  // `reuse`, if given, is repointed instead of allocating.
+  std::shared_ptr<ObjUpvalue>
+  captureUpvalue(size_t index, std::shared_ptr<ObjUpvalue> reuse = nullptr);
+  std::shared_ptr<ObjClosure> frameClosure(ObjFunction *function);
+  void frameUpvalue(std::shared_ptr<ObjUpvalue> &upvalue, size_t index);
+  void closeUpvalues(size_t last_idx);
   bool bindMethod(ObjClass *klass, const std::string &name);
   bool invoke(const std::string &name, uint8_t arg_count);
   bool invokeFromClass(ObjClass *klass, const std::string &name,
                        uint8_t arg_count);
 
+  bool spawnNative(uint8_t arg_count);
+  bool resumeNative(uint8_t arg_count);
+  bool yieldNative(uint8_t arg_count);
+  bool doneNative(uint8_t arg_count);
+  bool joinNative(uint8_t arg_count);
+  bool sleepNative(uint8_t arg_count);
+  bool readFileNative(uint8_t arg_count);
+  bool spawnTaskNative(uint8_t arg_count);
+  bool parallelMapNative(uint8_t arg_count);
+  bool arrayNative(uint8_t arg_count);
+  bool pushNative(uint8_t arg_count);
+  bool getNative(uint8_t arg_count);
+  bool setNative(uint8_t arg_count);
+  bool lengthNative(uint8_t arg_count);
+  bool arrayIndex(uint8_t arg_count, size_t &index);
+  bool freezeNative(uint8_t arg_count);
+  bool isFrozenNative(uint8_t arg_count);
+  bool channelNative(uint8_t arg_count);
+  bool sendNative(uint8_t arg_count);
+  bool receiveNative(uint8_t arg_count);
+  bool freeze(const Value &value);
+  bool freezeClass(ObjClass &klass);
+  void returnToResumer(Value value);
+  void finishFiber(ObjFiber &fiber, Value result);
+  bool park();
+  bool schedule();
+  EventLoop &eventLoop();
+  void collectGarbage();
+  bool compileForTasks(ObjFunction *function,
+                       std::unordered_set<ObjFunction *> &seen);
+  bool prepareTask(const Value &callee, Task &task);
+  void submitTask(std::shared_ptr<Task> task);
+  Value taskResult(const Task &task);
+
   static bool isFalsey(const Value &value);
+  static bool isMethod(const Value &receiver, ObjFunction *function);
 };